@@ -13,6 +13,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "8089.h"
 
@@ -33,6 +35,52 @@ static const enum i89_regs pppregs[8] = { GA, GB, GC, BAD_REG, TP, BAD_REG, BAD_
 #define I89_HAVE_PRINT
 #define I89_HAVE_CHECK
 
+/*
+ * Static tracepoints for perf, bpftrace and friends. Each is a single
+ * nop until something attaches to it.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define I89_HAVE_SDT
+#endif
+#endif
+
+#if defined(I89_HAVE_SDT)
+#include <sys/sdt.h>
+#define PROBE1(n,a)		DTRACE_PROBE1(lib8089, n, a)
+#define PROBE3(n,a,b,c)		DTRACE_PROBE3(lib8089, n, a, b, c)
+#define PROBE4(n,a,b,c,d)	DTRACE_PROBE4(lib8089, n, a, b, c, d)
+#else
+/* The arguments are evaluated, so that they don't end up unused. */
+#define PROBE1(n,a)		do { (void)(a); } while (0)
+#define PROBE3(n,a,b,c)		do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(n,a,b,c,d)	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+/*
+ * Approximate instruction timings in clocks, after the 8089 data sheet,
+ * for a 16-bit bus without wait states. The effective address
+ * calculation is included with the most common (offset) mode.
+ */
+
+static const uint8_t clocks[64] = {
+	[ 0] =  4,	[ 2] = 12,	[ 8] =  3,	[ 9] =  3,
+	[10] =  3,	[11] =  2,	[12] =  3,	[14] =  2,
+	[15] =  2,	[16] =  5,	[17] =  5,	[18] = 11,
+	[19] = 12,	[32] = 10,	[33] = 10,	[34] = 20,
+	[35] = 19,	[36] =  8,	[37] = 14,	[38] = 16,
+	[39] = 17,	[40] = 10,	[41] = 10,	[42] = 10,
+	[43] = 10,	[44] = 14,	[45] = 14,	[46] = 14,
+	[47] = 14,	[48] = 16,	[49] = 16,	[50] = 16,
+	[51] = 10,	[52] = 16,	[53] = 16,	[54] = 16,
+	[55] = 16,	[56] = 12,	[57] = 12,	[58] = 16,
+	[59] = 16,	[61] = 16,	[62] = 16,
+};
+
+/* One DMA transfer cycle: a fetch and a store bus cycle. */
+#define DMA_CLOCKS 8
+
 #if defined(I89_HAVE_CHECK) || defined(I89_HAVE_PRINT)
 
 /*
@@ -275,458 +323,2837 @@ print (uint16_t insn, int8_t offset, uint32_t value, uint8_t sdisp)
 #endif /* !I89_HAVE_PRINT */
 
 /*
- * Memory access.
+ * Translation cache.
+ *
+ * Code in pages mapped with i89_map() is decoded once into blocks that
+ * end at the first control transfer; executing the block then skips the
+ * fetch and decode. Blocks are chained to their successors so that
+ * loops don't even need a lookup. Writes to a page holding translated
+ * code go through the slow path below, which drops the translations.
+ *
+ * Blocks remember the host page they come from, and are only used where
+ * that page is still mapped. A cache is not locked, so each IOP has one
+ * of its own; but blocks translated from a read-only image never change,
+ * and a cache of them can be frozen and looked into by any number of
+ * IOPs, on any thread, see i89_image_share(). Nothing in a frozen cache
+ * is written to: blocks are not chained to it, and whether they have
+ * been verified is worked out each time.
  */
 
-static uint32_t
-in8 (struct i89 *iop, uint32_t addr, int tag)
+#define TB_INSNS	16
+#define TB_HASH		1024
+#define TB_NONE		0xffffffff
+
+struct di {
+	int (*fn)(struct i89 *iop, int ch, const struct di *di);
+	uint16_t insn;
+	uint16_t insn2;		/* Store part of mov m,m */
+	int8_t disp;
+	int8_t disp2;
+	uint8_t len;
+	uint32_t value;
+};
+
+struct tb {
+	uint32_t addr;
+	uint32_t end;
+	const uint8_t *src;	/* Host page translated from */
+	int n;
+	int verified;		/* All instructions verified */
+	struct tb *next[2];	/* Fall-through and taken successors */
+	struct di di[TB_INSNS];
+};
+
+struct i89_tc {
+	struct tb tb[TB_HASH];
+	const struct i89_tc *shared;	/* Frozen blocks to look into */
+};
+
+/*
+ * Undo journal.
+ *
+ * Before each instruction, each transfer cycle and each channel
+ * attention, the state of the channel is saved in a ring of steps; memory
+ * writes save the bytes they overwrite in a ring of their own. Stepping
+ * back puts both back. Nothing is mapped for writes while the journal is
+ * on, so that all writes take the slow path, which keeps the journal. The
+ * translation cache is not used either, and every step copies all the
+ * registers of the channel: a journaled run is about a third slower than
+ * the interpreter, and several times slower than with the translation
+ * cache, see tests/bench. Writes to the I/O space and to memory that is
+ * not mapped can't be undone, and neither can what went out of the IOP:
+ * SINTRs, events, and blocks posted to a ring.
+ */
+
+enum undo_kind {
+	UNDO_INSN,
+	UNDO_XFER,
+	UNDO_POLL,
+	UNDO_ATTN,
+};
+
+struct undo_step {
+	uint32_t regs[NUM_REGS];
+	uint64_t cycles;
+	uint64_t park_until;
+	uint32_t poll_tp;
+	uint32_t poll_clk;
+	uint16_t poll[I89_POLL_PORTS];
+	uint8_t npoll;
+	uint32_t mem;		/* First memory entry of the step */
+	uint16_t tags;
+	uint8_t ch;
+	uint8_t kind;
+	unsigned wid:2;
+	unsigned xfer:1;
+	unsigned dma:1;
+	unsigned eop:1;
+	unsigned park:1;
+	unsigned halt:1;
+	unsigned is:1;
+	unsigned nointr:1;
+	unsigned prio:1;
+	unsigned blimit:1;
+	unsigned ccb:1;
+
+	/* Suspended context, only kept for an attention. */
+	uint32_t susp_regs[NUM_REGS];
+	uint16_t susp_tags;
+	unsigned susp_xfer:1;
+	unsigned susp_dma:1;
+	unsigned susp_valid:1;
+};
+
+struct undo_mem {
+	uint32_t addr;
+	uint8_t old;
+};
+
+struct i89_undo {
+	struct undo_step *step;
+	unsigned nstep, head, tail;
+	struct undo_mem *mem;
+	unsigned nmem, mhead, mtail;
+};
+
+/*
+ * Verified code: a bit for each address in the memory space that an
+ * instruction that passed the checks starts at, per page of host memory
+ * it was in. The pages get I89_PAGE_CODE, so that a write forgets them.
+ */
+
+struct i89_verify {
+	uint8_t *bits[I89_PAGES];
+	const uint8_t *src[I89_PAGES];
+};
+
+#define PAGE(a)		(((a) >> I89_PAGE_SHIFT) % I89_PAGES)
+#define PAGE_OFF(a)	((a) & (I89_PAGE_SIZE - 1))
+
+static void
+remap (struct i89 *iop, unsigned page)
 {
-	if (tag)
-		return iop->in8 (iop, addr);
-	else
-		return iop->read8 (iop, addr);
+	iop->rmap[page] = iop->pflags[page] & I89_PAGE_RWATCH ? NULL : iop->map[page];
+	iop->wmap[page] = iop->pflags[page] || iop->undo ? NULL : iop->map[page];
 }
 
-static uint32_t
-in16 (struct i89 *iop, uint32_t addr, int tag)
+/* Forget blocks translated from the given page of host memory. */
+static void
+drop (struct i89_tc *tc, unsigned page, const uint8_t *src)
 {
-	if (tag) {
-		if (iop->in16)
-			return iop->in16 (iop, addr);
-		return iop->in8 (iop, addr) | (iop->in8 (iop, addr + 1) << 8);
-	} else {
-		if (iop->read16)
-			return iop->read16 (iop, addr);
-		return iop->read8 (iop, addr) | (iop->read8 (iop, addr + 1) << 8);
+	int i;
+
+	for (i = 0; i < TB_HASH; i++) {
+		if (tc->tb[i].addr != TB_NONE && PAGE(tc->tb[i].addr) == page &&
+		    tc->tb[i].src == src)
+			tc->tb[i].addr = TB_NONE;
 	}
 }
 
-static uint32_t
-in (struct i89 *iop, uint32_t addr, int tag, unsigned wide)
+static void
+invalidate (struct i89 *iop, unsigned page)
 {
-	addr &= tag ? 0xffff : 0xfffff;
-	if (wide == 0)
-		return in8 (iop, addr, tag);
-	if (addr % 2)
-		return in8 (iop, addr, tag) | (in (iop, addr + 1, tag, wide - 1) << 8);
-	if (wide == 1)
-		return in16 (iop, addr, tag);
-	return in16 (iop, addr, tag) | (in (iop, addr + 2, tag, wide - 2) << 16);
+	iop->pflags[page] &= ~I89_PAGE_CODE;
+	remap (iop, page);
+
+	/* Read-only pages don't change; a write ends up elsewhere. */
+	if (iop->pflags[page] & I89_PAGE_RO)
+		return;
+	if (iop->tc)
+		drop (iop->tc, page, iop->map[page]);
+	if (iop->verify && iop->verify->bits[page])
+		memset (iop->verify->bits[page], 0, I89_PAGE_SIZE / 8);
 }
 
-static void
-out8 (struct i89 *iop, uint32_t addr, uint8_t value, int tag)
+void
+i89_invalidate (struct i89 *iop, uint32_t addr, uint32_t len)
 {
-	if (tag)
-		iop->out8 (iop, addr, value);
-	else
-		iop->write8 (iop, addr, value);
+	unsigned page;
+
+	if (len == 0)
+		return;
+	for (page = PAGE(addr); page <= PAGE(addr + len - 1); page++) {
+		if (iop->pflags[page] & I89_PAGE_CODE)
+			invalidate (iop, page);
+	}
 }
 
-static void
-out16 (struct i89 *iop, uint32_t addr, uint16_t value, int tag)
+/* Whether the instruction at addr in the memory space has been verified. */
+static inline int
+verified (struct i89 *iop, uint32_t addr)
 {
-	if (tag) {
-		if (iop->out16) {
-			iop->out16 (iop, addr, value);
-		} else {
-			iop->out8 (iop, addr, value);
-			iop->out8 (iop, addr + 1, value >> 8);
-		}
-	} else {
-		if (iop->write16) {
-			iop->write16 (iop, addr, value);
-			return;
-		} else {
-			iop->write8 (iop, addr, value);
-			iop->write8 (iop, addr + 1, value >> 8);
-		}
-	}
+	struct i89_verify *v = iop->verify;
+	unsigned page = PAGE(addr);
+
+	if (v == NULL || addr > 0xfffff || v->bits[page] == NULL ||
+	    v->src[page] != iop->map[page])
+		return 0;
+	return (v->bits[page][PAGE_OFF(addr) / 8] >> (addr % 8)) & 1;
 }
 
-static void
-out (struct i89 *iop, uint32_t addr, uint32_t value, int tag, unsigned wide)
+/* Note that the instruction from addr up to end is good. */
+static int
+verified_mark (struct i89 *iop, uint32_t addr, uint32_t end)
 {
-	addr &= tag ? 0xffff : 0xfffff;
-	if (wide == 0) {
-		out8 (iop, addr, value, tag);
-		return;
+	struct i89_verify *v = iop->verify;
+	unsigned page = PAGE(addr);
+
+	/* Only what is in one page of host memory. */
+	if (addr > 0xfffff || end > 0x100000 || PAGE(end - 1) != page ||
+	    iop->map[page] == NULL)
+		return 0;
+
+	if (v->bits[page] == NULL) {
+		v->bits[page] = calloc (1, I89_PAGE_SIZE / 8);
+		if (v->bits[page] == NULL)
+			return -1;
+	} else if (v->src[page] != iop->map[page]) {
+		memset (v->bits[page], 0, I89_PAGE_SIZE / 8);
 	}
-	if ((addr % 2) || !out16) {
-		out8 (iop, addr, value, tag);
-		out (iop, addr + 1, value >> 8, tag, wide - 1);
-		return;
+	v->src[page] = iop->map[page];
+	v->bits[page][PAGE_OFF(addr) / 8] |= 1 << (addr % 8);
+
+	if (!(iop->pflags[page] & I89_PAGE_CODE)) {
+		iop->pflags[page] |= I89_PAGE_CODE;
+		remap (iop, page);
 	}
-	if (wide == 1) {
-		out16 (iop, addr, value, tag);
+	return 0;
+}
+
+static void
+map (struct i89 *iop, uint32_t addr, uint32_t len, uint8_t *host, int ro)
+{
+	unsigned page;
+
+	if (len == 0)
 		return;
+	i89_invalidate (iop, addr, len);
+	for (page = PAGE(addr); page <= PAGE(addr + len - 1); page++) {
+		iop->map[page] = host;
+		if (ro)
+			iop->pflags[page] |= I89_PAGE_RO;
+		else
+			iop->pflags[page] &= ~I89_PAGE_RO;
+		remap (iop, page);
+		if (host)
+			host += I89_PAGE_SIZE;
 	}
-	out16 (iop, addr, value, tag);
-	out (iop, addr + 2, value >> 16, tag, wide - 2);
+}
+
+void
+i89_map (struct i89 *iop, uint32_t addr, uint32_t len, uint8_t *host)
+{
+	map (iop, addr, len, host, 0);
 }
 
 /*
- * Helper macros.
+ * Map pages for reading only. Writes to them go to the write callbacks,
+ * which may give the IOP a private copy.
  */
 
-#define CHAN	(iop->chan[ch])
-#define TAG(r)	((CHAN.tags >> (r)) & 1)
-#define MASK(b)	((CHAN.regs[MC] ^ (b)) & (CHAN.regs[MC] >> 8) & 0xff)
-#define preg	CHAN.regs[mmregs[mm]]
+void
+i89_map_ro (struct i89 *iop, uint32_t addr, uint32_t len, uint8_t *host)
+{
+	map (iop, addr, len, host, 1);
+}
 
 /*
- * Memory access macros.
+ * A translation cache is not locked: IOPs that run on threads of their
+ * own can't share one.
  */
 
-#define rd	in(iop, preg+offset, TAG(mmregs[mm]), w)
-#define rd20	in(iop, preg+offset, TAG(mmregs[mm]), 2)
-#define rd32	in(iop, preg+offset, TAG(mmregs[mm]), 3)
-#define wr(v)	out(iop, preg+offset, v, TAG(mmregs[mm]), w)
-#define wr20(v)	out(iop, preg+offset, v, TAG(mmregs[mm]), 2)
+struct i89_tc *
+i89_tc_new (void)
+{
+	struct i89_tc *tc;
+	int i;
+
+	tc = malloc (sizeof(*tc));
+	if (tc == NULL)
+		return NULL;
+	for (i = 0; i < TB_HASH; i++)
+		tc->tb[i].addr = TB_NONE;
+	tc->shared = NULL;
+
+	return tc;
+}
 
 /*
- * DMA.
+ * Freeze the cache, keeping only the blocks that were translated from
+ * the pages given, which must never change; then let another cache look
+ * into it.
  */
 
-static int
-dma (struct i89 *iop, int ch)
+void
+i89_tc_freeze (struct i89_tc *tc, uint8_t *const pages[I89_PAGES])
 {
-	uint16_t cc = CHAN.regs[CC];
-	int gs_inc = !!(cc & 0x4000);
-	int gd_inc = !!(cc & 0x8000);
-	int wid = CHAN.wid;
-	uint8_t masked = 0;
-	int src, dst;
-	uint16_t val;
-	int term;
+	struct tb *tb;
 
-	/* S */
-	if (cc & 0x0400) {
-		src = GB;
-		dst = GA;
-	} else {
-		src = GA;
-		dst = GB;
+	for (tb = tc->tb; tb < tc->tb + TB_HASH; tb++) {
+		if (tb->addr != TB_NONE && tb->src != pages[PAGE(tb->addr)])
+			tb->addr = TB_NONE;
+		tb->verified = 0;
 	}
+	tc->shared = NULL;
+}
 
-	//printf ("\n");
-	//printf ("========== XFER =======\n");
-	//printf ("%s->", gs_inc ? "(GS)+" : "GS");
-	//printf ("%s ", gd_inc ? "(GD)+" : "GD");
-	//printf ("src=%s dst=%s ", regn[src], regn[dst]);
-	//printf ("\n");
-	//printf ("tbc=TP+%d\n", tp_add);
+void
+i89_tc_share (struct i89_tc *tc, const struct i89_tc *frozen)
+{
+	tc->shared = frozen;
+}
 
-	/* TR: translate not supported */
-	if (cc & 0x2000) {
-		fprintf (stderr, "tx unimpl\n");
-		return -1;
-	}
+void
+i89_tc_free (struct i89_tc *tc)
+{
+	free (tc);
+}
 
-	while (1) {
-		/* TX External Terminate */
-		if (cc & 0x0060) {
-			if (!CHAN.xfer) {
-				term = cc >> 5;
-				break;
-			}
-		}
+/*
+ * Breakpoints and watchpoints.
+ *
+ * Each kind has a bitmap per page, allocated when something in the page
+ * is watched. A page with watches gets a flag that takes its accesses off
+ * the fast path, so that only they pay for the bitmap lookup; pages with
+ * breakpoints are left to the interpreter, which checks TP before each
+ * instruction there. Hits are noted in iop->hit and the channel stops
+ * once the instruction that caused them is done.
+ */
 
-		/* TBC Byte Counte Termination*/
-		if (cc & 0x0018) {
-			if (CHAN.regs[BC] == 0) {
-				term = cc >> 7;
-				break;
-			}
-			if (CHAN.regs[BC] == 1)
-				wid = 0;
-		}
+#define IO_PAGES	(0x10000 >> I89_PAGE_SHIFT)
 
-		switch (wid) {
-		case 0:
-			/* wid 8,8 */
-			val = in8 (iop, CHAN.regs[src], TAG(src));
-			masked = !MASK(val);
-			CHAN.regs[src] += gs_inc;
-			out8 (iop, CHAN.regs[dst], val, TAG(dst));
-			CHAN.regs[dst] += gd_inc;
-			CHAN.regs[BC]--;
-			break;
-		case 1:
-			/* wid 8,16 */
-			val = in8 (iop, CHAN.regs[src], TAG(src));
-			masked = !MASK(val);
-			CHAN.regs[src] += gs_inc;
-			val |= in8 (iop, CHAN.regs[src], TAG(src)) << 8;
-			masked |= !MASK(val >> 8);
-			CHAN.regs[src] += gs_inc;
-			out16 (iop, CHAN.regs[dst], val, TAG(dst));
-			CHAN.regs[dst] += 2 * gd_inc;
-			CHAN.regs[BC] -= 2;
-			break;
-		case 2:
-			/* wid 16,8 */
-			val = in16 (iop, CHAN.regs[src], TAG(src));
-			masked = !MASK(val);
-			masked |= !MASK(val >> 8);
-			CHAN.regs[src] += 2 * gs_inc;
-			out8 (iop, CHAN.regs[dst], val, TAG(dst));
-			CHAN.regs[dst] += gd_inc;
-			out8 (iop, CHAN.regs[dst], val >> 8, TAG(dst));
-			CHAN.regs[dst] += gd_inc;
-			CHAN.regs[BC] -= 2;
-			break;
-		case 3:
-			/* wid 16,16 */
-			val = in16 (iop, CHAN.regs[src], TAG(src));
-			masked = !MASK(val);
-			masked |= !MASK(val >> 8);
-			CHAN.regs[src] += 2 * gs_inc;
-			out16 (iop, CHAN.regs[dst], val, TAG(dst));
-			CHAN.regs[dst] += 2 * gd_inc;
-			CHAN.regs[BC] -= 2;
-			break;
-		}
+struct i89_watch {
+	uint8_t *exec[I89_PAGES];
+	uint8_t *rd[I89_PAGES];
+	uint8_t *wr[I89_PAGES];
+	uint8_t *iord[IO_PAGES];
+	uint8_t *iowr[IO_PAGES];
 
-#if 0
-		if ((cc & 0x0007) != 0x0006) {
-			/* TSH: Mask/compare termination */
-			if (masked != !(cc & 0x0600)) {
-				term = cc & 0x0003;
-				break;
-			}
-		}
-#endif
+	/* TP of the breakpoint each channel last stopped at, plus one. */
+	uint32_t resume[2];
+};
 
-		if (cc & 0x0080) {
-			/* TS: Single Transfer mode. */
-			term = 0;
-			break;
-		}
+static uint8_t **
+bitmap (struct i89_watch *wp, enum i89_watch_kind kind, uint32_t addr)
+{
+	if (kind & I89_WATCH_IO) {
+		addr = (addr & 0xffff) >> I89_PAGE_SHIFT;
+		return kind & I89_WATCH_READ ? &wp->iord[addr] : &wp->iowr[addr];
 	}
 
-	CHAN.xfer = 0;
-
-	switch (term & 3) {
-	case 3: CHAN.regs[TP] += 4;
-	case 2: CHAN.regs[TP] += 4;
+	switch (kind) {
+	case I89_WATCH_EXEC:
+		return &wp->exec[PAGE(addr)];
+	case I89_WATCH_READ:
+		return &wp->rd[PAGE(addr)];
+	default:
+		return &wp->wr[PAGE(addr)];
 	}
-
-	return 0;
 }
 
-/*
- * Various common instruction operations.
- */
+static void
+watched (struct i89 *iop, const uint8_t *bits, enum i89_watch_kind kind, uint32_t addr)
+{
+	uint32_t off = PAGE_OFF(addr);
 
-#define FETCH	(in(iop, CHAN.regs[TP]++, 0, 0))
-#define FETCH16	(in(iop, (CHAN.regs[TP]+=2)-2, 0, 1))
-#define JUMP	(CHAN.regs[TP] += (int16_t)value)
-#define REG	(CHAN.regs[rrr])
-#define BIT	(1 << bbb)
-#define TAG_IO	(CHAN.tags |= (1 << rrr))
+	/* Only the first hit is reported. */
+	if (bits == NULL || !(bits[off / 8] & (1 << (off % 8))) || iop->hit.kind)
+		return;
+	if (iop->stop && !iop->stop (iop, kind, addr))
+		return;
+	iop->hit.kind = kind;
+	iop->hit.addr = addr;
+}
+
+static void
+watch_io (struct i89 *iop, enum i89_watch_kind kind, uint16_t addr, int len)
+{
+	while (len--) {
+		watched (iop, *bitmap (iop->watch, kind, addr), kind, addr);
+		addr++;
+	}
+}
+
+/* Recompute the flags of a page after its watches changed. */
+static void
+reflag (struct i89 *iop, unsigned page)
+{
+	struct i89_watch *wp = iop->watch;
+	uint8_t flags = iop->pflags[page];
+
+	flags &= ~(I89_PAGE_RWATCH | I89_PAGE_WWATCH | I89_PAGE_BREAK);
+	if (wp->rd[page])
+		flags |= I89_PAGE_RWATCH;
+	if (wp->wr[page])
+		flags |= I89_PAGE_WWATCH;
+	if (wp->exec[page])
+		flags |= I89_PAGE_BREAK;
+
+	iop->pflags[page] = flags;
+	remap (iop, page);
+}
+
+static int
+watch (struct i89 *iop, enum i89_watch_kind kind, uint32_t addr, uint32_t len, int set)
+{
+	uint8_t **bits;
+	uint32_t a, off;
+	int i;
+
+	for (a = addr; a - addr < len; a++) {
+		bits = bitmap (iop->watch, kind, a);
+		off = PAGE_OFF(a);
+		if (*bits == NULL) {
+			if (!set)
+				continue;
+			*bits = calloc (1, I89_PAGE_SIZE / 8);
+			if (*bits == NULL)
+				return -1;
+		}
+		if (set) {
+			(*bits)[off / 8] |= 1 << (off % 8);
+		} else {
+			(*bits)[off / 8] &= ~(1 << (off % 8));
+			for (i = 0; i < I89_PAGE_SIZE / 8 && !(*bits)[i]; i++)
+				;
+			if (i == I89_PAGE_SIZE / 8) {
+				free (*bits);
+				*bits = NULL;
+			}
+		}
+		if (!(kind & I89_WATCH_IO) && (PAGE_OFF(a + 1) == 0 || a - addr == len - 1))
+			reflag (iop, PAGE(a));
+	}
+
+	return 0;
+}
+
+/*
+ * Stop when the given range of memory (or I/O space, with I89_WATCH_IO)
+ * is executed, read or written, as selected by the kind bits. A
+ * breakpoint is a one byte I89_WATCH_EXEC watch on the first byte of an
+ * instruction. Returns -1 if out of memory.
+ */
+
+int
+i89_watch (struct i89 *iop, enum i89_watch_kind kind, uint32_t addr, uint32_t len)
+{
+	int bit;
+
+	if (iop->watch == NULL) {
+		iop->watch = calloc (1, sizeof(*iop->watch));
+		if (iop->watch == NULL)
+			return -1;
+	}
+
+	for (bit = I89_WATCH_EXEC; bit <= I89_WATCH_WRITE; bit <<= 1) {
+		if ((kind & bit) && watch (iop, bit | (kind & I89_WATCH_IO), addr, len, 1) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+void
+i89_unwatch (struct i89 *iop, enum i89_watch_kind kind, uint32_t addr, uint32_t len)
+{
+	int bit;
+
+	if (iop->watch == NULL)
+		return;
+
+	for (bit = I89_WATCH_EXEC; bit <= I89_WATCH_WRITE; bit <<= 1) {
+		if (kind & bit)
+			watch (iop, bit | (kind & I89_WATCH_IO), addr, len, 0);
+	}
+}
+
+/* Remove all watches. */
+void
+i89_watch_free (struct i89 *iop)
+{
+	struct i89_watch *wp = iop->watch;
+	unsigned page;
+
+	if (wp == NULL)
+		return;
+
+	for (page = 0; page < I89_PAGES; page++) {
+		free (wp->exec[page]);
+		free (wp->rd[page]);
+		free (wp->wr[page]);
+		wp->exec[page] = wp->rd[page] = wp->wr[page] = NULL;
+		reflag (iop, page);
+	}
+	for (page = 0; page < IO_PAGES; page++) {
+		free (wp->iord[page]);
+		free (wp->iowr[page]);
+	}
+
+	free (wp);
+	iop->watch = NULL;
+}
+
+/*
+ * Have fn called by i89_reset() on the IOP. Modules that attach things
+ * to an IOP register one each, to put back what belongs to them; see
+ * i89_reset(). Registering the same function twice is a no-op. Returns
+ * -1 if there's no room left, which can't happen with the modules of
+ * the library alone.
+ */
+
+int
+i89_keep (struct i89 *iop, void (*fn)(struct i89 *iop, const struct i89 *own))
+{
+	int i;
+
+	for (i = 0; i < I89_KEEP; i++) {
+		if (iop->keep[i] == fn)
+			return 0;
+		if (iop->keep[i] == NULL) {
+			iop->keep[i] = fn;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void
+i89_unkeep (struct i89 *iop, void (*fn)(struct i89 *iop, const struct i89 *own))
+{
+	int i;
+
+	for (i = 0; i < I89_KEEP; i++) {
+		if (iop->keep[i] == fn)
+			break;
+	}
+	for (; i < I89_KEEP; i++)
+		iop->keep[i] = i + 1 < I89_KEEP ? iop->keep[i + 1] : NULL;
+}
+
+/*
+ * Bring the IOP back to the state of a template: typically an IOP that
+ * has been set up once, with its callbacks, page map and control block
+ * address, but never run. Then the functions registered with
+ * i89_keep() on the IOP, not on the template, are called in the order
+ * they were registered, with a copy of the IOP from before, to put back
+ * what was attached to it. What the IOP has nothing of its own for comes
+ * from the template, except for the translation cache, which is never
+ * shared. Its undo journal is emptied and its memory can be reset with
+ * i89_mem_reset(), before.
+ */
+
+void
+i89_reset (struct i89 *iop, const struct i89 *tmpl)
+{
+	struct i89 own = *iop;
+	unsigned page;
+	int i;
+
+	/* Whatever was translated from writable pages may change. */
+	for (page = 0; page < I89_PAGES; page++) {
+		if (iop->pflags[page] & I89_PAGE_CODE)
+			invalidate (iop, page);
+	}
+
+	*iop = *tmpl;
+
+	/* Debugging state never comes from the template. */
+	iop->watch = own.watch;
+	iop->undo = own.undo;
+	iop->verify = own.verify;
+	iop->tc = own.tc;
+
+	memcpy (iop->keep, own.keep, sizeof(iop->keep));
+	for (i = 0; i < I89_KEEP && iop->keep[i]; i++)
+		iop->keep[i] (iop, &own);
+
+	if (iop->undo)
+		iop->undo->tail = iop->undo->head = iop->undo->mtail = iop->undo->mhead = 0;
+
+	for (page = 0; page < I89_PAGES; page++) {
+		if (iop->watch) {
+			reflag (iop, page);
+		} else {
+			iop->pflags[page] &= ~(I89_PAGE_RWATCH | I89_PAGE_WWATCH | I89_PAGE_BREAK);
+			remap (iop, page);
+		}
+	}
+}
+
+/*
+ * The bus.
+ *
+ * By default, memory and I/O accesses that miss the page map, as well as
+ * SINTR, bus locking and streaming ports, go through the function
+ * pointers in struct i89. A program that wants its bus inlined into the
+ * interpreter and the transfer loop can instead define I89_BUS, include
+ * 8089.h, provide static inline bus_*() functions with the signatures
+ * below and then #include "8089.c". The core it gets that way defines
+ * all that 8089.o does, so it may still link against lib8089.a for the
+ * other modules, but not against 8089.o itself. See tests/inline.c.
+ */
+
+#if !defined(I89_BUS)
+
+static inline uint8_t
+bus_read8 (struct i89 *iop, uint32_t addr)
+{
+	return iop->read8 (iop, addr);
+}
+
+static inline uint16_t
+bus_read16 (struct i89 *iop, uint32_t addr)
+{
+	if (iop->read16)
+		return iop->read16 (iop, addr);
+	return iop->read8 (iop, addr) | (iop->read8 (iop, addr + 1) << 8);
+}
+
+static inline void
+bus_write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	iop->write8 (iop, addr, value);
+}
+
+static inline void
+bus_write16 (struct i89 *iop, uint32_t addr, uint16_t value)
+{
+	if (iop->write16) {
+		iop->write16 (iop, addr, value);
+	} else {
+		iop->write8 (iop, addr, value);
+		iop->write8 (iop, addr + 1, value >> 8);
+	}
+}
+
+static inline uint8_t
+bus_in8 (struct i89 *iop, uint16_t addr)
+{
+	return iop->in8 (iop, addr);
+}
+
+static inline uint16_t
+bus_in16 (struct i89 *iop, uint16_t addr)
+{
+	if (iop->in16)
+		return iop->in16 (iop, addr);
+	return iop->in8 (iop, addr) | (iop->in8 (iop, addr + 1) << 8);
+}
+
+static inline void
+bus_out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+	iop->out8 (iop, addr, value);
+}
+
+static inline void
+bus_out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+	if (iop->out16) {
+		iop->out16 (iop, addr, value);
+	} else {
+		iop->out8 (iop, addr, value);
+		iop->out8 (iop, addr + 1, value >> 8);
+	}
+}
+
+static inline unsigned
+bus_in_block (struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	if (iop->in_block)
+		return iop->in_block (iop, addr, buf, len);
+	return 0;
+}
+
+static inline unsigned
+bus_out_block (struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	if (iop->out_block)
+		return iop->out_block (iop, addr, buf, len);
+	return 0;
+}
+
+static inline void
+bus_sintr (struct i89 *iop)
+{
+	if (iop->sintr)
+		iop->sintr (iop);
+}
+
+static inline void
+bus_lock (struct i89 *iop, int locked)
+{
+	if (iop->lock)
+		iop->lock (iop, locked);
+}
+
+#endif /* !I89_BUS */
+
+/*
+ * Record the byte a write is about to overwrite. Only for memory that is
+ * mapped, if only for reads: reading it back through the callbacks could
+ * have side effects, so writes to the rest can't be undone.
+ */
+static void
+journal (struct i89 *iop, uint32_t addr)
+{
+	struct i89_undo *u = iop->undo;
+	unsigned page = PAGE(addr);
+	struct undo_mem *m;
+
+	if (!iop->map[page])
+		return;
+
+	/* Make room, giving up on the steps whose bytes get overwritten. */
+	if (u->mhead - u->mtail == u->nmem) {
+		u->mtail++;
+		while (u->tail != u->head &&
+		       (int)(u->step[u->tail % u->nstep].mem - u->mtail) < 0)
+			u->tail++;
+	}
+
+	m = &u->mem[u->mhead++ % u->nmem];
+	m->addr = addr & 0xfffff;
+	m->old = iop->map[page][PAGE_OFF(addr)];
+}
+
+/*
+ * Memory access.
+ *
+ * System memory in mapped pages is accessed directly, the rest goes
+ * through the callbacks. Pages with flags set are only mapped for reads;
+ * writes to them take the slow path. So do reads from pages with read
+ * watchpoints.
+ */
+
+static uint8_t
+load8 (struct i89 *iop, uint32_t addr)
+{
+	unsigned page = PAGE(addr);
+
+	if (iop->pflags[page] & I89_PAGE_RWATCH)
+		watched (iop, iop->watch->rd[page], I89_WATCH_READ, addr);
+	if (iop->map[page])
+		return iop->map[page][PAGE_OFF(addr)];
+	return bus_read8 (iop, addr);
+}
+
+static uint32_t
+in8 (struct i89 *iop, uint32_t addr, int tag)
+{
+	uint8_t *page;
+
+	if (tag) {
+		if (iop->watch)
+			watch_io (iop, I89_WATCH_IO | I89_WATCH_READ, addr, 1);
+		return bus_in8 (iop, addr);
+	}
+
+	page = iop->rmap[PAGE(addr)];
+	if (page)
+		return page[PAGE_OFF(addr)];
+	return load8 (iop, addr);
+}
+
+static uint32_t
+in16 (struct i89 *iop, uint32_t addr, int tag)
+{
+	uint8_t *page;
+
+	if (tag) {
+		if (iop->watch)
+			watch_io (iop, I89_WATCH_IO | I89_WATCH_READ, addr, 2);
+		return bus_in16 (iop, addr);
+	}
+
+	page = iop->rmap[PAGE(addr)];
+	if (page && PAGE_OFF(addr + 1)) {
+		page += PAGE_OFF(addr);
+		return page[0] | (page[1] << 8);
+	}
+	if (iop->map[PAGE(addr)] || (iop->pflags[PAGE(addr)] & I89_PAGE_RWATCH))
+		return in8 (iop, addr, 0) | (in8 (iop, addr + 1, 0) << 8);
+	return bus_read16 (iop, addr);
+}
+
+static uint32_t
+in (struct i89 *iop, uint32_t addr, int tag, unsigned wide)
+{
+	addr &= tag ? 0xffff : 0xfffff;
+	if (wide == 0)
+		return in8 (iop, addr, tag);
+	if (addr % 2)
+		return in8 (iop, addr, tag) | (in (iop, addr + 1, tag, wide - 1) << 8);
+	if (wide == 1)
+		return in16 (iop, addr, tag);
+	return in16 (iop, addr, tag) | (in (iop, addr + 2, tag, wide - 2) << 16);
+}
+
+static void
+store8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	unsigned page = PAGE(addr);
+
+	if (iop->pflags[page] & I89_PAGE_CODE)
+		invalidate (iop, page);
+	if (iop->pflags[page] & I89_PAGE_WWATCH)
+		watched (iop, iop->watch->wr[page], I89_WATCH_WRITE, addr);
+	if (iop->undo)
+		journal (iop, addr);
+	if (iop->map[page] && !(iop->pflags[page] & I89_PAGE_RO))
+		iop->map[page][PAGE_OFF(addr)] = value;
+	else
+		bus_write8 (iop, addr, value);
+}
+
+static void
+out8 (struct i89 *iop, uint32_t addr, uint8_t value, int tag)
+{
+	uint8_t *page;
+
+	if (tag) {
+		if (iop->watch)
+			watch_io (iop, I89_WATCH_IO | I89_WATCH_WRITE, addr, 1);
+		bus_out8 (iop, addr, value);
+		return;
+	}
+
+	page = iop->wmap[PAGE(addr)];
+	if (page)
+		page[PAGE_OFF(addr)] = value;
+	else
+		store8 (iop, addr, value);
+}
+
+static void
+out16 (struct i89 *iop, uint32_t addr, uint16_t value, int tag)
+{
+	uint8_t *page;
+
+	if (tag) {
+		if (iop->watch)
+			watch_io (iop, I89_WATCH_IO | I89_WATCH_WRITE, addr, 2);
+		bus_out16 (iop, addr, value);
+		return;
+	}
+
+	page = iop->wmap[PAGE(addr)];
+	if (page && PAGE_OFF(addr + 1)) {
+		page += PAGE_OFF(addr);
+		page[0] = value;
+		page[1] = value >> 8;
+	} else if (!iop->map[PAGE(addr)] && !(iop->pflags[PAGE(addr)] & I89_PAGE_WWATCH)) {
+		bus_write16 (iop, addr, value);
+	} else {
+		store8 (iop, addr, value);
+		store8 (iop, addr + 1, value >> 8);
+	}
+}
+
+static void
+out (struct i89 *iop, uint32_t addr, uint32_t value, int tag, unsigned wide)
+{
+	addr &= tag ? 0xffff : 0xfffff;
+	if (wide == 0) {
+		out8 (iop, addr, value, tag);
+		return;
+	}
+	if ((addr % 2) || !out16) {
+		out8 (iop, addr, value, tag);
+		out (iop, addr + 1, value >> 8, tag, wide - 1);
+		return;
+	}
+	if (wide == 1) {
+		out16 (iop, addr, value, tag);
+		return;
+	}
+	out16 (iop, addr, value, tag);
+	out (iop, addr + 2, value >> 16, tag, wide - 2);
+}
+
+/*
+ * Helper macros.
+ */
+
+#define CHAN	(iop->chan[ch])
+#define TAG(r)	((CHAN.tags >> (r)) & 1)
+#define MASK(b)	((CHAN.regs[MC] ^ (b)) & (CHAN.regs[MC] >> 8) & 0xff)
+#define preg	CHAN.regs[mmregs[mm]]
+
+/*
+ * Memory access macros.
+ */
+
+#define rd	in(iop, preg+offset, TAG(mmregs[mm]), w)
+#define rd20	in(iop, preg+offset, TAG(mmregs[mm]), 2)
+#define rd32	in(iop, preg+offset, TAG(mmregs[mm]), 3)
+#define wr(v)	out(iop, preg+offset, v, TAG(mmregs[mm]), w)
+#define wr20(v)	out(iop, preg+offset, v, TAG(mmregs[mm]), 2)
+
+/*
+ * Save the state of the channel before a step, see the undo journal.
+ */
+
+static void
+checkpoint (struct i89 *iop, int ch, enum undo_kind kind)
+{
+	struct i89_undo *u = iop->undo;
+	struct undo_step *s;
+
+	if (u->head - u->tail == u->nstep) {
+		u->tail++;
+		u->mtail = u->step[u->tail % u->nstep].mem;
+	}
+
+	s = &u->step[u->head++ % u->nstep];
+	memcpy (s->regs, CHAN.regs, sizeof(s->regs));
+	s->cycles = iop->cycles;
+	s->mem = u->mhead;
+	s->tags = CHAN.tags;
+	s->ch = ch;
+	s->kind = kind;
+	s->wid = CHAN.wid;
+	s->xfer = CHAN.xfer;
+	s->dma = CHAN.dma;
+	s->eop = CHAN.eop;
+	s->park = CHAN.park;
+	s->park_until = CHAN.park_until;
+	s->poll_tp = CHAN.poll_tp;
+	s->poll_clk = CHAN.poll_clk;
+	memcpy (s->poll, CHAN.poll, sizeof(s->poll));
+	s->npoll = CHAN.npoll;
+	s->halt = CHAN.halt;
+	s->is = CHAN.is;
+	s->nointr = CHAN.nointr;
+	s->prio = CHAN.prio;
+	s->blimit = CHAN.blimit;
+	s->ccb = CHAN.ccb;
+
+	if (kind == UNDO_ATTN) {
+		memcpy (s->susp_regs, CHAN.susp.regs, sizeof(s->susp_regs));
+		s->susp_tags = CHAN.susp.tags;
+		s->susp_xfer = CHAN.susp.xfer;
+		s->susp_dma = CHAN.susp.dma;
+		s->susp_valid = CHAN.susp.valid;
+	}
+}
+
+/*
+ * DMA.
+ *
+ * A transfer is a state machine rather than a loop: the channel stays in
+ * transfer cycles until one of the termination conditions hits, and
+ * i89_xfer() advances it by as many cycles as the caller wishes. This
+ * lets the host and the other channel run in between and lets device
+ * models pace the transfer with DRQ and stop it with EOP.
+ */
+
+/* Termination causes, for the tracepoint. */
+#define TERM_EXT	1
+#define TERM_BC		2
+#define TERM_MASK	3
+#define TERM_SINGLE	4
+
+static int
+dma_term (struct i89 *iop, int ch, int cause, int term)
+{
+	PROBE4(dma_end, ch, cause, term & 3, CHAN.regs[BC]);
+
+	CHAN.xfer = 0;
+	CHAN.dma = 0;
+	CHAN.eop = 0;
+
+	switch (term & 3) {
+	case 3: CHAN.regs[TP] += 4;
+	case 2: CHAN.regs[TP] += 4;
+	}
+
+	return I89_OK;
+}
+
+/*
+ * Move a run of transfer cycles between a streaming port and memory
+ * mapped in a single page in one go. Returns the number of cycles
+ * done, 0 if the next one can't be streamed, such as when it straddles
+ * pages, and -1 if the device had nothing ready.
+ */
+
+static int
+xfer_block (struct i89 *iop, int ch, int src, int dst, int wid, unsigned cycles)
+{
+	int in = TAG(src);
+	int mem = in ? dst : src;
+	uint16_t port = CHAN.regs[in ? src : dst];
+	uint32_t addr = CHAN.regs[mem] & 0xfffff;
+	unsigned bpc = wid ? 2 : 1;
+	unsigned len, done;
+	uint8_t *p;
+
+	p = in ? iop->wmap[PAGE(addr)] : iop->rmap[PAGE(addr)];
+	if (p == NULL)
+		return 0;
+	p += PAGE_OFF(addr);
+
+	len = I89_PAGE_SIZE - PAGE_OFF(addr);
+	if (cycles && len > cycles * bpc)
+		len = cycles * bpc;
+	if ((CHAN.regs[CC] & 0x0018) && len > CHAN.regs[BC])
+		len = CHAN.regs[BC];
+	len -= len % bpc;
+	if (len == 0)
+		return 0;
+
+	if (in)
+		done = bus_in_block (iop, port, p, len);
+	else
+		done = bus_out_block (iop, port, p, len);
+	if (done == 0)
+		return -1;
+	if (done > len)
+		done = len;
+
+	/* A cycle left halfway is redone as a whole, on a port that may
+	 * be a word wide. */
+	done -= done % bpc;
+	if (done == 0)
+		return 0;
+
+	CHAN.regs[mem] += done;
+	CHAN.regs[BC] -= done;
+	return done / bpc;
+}
+
+int
+i89_xfer (struct i89 *iop, int ch, unsigned cycles)
+{
+	uint16_t cc = CHAN.regs[CC];
+	int gs_inc = !!(cc & 0x4000);
+	int gd_inc = !!(cc & 0x8000);
+	int wid = CHAN.wid;
+	uint8_t masked = 0;
+	int src, dst, stream, n;
+	uint16_t val;
+
+	if (!CHAN.dma)
+		return I89_OK;
+
+	/* S */
+	if (cc & 0x0400) {
+		src = GB;
+		dst = GA;
+	} else {
+		src = GA;
+		dst = GB;
+	}
+
+	/* A fixed port on one side and incremented memory on the other
+	 * can be streamed, unless the ports are watched, the transfer is
+	 * a single one or it needs to be undone cycle by cycle. */
+	stream = !(cc & 0x0080) && !iop->watch && !iop->undo &&
+		 ((TAG(src) && !gs_inc && !TAG(dst) && gd_inc) ||
+		  (TAG(dst) && !gd_inc && !TAG(src) && gs_inc));
+
+	do {
+		/* TX External Terminate */
+		if ((cc & 0x0060) && CHAN.eop) {
+			if (iop->undo)
+				checkpoint (iop, ch, UNDO_XFER);
+			return dma_term (iop, ch, TERM_EXT, cc >> 5);
+		}
+
+		/* TBC Byte Counte Termination*/
+		if (cc & 0x0018) {
+			if (CHAN.regs[BC] == 0) {
+				if (iop->undo)
+					checkpoint (iop, ch, UNDO_XFER);
+				return dma_term (iop, ch, TERM_BC, cc >> 3);
+			}
+			if (CHAN.regs[BC] == 1)
+				wid = 0;
+		}
+
+		/* SYN: Synchronized transfers wait for DRQ. */
+		if ((cc & 0x1800) && CHAN.nodrq)
+			return I89_DMA_WAIT;
+
+		/* Waiting for DRQ leaves nothing to undo; a cycle does. */
+		if (iop->undo)
+			checkpoint (iop, ch, UNDO_XFER);
+
+		if (stream) {
+			n = xfer_block (iop, ch, src, dst, wid, cycles);
+			if (n > 0) {
+				iop->cycles += n * DMA_CLOCKS;
+				/* One more is counted off below. */
+				if (cycles)
+					cycles -= n - 1;
+				continue;
+			}
+			if (n < 0)
+				stream = 0;
+		}
+
+		switch (wid) {
+		case 0:
+			/* wid 8,8 */
+			val = in8 (iop, CHAN.regs[src], TAG(src));
+			masked = !MASK(val);
+			CHAN.regs[src] += gs_inc;
+			out8 (iop, CHAN.regs[dst], val, TAG(dst));
+			CHAN.regs[dst] += gd_inc;
+			CHAN.regs[BC]--;
+			break;
+		case 1:
+			/* wid 8,16 */
+			val = in8 (iop, CHAN.regs[src], TAG(src));
+			masked = !MASK(val);
+			CHAN.regs[src] += gs_inc;
+			val |= in8 (iop, CHAN.regs[src], TAG(src)) << 8;
+			masked |= !MASK(val >> 8);
+			CHAN.regs[src] += gs_inc;
+			out16 (iop, CHAN.regs[dst], val, TAG(dst));
+			CHAN.regs[dst] += 2 * gd_inc;
+			CHAN.regs[BC] -= 2;
+			break;
+		case 2:
+			/* wid 16,8 */
+			val = in16 (iop, CHAN.regs[src], TAG(src));
+			masked = !MASK(val);
+			masked |= !MASK(val >> 8);
+			CHAN.regs[src] += 2 * gs_inc;
+			out8 (iop, CHAN.regs[dst], val, TAG(dst));
+			CHAN.regs[dst] += gd_inc;
+			out8 (iop, CHAN.regs[dst], val >> 8, TAG(dst));
+			CHAN.regs[dst] += gd_inc;
+			CHAN.regs[BC] -= 2;
+			break;
+		case 3:
+			/* wid 16,16 */
+			val = in16 (iop, CHAN.regs[src], TAG(src));
+			masked = !MASK(val);
+			masked |= !MASK(val >> 8);
+			CHAN.regs[src] += 2 * gs_inc;
+			out16 (iop, CHAN.regs[dst], val, TAG(dst));
+			CHAN.regs[dst] += 2 * gd_inc;
+			CHAN.regs[BC] -= 2;
+			break;
+		}
+
+#if 0
+		if ((cc & 0x0007) != 0x0006) {
+			/* TSH: Mask/compare termination */
+			if (masked != !(cc & 0x0600))
+				return dma_term (iop, ch, TERM_MASK, cc & 0x0003);
+		}
+#endif
+
+		iop->cycles += DMA_CLOCKS;
+
+		/* TS: Single Transfer mode. */
+		if (cc & 0x0080)
+			return dma_term (iop, ch, TERM_SINGLE, 0);
+	} while (cycles == 0 || --cycles);
+
+	return I89_DMA;
+}
+
+static int
+dma (struct i89 *iop, int ch)
+{
+	/* TR: translate not supported */
+	if (CHAN.regs[CC] & 0x2000) {
+		fprintf (stderr, "tx unimpl\n");
+		return -1;
+	}
+
+	PROBE4(dma_start, ch, CHAN.regs[CC], CHAN.regs[GA], CHAN.regs[GB]);
+
+	CHAN.dma = 1;
+	CHAN.eop = 0;
+	return i89_xfer (iop, ch, iop->burst);
+}
+
+void
+i89_drq (struct i89 *iop, int ch, int level)
+{
+	CHAN.nodrq = !level;
+}
+
+void
+i89_eop (struct i89 *iop, int ch)
+{
+	if (CHAN.dma)
+		CHAN.eop = 1;
+}
+
+/*
+ * Various common instruction operations.
+ */
+
+#define FETCH	(fetch(iop, CHAN.regs[TP]++, TAG(TP), 0))
+#define FETCH16	(fetch(iop, (CHAN.regs[TP]+=2)-2, TAG(TP), 1))
+#define JUMP	(CHAN.regs[TP] += (int16_t)value)
+#define REG	(CHAN.regs[rrr])
+#define BIT	(1 << bbb)
+#define TAG_IO	(CHAN.tags |= (1 << rrr))
 #define TAG_MEM	(CHAN.tags &= ~(1 << rrr))
 #define REG20	((REG & 0xffff) | (REG & 0xf0000) << 4 | (TAG(rrr) << 19))
 
-static inline uint32_t
-segoff (uint32_t value)
+/*
+ * Fetch from where TP points, possibly the I/O space. Instruction
+ * fetches don't trip read watchpoints.
+ */
+
+static uint32_t
+fetch (struct i89 *iop, uint32_t addr, int tag, unsigned wide)
+{
+	uint32_t value;
+
+	if (tag)
+		return in (iop, addr, 1, wide);
+
+	addr &= 0xfffff;
+	if (!(iop->pflags[PAGE(addr)] & I89_PAGE_RWATCH))
+		return in (iop, addr, 0, wide);
+
+	if (iop->map[PAGE(addr)])
+		value = iop->map[PAGE(addr)][PAGE_OFF(addr)];
+	else
+		value = bus_read8 (iop, addr);
+	if (wide)
+		value |= fetch (iop, addr + 1, 0, wide - 1) << 8;
+	return value;
+}
+
+static inline uint32_t
+segoff (uint32_t value)
+{
+	return (value & 0xffff) | ((value >> 16) << 4);
+}
+
+static uint32_t
+memptr (struct i89 *iop, uint32_t addr)
+{
+	return segoff(in (iop, addr, 0, 3));
+}
+
+static void
+start (struct i89 *iop, int ch, uint32_t pb, int local)
+{
+	CHAN.regs[PP] = pb;
+	CHAN.regs[TP] = memptr (iop, pb);
+	CHAN.tags &= ~(1 << PP | 1 << TP);
+	CHAN.tags |= local << TP;
+	CHAN.halt = 0;
+	CHAN.park = 0;
+	CHAN.xfer = 0;
+	CHAN.dma = 0;
+	CHAN.eop = 0;
+}
+
+/*
+ * Command submission ring.
+ */
+
+/* Post the block the channel is running from the ring, done or not. */
+static void
+complete (struct i89 *iop, int ch)
+{
+	struct i89_ring *ring = CHAN.ring;
+
+	if (!CHAN.queued)
+		return;
+
+	ring->cq[ring->cq_tail % I89_RING_SIZE].pb = CHAN.regs[PP];
+	ring->cq[ring->cq_tail % I89_RING_SIZE].status =
+		in8 (iop, CHAN.regs[PP] + ring->status, 0);
+	/* Whoever reaps may be on another thread; see thr89.c. */
+	__atomic_store_n (&ring->cq_tail, ring->cq_tail + 1, __ATOMIC_RELEASE);
+	CHAN.queued = 0;
+}
+
+static int
+dispatch (struct i89 *iop, int ch)
+{
+	struct i89_ring *ring = CHAN.ring;
+
+	if (ring == NULL || ring->sq_head == ring->sq_tail)
+		return 0;
+
+	start (iop, ch, ring->sq[ring->sq_head++ % I89_RING_SIZE], 0);
+	CHAN.queued = 1;
+	return 1;
+}
+
+/*
+ * Queue a parameter block. A channel that is idle, that is halted or
+ * not running anything a channel attention or the ring started, starts
+ * it right away.
+ */
+
+int
+i89_submit (struct i89 *iop, int ch, uint32_t pb)
+{
+	struct i89_ring *ring = CHAN.ring;
+
+	if (ring == NULL)
+		return -1;
+
+	/* Leave room for the completion of everything in flight. */
+	if (ring->sq_tail - __atomic_load_n (&ring->cq_head, __ATOMIC_ACQUIRE) == I89_RING_SIZE)
+		return -1;
+
+	ring->sq[ring->sq_tail++ % I89_RING_SIZE] = pb;
+	if (CHAN.halt || (!CHAN.queued && !CHAN.ccb))
+		dispatch (iop, ch);
+	return 0;
+}
+
+int
+i89_reap (struct i89 *iop, int ch, uint32_t *pb, uint8_t *status)
+{
+	struct i89_ring *ring = CHAN.ring;
+
+	if (ring == NULL || ring->cq_head == __atomic_load_n (&ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*pb = ring->cq[ring->cq_head % I89_RING_SIZE].pb;
+	*status = ring->cq[ring->cq_head % I89_RING_SIZE].status;
+	__atomic_store_n (&ring->cq_head, ring->cq_head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static inline void
+event (struct i89 *iop, int ch, enum i89_event ev, unsigned arg)
+{
+	if (iop->event)
+		iop->event (iop, ch, ev, arg);
+}
+
+static int
+halt (struct i89 *iop, int ch)
+{
+	CHAN.halt = 1;
+	event (iop, ch, I89_EVENT_HALT, 0);
+	if (!CHAN.queued) {
+		if (CHAN.ccb)
+			out8 (iop, iop->cb + 8 * ch + 1, 0x00, 0);
+		CHAN.ccb = 0;
+		return I89_HALT;
+	}
+
+	complete (iop, ch);
+	return dispatch (iop, ch) ? I89_OK : I89_HALT;
+}
+
+/*
+ * Polling loop detection.
+ *
+ * A channel waiting for a device typically spins in a loop made only of
+ * conditional jumps on I/O space locations, such as "jnbt [gc].6h,7,$".
+ * Such a loop has no side effects other than the port reads, so instead
+ * of spinning the channel is parked until the device model tells us
+ * that one of the polled ports may have changed, or until poll_limit
+ * cycles pass. The cycles the loop would have spent are still counted.
+ */
+
+static void
+poll (struct i89 *iop, int ch, uint16_t insn, int8_t offset, uint32_t pc, uint32_t next)
+{
+	uint16_t port;
+	int i;
+
+	switch (opcode) {
+	case  8:					/* jmp */
+		if (rrr != TP)
+			goto reset;
+		break;
+	case 44: case 45: case 46: case 47:		/* jmce, jmcne, jnbt, jbt */
+	case 56: case 57:				/* jnz m, jz m */
+		if (aa == 3 || !TAG(mmregs[mm]))
+			goto reset;
+		port = preg + offset;
+		for (i = 0; i < CHAN.npoll; i++) {
+			if (CHAN.poll[i] == port)
+				break;
+		}
+		if (i == I89_POLL_PORTS)
+			goto reset;
+		if (i == CHAN.npoll)
+			CHAN.poll[CHAN.npoll++] = port;
+		break;
+	default:
+		goto reset;
+	}
+
+	if (CHAN.poll_clk == 0)
+		CHAN.poll_tp = pc;
+	CHAN.poll_clk += clocks[opcode];
+
+	if (CHAN.regs[TP] == CHAN.poll_tp) {
+		/* Back at the top of the loop. */
+		CHAN.park = 1;
+		CHAN.park_until = iop->cycles + iop->poll_limit;
+	} else if (CHAN.regs[TP] != next) {
+		/* Jumped elsewhere, not a loop we know of. */
+		goto reset;
+	}
+	return;
+
+reset:
+	CHAN.poll_clk = 0;
+	CHAN.npoll = 0;
+}
+
+static void
+unpark (struct i89 *iop, int ch)
+{
+	CHAN.park = 0;
+	CHAN.poll_clk = 0;
+	CHAN.npoll = 0;
+}
+
+void
+i89_port (struct i89 *iop, uint16_t port)
+{
+	int ch, i;
+
+	for (ch = 0; ch < 2; ch++) {
+		if (!CHAN.park)
+			continue;
+		for (i = 0; i < CHAN.npoll; i++) {
+			if (CHAN.poll[i] == port)
+				unpark (iop, ch);
+		}
+	}
+}
+
+/*
+ * Test and set lock. Other IOPs may share the memory from other threads,
+ * so nothing may get between the test and the set: directly mapped
+ * memory is updated with a host atomic operation, otherwise the lock
+ * callback is held around the access. The immediate value comes in the
+ * low byte of value, the jump displacement in the next one.
+ */
+
+static void
+tsl (struct i89 *iop, int ch, uint16_t insn, int8_t offset, uint32_t value)
+{
+	int tag = TAG(mmregs[mm]);
+	uint32_t addr = (preg + offset) & (tag ? 0xffff : 0xfffff);
+	uint8_t lock = 0;
+	uint8_t *page;
+
+	if (!tag && iop->map[PAGE(addr)]) {
+		if (iop->pflags[PAGE(addr)] & I89_PAGE_CODE)
+			invalidate (iop, PAGE(addr));
+		page = iop->wmap[PAGE(addr)];
+	} else {
+		page = NULL;
+	}
+
+	if (page) {
+		__atomic_compare_exchange_n (&page[PAGE_OFF(addr)], &lock, value,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	} else {
+		bus_lock (iop, 1);
+		lock = in8 (iop, addr, tag);
+		if (lock == 0)
+			out8 (iop, addr, value, tag);
+		bus_lock (iop, 0);
+	}
+
+	/* Already locked. */
+	if (lock)
+		CHAN.regs[TP] += (int8_t)(value >> 8);
+}
+
+/*
+ * Execute a decoded instruction.
+ */
+
+static int
+exec (struct i89 *iop, int ch, uint16_t insn, int8_t offset, uint32_t value)
+{
+	iop->cycles += clocks[opcode];
+
+	switch (opcode) {
+
+	case  2: REG = segoff (value); TAG_MEM;	break;	/* lpdi p,i */
+	case  8: REG += value;			break;	/* addi r,i */
+	case  9: REG |= value;			break;	/* ori r,i */
+	case 10: REG &= value;			break;	/* andi r,i */
+	case 11: REG = ~REG;			break;	/* not r */
+	case 12: REG = value; TAG_IO;		break;	/* movi r,i */
+	case 14: REG++;				break;	/* inc r */
+	case 15: REG--;				break;	/* dec r */
+	case 16: if (REG) JUMP;			break;	/* jnz r */
+	case 17: if (REG == 0) JUMP;		break;	/* jz r */
+	case 18: return halt (iop, ch);			/* hlt */
+	case 19: wr(value);			break;	/* mov m,i */
+	case 32: REG = rd; TAG_IO;		break;	/* mov r,m */
+	case 33: wr(REG);			break;	/* mov m,r */
+	case 34: REG = segoff (rd32); TAG_MEM;	break;	/* lpd p,m */
+	case 35:					/* movp p,m */
+		REG = rd20;
+		if (REG & (1 << 19))
+			TAG_IO;
+		else
+			TAG_MEM;
+		REG = (REG & 0xffff) | ((REG & 0xf00000) >> 4);
+		break;
+	case 36: /* handled by caller */	break;	/* mov m,m (load part) */
+	case 37: tsl (iop, ch, insn, offset, value); break; /* tsl */
+	case 38: wr20(REG20);			break;	/* movp m,p */
+	case 39: wr20(REG20); JUMP;		break;	/* call */
+	case 40: REG += rd;			break;	/* add r,m */
+	case 41: REG |= rd;			break;	/* or r,m */
+	case 42: REG &= rd;			break;	/* and r,m */
+	case 43: REG = ~rd;			break;	/* not r,m */
+	case 44: if (MASK(rd) == 0) JUMP;	break;	/* jmce */
+	case 45: if (MASK(rd) != 0) JUMP;	break;	/* jmcne */
+	case 46: if (!(rd & BIT)) JUMP;		break;	/* jnbt */
+	case 47: if (rd & BIT) JUMP;		break;	/* jbt */
+	case 48: wr(rd + value);		break;	/* add m,i */
+	case 49: wr(rd | value);		break;	/* or m,i */
+	case 50: wr(rd & value);		break;	/* and m,i */
+	case 51: wr(value);			break;	/* mov m,m (store part) */
+	case 52: wr(rd + REG);			break;	/* add m,r */
+	case 53: wr(rd | REG);			break;	/* or m,r */
+	case 54: wr(rd & REG);			break;	/* and m,r */
+	case 55: wr(~rd);			break;	/* not m */
+	case 56: if (rd) JUMP;			break;	/* jnz m */
+	case 57: if (rd == 0) JUMP;		break;	/* jz m */
+	case 58: wr(rd + 1);			break;	/* inc m */
+	case 59: wr(rd - 1);			break;	/* dec m */
+	case 61: wr(rd | 1 << bbb);		break;	/* setb */
+	case 62: wr(rd & ~ BIT);		break;	/* clr */
+
+	case  0:
+		/* Special instruction */
+		if (insn == 0x0000) {
+			/* nop */
+			break;
+		} else if (insn == 0x0040) {
+			PROBE1(sintr, ch);
+			event (iop, ch, I89_EVENT_SINTR, 0);
+			CHAN.is = 1;
+			if (!CHAN.nointr)
+				bus_sintr (iop);
+			break;
+		} else if (insn == 0x0060) {
+			CHAN.xfer = 1;
+			/* Transfer begins at the end of next insn. */
+			break;
+		} else if (insn & 0x0080) {
+			CHAN.wid = (insn & 0x0060) >> 5;
+			break;
+		}
+		/* Fallthrough. */
+	default:
+		PROBE3(unknown, ch, CHAN.regs[TP], insn);
+		fprintf (stderr, "Unknown: %d\n", opcode);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Things to do after an instruction is done: watch for polling loops and
+ * start a transfer if the previous instruction was xfer.
+ */
+
+static int
+retire (struct i89 *iop, int ch, uint16_t insn, int8_t offset, uint32_t pc, uint32_t next)
+{
+	PROBE3(insn, ch, pc, insn);
+
+	if (iop->poll_limit)
+		poll (iop, ch, insn, offset, pc, next);
+
+	if (CHAN.xfer && insn != 0x0060)
+		return dma (iop, ch);
+
+	return 0;
+}
+
+/*
+ * This fetches an instruction and its argument.
+ * It optionally validates, prints and executes it.
+ *
+ * Processing MOV M,M is somewhat peculiar, because it's in fact two
+ * instructions: one for load, another for store. Handling it involves
+ * recursion, passing along the value being transferred and context for
+ * pretty printing.
+ */
+
+
+static int
+do_insn (struct i89 *iop, int ch, enum i89_flags flags, uint32_t value, int column)
+{
+	uint32_t pc = CHAN.regs[TP];
+	uint32_t next;
+	int8_t offset, sdisp;
+	uint16_t insn;
+	int check = 0;
+	int ret;
+
+	PRINT_ADDR ("%05x: ", CHAN.regs[TP]);
+
+	/* Fetch the instruction. */
+	insn = FETCH16;
+	PRINT_DATA ("%04x ", insn);
+
+	/* Displacement/offset */
+	switch (aa) {
+	case 0:
+		offset = 0;
+		break;
+	case 1:
+		offset = FETCH;
+		PRINT_DATA ("%02x ", offset);
+		break;
+	case 2:
+		offset = CHAN.regs[IX];
+		break;
+	case 3:
+		offset = CHAN.regs[IX]++;
+		break;
+	}
+
+	/* Immediate value */
+	switch (wb) {
+	case 0:
+		/* None. Second part of mov m,m takes this from previous
+		 * half instruction, passed as an argument. */
+		break;
+	case 1:
+		/* Immediate byte. */
+		value = FETCH;
+		PRINT_DATA ("%02x ", value);
+
+		/* Sign extend */
+		value = (int8_t)value;
+		break;
+	case 2:
+		/* Immediate word (or more). */
+		value = FETCH16;
+		if ((insn & 0xff00) == 0x0800) {
+			/* lpdi takes two more immediate bytes */
+			value |= FETCH16 << 16;
+			PRINT_DATA ("%08x ", value);
+		} else {
+			PRINT_DATA ("%04x ", value);
+			/* Sign extend */
+			value = (int16_t)value;
+		}
+		break;
+	case 3:
+		/* Used by tsl instruction only. */
+		value = FETCH;
+		PRINT_DATA ("%02x ", value);
+		sdisp = FETCH;
+		PRINT_DATA ("%02x ", sdisp);
+		sdisp = (int16_t)sdisp;
+		/* Pass the displacement along for execution. */
+		value |= (sdisp & 0xff) << 8;
+		break;
+	}
+
+	/* Sanity checks, unless verified already (with the store part
+	 * of mov m,m). */
+	if ((flags & I89_CHECK) && !(flags & _I89_STORE) && !TAG(TP) && verified (iop, pc))
+		flags &= ~I89_CHECK;
+        if (flags & I89_CHECK) {
+		if (validate (insn, value))
+			return -1;
+		if ((flags & _I89_STORE) && (opcode != 51)) {
+			fprintf (stderr, "mov/store must follow mov/load\n");
+			return -1;
+		}
+		check = 1;
+	}
+
+	/* mov m,m (load part) */
+	if (opcode == 36) {
+		if (do_insn(iop, ch, _I89_STORE | flags & ~I89_PRINT_ADDR, rd, column) < 0)
+			return -1;
+		column = 0;
+	}
+
+        if (flags & I89_PRINT_INSN) {
+		if (column && (flags & I89_PRINT_DATA)) {
+			for (; column < 20; column++)
+				putchar (' ');
+		}
+		if (print (insn, offset, value, sdisp))
+			return -1;
+		/* mov m,m (store part) */
+		if (opcode != 51)
+			putchar ('\n');
+	}
+
+	if ((flags & I89_EXEC) == 0)
+		return 0;
+
+	/* Passed, no need to check it again. */
+	if (check && iop->verify && !(flags & _I89_STORE) && !TAG(TP))
+		verified_mark (iop, pc, CHAN.regs[TP]);
+
+	next = CHAN.regs[TP];
+	ret = exec (iop, ch, insn, offset, value);
+
+	/* The store part of mov m,m leaves the rest to the load part. */
+	if (ret || (flags & _I89_STORE))
+		return ret;
+
+	return retire (iop, ch, insn, offset, pc, next);
+}
+
+/*
+ * Translator.
+ */
+
+#define OFFSET(d)	(aa == 1 ? (d) : aa == 2 ? (int8_t)CHAN.regs[IX] : \
+			 aa == 3 ? (int8_t)CHAN.regs[IX]++ : 0)
+
+/* Length of an instruction, or 0 if we'd rather not translate it. */
+static int
+length (uint16_t insn)
+{
+	int len = 2 + (aa == 1);
+
+	switch (wb) {
+	case 1:
+		return len + 1;
+	case 2:
+		return len + ((insn & 0xff00) == 0x0800 ? 4 : 2);
+	case 3:
+		/* tsl */
+		return 0;
+	}
+
+	return len;
+}
+
+static int
+decode (const uint8_t *p, int avail, struct di *di)
+{
+	uint16_t insn;
+	int len, n;
+
+	if (avail < 2)
+		return 0;
+	insn = p[0] | (p[1] << 8);
+	len = length (insn);
+	if (len == 0 || len > avail)
+		return 0;
+
+	di->insn = insn;
+	di->disp = aa == 1 ? p[2] : 0;
+	n = 2 + (aa == 1);
+	switch (wb) {
+	case 0:
+		/* No immediate; don't leave one from the slot's last use. */
+		di->value = 0;
+		break;
+	case 1:
+		di->value = (int8_t)p[n];
+		break;
+	case 2:
+		di->value = p[n] | (p[n + 1] << 8);
+		if (len - n == 4)
+			di->value |= (p[n + 2] | (p[n + 3] << 8)) << 16;
+		else
+			di->value = (int16_t)di->value;
+		break;
+	}
+
+	if (opcode == 36) {
+		/* mov m,m: the store part goes along */
+		if (avail - len < 2)
+			return 0;
+		insn = p[len] | (p[len + 1] << 8);
+		if (opcode != 51 || wb != 0 || length (insn) > avail - len)
+			return 0;
+		di->insn2 = insn;
+		di->disp2 = aa == 1 ? p[len + 2] : 0;
+		len += length (insn);
+	}
+
+	di->len = len;
+	return len;
+}
+
+/* Does the instruction (possibly) alter the flow of control? */
+static int
+branch (uint16_t insn)
+{
+	switch (opcode) {
+	case  0:
+		/* sintr, xfer */
+		return insn == 0x0040 || insn == 0x0060;
+	case  2: case 34: case 35:
+		return pppregs[ppp] == TP;
+	case  8: case  9: case 10: case 11: case 12: case 14: case 15:
+	case 32: case 40: case 41: case 42: case 43:
+		return rrr == TP;
+	case 16: case 17: case 18: case 39: case 44: case 45: case 46:
+	case 47: case 56: case 57:
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+valid (uint16_t insn)
+{
+	if (opcode == 0)
+		return insn == 0x0000 || insn == 0x0040 || insn == 0x0060 ||
+		       (insn & 0xff80) == 0x0080;
+	return clocks[opcode] && opcode != 37 && opcode != 51;
+}
+
+/*
+ * Decode the instruction in the avail bytes at p, located at addr, for
+ * analysis tools. Returns its length, or 0 if it is not valid.
+ */
+
+int
+i89_decode (const uint8_t *p, int avail, uint32_t addr, struct i89_decoded *d)
+{
+	struct di di;
+	uint16_t insn;
+	int len;
+
+	if (avail < 2)
+		return 0;
+	insn = p[0] | (p[1] << 8);
+
+	if (opcode == 37) {
+		/* tsl: jumps if the lock was taken */
+		len = 2 + (aa == 1) + 2;
+		if (len > avail)
+			return 0;
+		d->insn = insn;
+		d->len = len;
+		d->clocks = clocks[37];
+		d->flow = I89_FLOW_BRANCH;
+		d->target = (addr + len + (int8_t)p[len - 1]) & 0xfffff;
+		return len;
+	}
+
+	di.value = 0;
+	len = decode (p, avail, &di);
+	if (len == 0 || !valid (insn))
+		return 0;
+
+	d->insn = insn;
+	d->len = len;
+	d->clocks = clocks[opcode] + (opcode == 36 ? clocks[51] : 0);
+	d->target = (addr + len + di.value) & 0xfffff;
+
+	switch (opcode) {
+	case 18:
+		d->flow = I89_FLOW_HALT;
+		break;
+	case 39:
+		d->flow = I89_FLOW_CALL;
+		break;
+	case 16: case 17: case 44: case 45: case 46: case 47: case 56: case 57:
+		d->flow = I89_FLOW_BRANCH;
+		break;
+	case  2:
+		d->flow = pppregs[ppp] == TP ? I89_FLOW_JUMP : I89_FLOW_NEXT;
+		d->target = segoff (di.value);
+		break;
+	case  8:
+		d->flow = rrr == TP ? I89_FLOW_JUMP : I89_FLOW_NEXT;
+		break;
+	case 35:
+		d->flow = pppregs[ppp] == TP ? I89_FLOW_RETURN : I89_FLOW_NEXT;
+		break;
+	default:
+		/* sintr and xfer end a block, but go on. */
+		d->flow = branch (insn) && opcode != 0 ? I89_FLOW_INDIRECT : I89_FLOW_NEXT;
+		break;
+	}
+
+	return len;
+}
+
+static int
+exec_di (struct i89 *iop, int ch, const struct di *di)
+{
+	uint32_t pc = CHAN.regs[TP];
+	uint32_t value = di->value;
+	uint16_t insn = di->insn;
+	int8_t offset;
+	int ret;
+
+	CHAN.regs[TP] += di->len;
+	offset = OFFSET(di->disp);
+	if (opcode == 36) {
+		iop->cycles += clocks[36];
+		value = rd;
+		insn = di->insn2;
+		offset = OFFSET(di->disp2);
+	}
+
+	ret = exec (iop, ch, insn, offset, value);
+	if (ret)
+		return ret;
+
+	return retire (iop, ch, di->insn, offset, pc, pc + di->len);
+}
+
+/*
+ * Superinstructions.
+ *
+ * Channel programs are full of fixed idioms, such as counted loops or
+ * issuing a device command and then polling for its completion. Pairs
+ * of instructions that match an entry in fusions[] are executed by a
+ * single handler. Add more entries as they turn up.
+ */
+
+static int
+fused (struct i89 *iop, int ch, const struct di *di, uint32_t pc, int8_t offset)
+{
+	retire (iop, ch, di[0].insn, 0, pc, pc + di[0].len);
+	pc += di[0].len;
+	return retire (iop, ch, di[1].insn, offset, pc, pc + di[1].len);
+}
+
+/* dec r; jnz r,l */
+static int
+fuse_dec_jnz (struct i89 *iop, int ch, const struct di *di)
+{
+	uint32_t pc = CHAN.regs[TP];
+	uint32_t value = di[1].value;
+	uint16_t insn = di[1].insn;
+
+	iop->cycles += clocks[15] + clocks[16];
+	CHAN.regs[TP] += di[0].len + di[1].len;
+	if (--REG)
+		JUMP;
+
+	return fused (iop, ch, di, pc, 0);
+}
+
+/* mov m,i; jbt m,b,l or jnbt m,b,l */
+static int
+fuse_mov_jbt (struct i89 *iop, int ch, const struct di *di)
 {
-	return (value & 0xffff) | ((value >> 16) << 4);
+	uint32_t pc = CHAN.regs[TP];
+	uint32_t value = di[0].value;
+	uint16_t insn = di[0].insn;
+	int8_t offset;
+
+	iop->cycles += clocks[19];
+	CHAN.regs[TP] += di[0].len;
+	offset = OFFSET(di[0].disp);
+	wr(value);
+
+	/* The store may have overwritten the jump: that's for a new
+	 * block to see. */
+	if (!(iop->pflags[PAGE(pc)] & I89_PAGE_CODE))
+		return retire (iop, ch, di[0].insn, offset, pc, pc + di[0].len);
+
+	iop->cycles += clocks[di[1].insn >> 10];
+	CHAN.regs[TP] += di[1].len;
+	insn = di[1].insn;
+	value = di[1].value;
+	offset = OFFSET(di[1].disp);
+	if (rd & BIT ? opcode == 47 : opcode == 46)
+		JUMP;
+
+	return fused (iop, ch, di, pc, offset);
+}
+
+/* lpdi p,i; mov */
+static int
+fuse_lpdi_mov (struct i89 *iop, int ch, const struct di *di)
+{
+	uint32_t pc = CHAN.regs[TP];
+	uint16_t insn = di[0].insn;
+	int8_t offset;
+	int ret;
+
+	iop->cycles += clocks[2];
+	CHAN.regs[TP] += di[0].len + di[1].len;
+	REG = segoff (di[0].value);
+	TAG_MEM;
+
+	insn = di[1].insn;
+	offset = OFFSET(di[1].disp);
+	ret = exec (iop, ch, insn, offset, di[1].value);
+	if (ret)
+		return ret;
+
+	return fused (iop, ch, di, pc, offset);
+}
+
+static int
+same_reg (const struct di *di)
+{
+	return ((di[0].insn ^ di[1].insn) & 0x00e0) == 0;
+}
+
+static const struct fusion {
+	uint8_t op[2];
+	int (*match)(const struct di *di);
+	int (*fn)(struct i89 *iop, int ch, const struct di *di);
+} fusions[] = {
+	{ { 15, 16 }, same_reg,	fuse_dec_jnz },		/* dec r; jnz r,l */
+	{ { 19, 46 }, NULL,	fuse_mov_jbt },		/* mov m,i; jnbt m,b,l */
+	{ { 19, 47 }, NULL,	fuse_mov_jbt },		/* mov m,i; jbt m,b,l */
+	{ {  2, 19 }, NULL,	fuse_lpdi_mov },	/* lpdi p,i; mov m,i */
+	{ {  2, 32 }, NULL,	fuse_lpdi_mov },	/* lpdi p,i; mov r,m */
+	{ {  2, 33 }, NULL,	fuse_lpdi_mov },	/* lpdi p,i; mov m,r */
+};
+
+static void
+fuse (struct tb *tb)
+{
+	const struct fusion *f;
+	struct di *di;
+	int i;
+
+	for (i = 0; i < tb->n - 1; i++) {
+		di = &tb->di[i];
+		for (f = fusions; f < fusions + sizeof(fusions) / sizeof(*fusions); f++) {
+			if ((di[0].insn >> 10) == f->op[0] &&
+			    (di[1].insn >> 10) == f->op[1] &&
+			    (f->match == NULL || f->match (di))) {
+				di->fn = f->fn;
+				i++;
+				break;
+			}
+		}
+	}
+}
+
+static struct tb *
+translate (struct i89 *iop, uint32_t addr)
+{
+	const struct i89_tc *shared = iop->tc->shared;
+	unsigned hash = (addr ^ (addr >> 10)) % TB_HASH;
+	struct tb *tb = &iop->tc->tb[hash];
+	uint8_t *page = iop->map[PAGE(addr)];
+	uint32_t pc = addr;
+	struct di *di;
+	int len;
+
+	if (tb->addr == addr && tb->src == page)
+		return tb;
+	if (page == NULL || addr > 0xfffff)
+		return NULL;
+	if (shared && shared->tb[hash].addr == addr && shared->tb[hash].src == page) {
+		iop->pflags[PAGE(addr)] |= I89_PAGE_CODE;
+		remap (iop, PAGE(addr));
+		return (struct tb *)&shared->tb[hash];
+	}
+
+	tb->n = 0;
+	tb->next[0] = tb->next[1] = NULL;
+	/* Blocks don't cross pages: the next one may be mapped elsewhere. */
+	while (tb->n < TB_INSNS && PAGE(pc) == PAGE(addr)) {
+		di = &tb->di[tb->n];
+		di->fn = NULL;
+		len = decode (page + PAGE_OFF(pc), I89_PAGE_SIZE - PAGE_OFF(pc), di);
+		if (len == 0 || !valid (di->insn))
+			break;
+		tb->n++;
+		pc += len;
+		if (branch (di->insn))
+			break;
+	}
+	if (tb->n == 0)
+		return NULL;
+
+	fuse (tb);
+	tb->addr = addr;
+	tb->end = pc;
+	tb->src = page;
+	tb->verified = 0;
+	iop->pflags[PAGE(addr)] |= I89_PAGE_CODE;
+	remap (iop, PAGE(addr));
+
+	return tb;
 }
 
 /*
- * This fetches an instruction and its argument.
- * It optionally validates, prints and executes it.
+ * Run translated blocks for as long as the channel stays in them.
+ * Returns I89_OK with CHAN.regs[TP] pointing to something that
+ * needs the interpreter, or when the cycles run out.
+ */
+
+static inline int
+frozen (struct i89 *iop, const struct tb *tb)
+{
+	const struct i89_tc *shared = iop->tc->shared;
+
+	return shared && tb >= shared->tb && tb < shared->tb + TB_HASH;
+}
+
+/* Whether the instructions of a block need no checks. */
+static int
+tb_verified (struct i89 *iop, struct tb *tb)
+{
+	uint32_t addr = tb->addr;
+	int i;
+
+	for (i = 0; i < tb->n; i++) {
+		/* Another page may be mapped elsewhere, and verified apart. */
+		if (PAGE(addr) != PAGE(tb->addr) || !verified (iop, addr))
+			return 0;
+		addr += tb->di[i].len;
+	}
+
+	return 1;
+}
+
+static int
+run_tc (struct i89 *iop, int ch, uint64_t end, int check)
+{
+	struct tb *tb, *prev = NULL;
+	const struct di *di;
+	uint32_t addr, pc;
+	int ret, i;
+
+	while (iop->cycles < end && !CHAN.park && !CHAN.dma && !CHAN.halt && !TAG(TP)) {
+		addr = CHAN.regs[TP];
+		tb = prev ? prev->next[addr != prev->end] : NULL;
+		/* Breakpoints are checked by the interpreter. */
+		if (iop->pflags[PAGE(addr)] & I89_PAGE_BREAK)
+			return I89_OK;
+		if (tb == NULL || tb->addr != addr || tb->src != iop->map[PAGE(addr)]) {
+			tb = translate (iop, addr);
+			if (tb == NULL)
+				return I89_OK;
+			if (prev && prev->addr != TB_NONE && !frozen (iop, prev))
+				prev->next[addr != prev->end] = tb;
+		}
+		/* The interpreter checks what has not been verified. */
+		if (check && !tb->verified) {
+			if (!tb_verified (iop, tb))
+				return I89_OK;
+			if (!frozen (iop, tb))
+				tb->verified = 1;
+		}
+
+		pc = addr;
+		for (i = 0; i < tb->n && iop->cycles < end; i++) {
+			di = &tb->di[i];
+			/* A pending transfer starts right after the first
+			 * instruction; and don't run past the budget. */
+			if (di->fn && !CHAN.xfer && iop->cycles + clocks[di->insn >> 10] < end) {
+				ret = di->fn (iop, ch, di);
+				pc += di->len;
+				di++;
+				i++;
+			} else {
+				ret = exec_di (iop, ch, di);
+			}
+			if (iop->hit.kind && ret != I89_ERROR)
+				return I89_WATCH;
+			if (ret)
+				return ret;
+			pc += di->len;
+			/* Jumped away, or the block has been overwritten,
+			 * or its page replaced with a private copy. */
+			if (CHAN.regs[TP] != pc || tb->addr != addr ||
+			    tb->src != iop->map[PAGE(addr)])
+				break;
+		}
+		prev = tb;
+	}
+
+	return I89_OK;
+}
+
+int
+i89_compare (const struct i89 *a, const struct i89 *b)
+{
+	int ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		if (memcmp (a->chan[ch].regs, b->chan[ch].regs, sizeof(a->chan[ch].regs)) ||
+		    a->chan[ch].tags != b->chan[ch].tags ||
+		    a->chan[ch].wid != b->chan[ch].wid ||
+		    a->chan[ch].xfer != b->chan[ch].xfer ||
+		    a->chan[ch].dma != b->chan[ch].dma)
+			return -1;
+	}
+
+	return a->cycles == b->cycles ? 0 : -1;
+}
+
+/* Count the edge from the previous instruction to the one at TP. */
+static inline void
+cover (struct i89 *iop, int ch)
+{
+	uint32_t tp = (CHAN.regs[TP] & 0xfffff) ^ (ch << 19);
+
+	iop->cov[(iop->cov_prev ^ tp) % iop->ncov]++;
+	iop->cov_prev = tp >> 1;
+}
+
+/*
+ * Execute one instruction on a channel or, if the channel is in the
+ * middle of a transfer, advance the transfer by iop->burst cycles.
+ */
+
+/*
+ * Check for a breakpoint at TP. Resuming from one executes the
+ * instruction it is on.
+ */
+
+static int
+breakpoint (struct i89 *iop, int ch)
+{
+	struct i89_watch *wp = iop->watch;
+	uint32_t tp = CHAN.regs[TP] & 0xfffff;
+
+	if (TAG(TP))
+		return 0;
+	if (wp->resume[ch] == tp + 1) {
+		wp->resume[ch] = 0;
+		return 0;
+	}
+
+	watched (iop, wp->exec[PAGE(tp)], I89_WATCH_EXEC, tp);
+	if (iop->hit.kind == 0)
+		return 0;
+	wp->resume[ch] = tp + 1;
+	return 1;
+}
+
+int
+i89_step (struct i89 *iop, int ch, enum i89_flags flags)
+{
+	int ret;
+
+	if (CHAN.park) {
+		/* Account for one turn of the loop. */
+		if (iop->undo)
+			checkpoint (iop, ch, UNDO_POLL);
+		iop->cycles += CHAN.poll_clk;
+		if (iop->cycles >= CHAN.park_until)
+			unpark (iop, ch);
+		return I89_POLL;
+	}
+	if (CHAN.halt && !dispatch (iop, ch))
+		return I89_HALT;
+
+	iop->hit.kind = 0;
+	if (CHAN.dma) {
+		ret = i89_xfer (iop, ch, iop->burst);
+	} else {
+		if ((iop->pflags[PAGE(CHAN.regs[TP])] & I89_PAGE_BREAK) && breakpoint (iop, ch))
+			return I89_BREAK;
+		if (iop->undo)
+			checkpoint (iop, ch, UNDO_INSN);
+		if (iop->cov)
+			cover (iop, ch);
+		ret = do_insn (iop, ch, flags, 0, 0);
+	}
+
+	if (iop->hit.kind && ret != I89_ERROR)
+		return I89_WATCH;
+	return ret;
+}
+
+/*
+ * Run a channel for (at least) the given number of clock cycles.
+ * Returns I89_OK if the cycles ran out, I89_POLL if they ran out while
+ * the channel was parked in a polling loop, or whatever stopped the
+ * channel earlier.
+ */
+
+int
+i89_run (struct i89 *iop, int ch, enum i89_flags flags, uint64_t cycles)
+{
+	uint64_t end = iop->cycles + cycles;
+	uint64_t turns, before;
+	int check, ret;
+
+	iop->hit.kind = 0;
+	while (iop->cycles < end) {
+		if (CHAN.park) {
+			/* Skip whole turns of the loop up to the deadline. */
+			if (CHAN.park_until < end) {
+				turns = CHAN.park_until - iop->cycles;
+			} else {
+				turns = end - iop->cycles;
+			}
+			turns = (turns + CHAN.poll_clk - 1) / CHAN.poll_clk;
+			if (iop->undo)
+				checkpoint (iop, ch, UNDO_POLL);
+			iop->cycles += turns * CHAN.poll_clk;
+			if (iop->cycles < CHAN.park_until)
+				return I89_POLL;
+			unpark (iop, ch);
+			continue;
+		}
+
+		/* Plain execution can use the translation cache, unless each
+		 * instruction needs to be journaled or covered. So can checked
+		 * execution, of verified code. */
+		check = flags == (I89_EXEC | I89_CHECK) && iop->verify;
+		if (iop->tc && (flags == I89_EXEC || check) && !iop->undo && !iop->cov) {
+			before = iop->cycles;
+			ret = run_tc (iop, ch, end, check);
+			if (ret != I89_OK && ret != I89_DMA)
+				return ret;
+			if (iop->cycles != before)
+				continue;
+		}
+
+		ret = i89_step (iop, ch, flags);
+		if (ret != I89_OK && ret != I89_DMA)
+			return ret;
+	}
+
+	return I89_OK;
+}
+
+/*
+ * Lockstep execution of many IOPs that run the same program, say for a
+ * parameter sweep. The channel registers of all the lanes are kept by
+ * register rather than by IOP, so that an instruction that only works
+ * on registers is carried out for all lanes that are at it in one pass
+ * over each array, which the compiler can turn into SIMD code.
  *
- * Processing MOV M,M is somewhat peculiar, because it's in fact two
- * instructions: one for load, another for store. Handling it involves
- * recursion, passing along the value being transferred and context for
- * pretty printing.
+ * Each step runs the lanes at the lowest TP. Lanes that branched ahead
+ * wait there for the others to catch up, which is where the paths of
+ * most programs join again. Anything that touches memory, I/O space or
+ * the channel state other than the registers is run for each of the
+ * lanes by the interpreter, as are lanes that are in a transfer, parked,
+ * watched, journaled or covered. On a loop of register instructions,
+ * tests/bench has 64 lanes run about three times as fast as they do
+ * one by one on the interpreter, and a little slower than one by one
+ * with the translation cache.
  */
 
+struct i89_lockstep {
+	struct i89 **iop;
+	unsigned n;
+	int ch;
+
+	/* Channel registers, tags and clocks, by lane. */
+	uint32_t *regs[NUM_REGS];
+	uint16_t *tags;
+	uint64_t *cycles;
+
+	uint64_t *end;
+	uint32_t *act;		/* ~0 for lanes in the step */
+	uint8_t *ok;		/* Can run in lockstep */
+	uint8_t *polling;	/* Has a polling loop tracked */
+	int *status;
+
+	struct i89_lockstep_stats stats;
+};
+
+struct i89_lockstep *
+i89_lockstep_new (struct i89 **iops, unsigned n, int ch)
+{
+	struct i89_lockstep *ls;
+	int r;
+
+	ls = calloc (1, sizeof(*ls));
+	if (ls == NULL)
+		return NULL;
+
+	ls->n = n;
+	ls->ch = ch;
+	ls->iop = malloc (n * sizeof(*ls->iop));
+	for (r = 0; r < NUM_REGS; r++)
+		ls->regs[r] = calloc (n, sizeof(**ls->regs));
+	ls->tags = calloc (n, sizeof(*ls->tags));
+	ls->cycles = calloc (n, sizeof(*ls->cycles));
+	ls->end = calloc (n, sizeof(*ls->end));
+	ls->act = calloc (n, sizeof(*ls->act));
+	ls->ok = calloc (n, sizeof(*ls->ok));
+	ls->polling = calloc (n, sizeof(*ls->polling));
+	ls->status = calloc (n, sizeof(*ls->status));
+	if (ls->iop == NULL || ls->tags == NULL || ls->cycles == NULL ||
+	    ls->end == NULL || ls->act == NULL || ls->ok == NULL ||
+	    ls->polling == NULL || ls->status == NULL) {
+		i89_lockstep_free (ls);
+		return NULL;
+	}
+	for (r = 0; r < NUM_REGS; r++) {
+		if (ls->regs[r] == NULL) {
+			i89_lockstep_free (ls);
+			return NULL;
+		}
+	}
+
+	memcpy (ls->iop, iops, n * sizeof(*ls->iop));
+	return ls;
+}
+
+void
+i89_lockstep_free (struct i89_lockstep *ls)
+{
+	int r;
+
+	for (r = 0; r < NUM_REGS; r++)
+		free (ls->regs[r]);
+	free (ls->iop);
+	free (ls->tags);
+	free (ls->cycles);
+	free (ls->end);
+	free (ls->act);
+	free (ls->ok);
+	free (ls->polling);
+	free (ls->status);
+	free (ls);
+}
+
+/* Pick up the state of a lane's IOP, or put it back. */
+static void
+lane_gather (struct i89_lockstep *ls, unsigned l)
+{
+	struct i89 *iop = ls->iop[l];
+	int ch = ls->ch;
+	int r;
+
+	for (r = 0; r < NUM_REGS; r++)
+		ls->regs[r][l] = CHAN.regs[r];
+	ls->tags[l] = CHAN.tags;
+	ls->cycles[l] = iop->cycles;
+	ls->ok[l] = !CHAN.dma && !CHAN.xfer && !CHAN.park && !CHAN.halt &&
+		    !iop->undo && !iop->cov && !iop->watch;
+	ls->polling[l] = CHAN.poll_clk || CHAN.npoll;
+}
+
+static void
+lane_scatter (struct i89_lockstep *ls, unsigned l)
+{
+	struct i89 *iop = ls->iop[l];
+	int ch = ls->ch;
+	int r;
+
+	for (r = 0; r < NUM_REGS; r++)
+		CHAN.regs[r] = ls->regs[r][l];
+	CHAN.tags = ls->tags[l];
+	iop->cycles = ls->cycles[l];
+}
 
+/* Whether the instruction only works on the channel registers. */
 static int
-do_insn (struct i89 *iop, int ch, enum i89_flags flags, uint32_t value, int column)
+lane_op (const struct di *di)
 {
-	int8_t offset, sdisp;
-	uint16_t insn;
+	uint16_t insn = di->insn;
 
-	PRINT_ADDR ("%05x: ", CHAN.regs[TP]);
+	switch (opcode) {
+	case  0:
+		return insn == 0x0000;
+	case  2:
+		return pppregs[ppp] != TP && pppregs[ppp] != BAD_REG;
+	case  8:
+		/* Not a jmp that a polling loop could be made of */
+		return rrr != TP || ((int16_t)di->value != 0 &&
+				     (int16_t)di->value != -di->len);
+	case  9: case 10: case 11: case 12: case 14: case 15:
+	case 16: case 17:
+		return rrr != TP;
+	}
 
-	/* Fetch the instruction. */
-	insn = FETCH16;
-	PRINT_DATA ("%04x ", insn);
+	return 0;
+}
 
-	/* Displacement/offset */
-	switch (aa) {
-	case 0:
-		offset = 0;
+/* Carry out a register instruction at tp for the lanes in act. */
+static void
+lane_exec (struct i89_lockstep *ls, const struct di *di, uint32_t tp)
+{
+	const uint32_t *act = ls->act;
+	uint32_t *reg, *tpr = ls->regs[TP];
+	uint16_t *tags = ls->tags;
+	uint16_t insn = di->insn;
+	uint32_t value = di->value;
+	uint32_t next = tp + di->len;
+	uint32_t taken = next + (int16_t)value;
+	uint64_t clk = clocks[opcode];
+	unsigned l, n = ls->n;
+	uint16_t bit = 1 << rrr;
+
+	reg = ls->regs[rrr];
+
+	switch (opcode) {
+	case  0:
 		break;
-	case 1:
-		offset = FETCH;
-		PRINT_DATA ("%02x ", offset);
+	case  8:
+		if (rrr == TP)
+			next = taken;
+		else for (l = 0; l < n; l++)
+			reg[l] += value & act[l];
 		break;
-	case 2:
-		offset = CHAN.regs[IX];
+	case  2:
+		value = segoff (value);
+		for (l = 0; l < n; l++) {
+			reg[l] = (reg[l] & ~act[l]) | (value & act[l]);
+			tags[l] &= ~(bit & act[l]);
+		}
 		break;
-	case 3:
-		offset = CHAN.regs[IX]++;
+	case  9:
+		for (l = 0; l < n; l++)
+			reg[l] |= value & act[l];
 		break;
-	}
-
-	/* Immediate value */
-	switch (wb) {
-	case 0:
-		/* None. Second part of mov m,m takes this from previous
-		 * half instruction, passed as an argument. */
+	case 10:
+		for (l = 0; l < n; l++)
+			reg[l] &= value | ~act[l];
 		break;
-	case 1:
-		/* Immediate byte. */
-		value = FETCH;
-		PRINT_DATA ("%02x ", value);
-
-		/* Sign extend */
-		value = (int8_t)value;
+	case 11:
+		for (l = 0; l < n; l++)
+			reg[l] ^= act[l];
 		break;
-	case 2:
-		/* Immediate word (or more). */
-		value = FETCH16;
-		if ((insn & 0xff00) == 0x0800) {
-			/* lpdi takes two more immediate bytes */
-			value |= FETCH16 << 16;
-			PRINT_DATA ("%08x ", value);
-		} else {
-			PRINT_DATA ("%04x ", value);
-			/* Sign extend */
-			value = (int16_t)value;
+	case 12:
+		for (l = 0; l < n; l++) {
+			reg[l] = (reg[l] & ~act[l]) | (value & act[l]);
+			tags[l] |= bit & act[l];
 		}
 		break;
-	case 3:
-		/* Used by tsl instruction only. */
-		value = FETCH;
-		PRINT_DATA ("%02x ", value);
-		sdisp = FETCH;
-		PRINT_DATA ("%02x ", sdisp);
-		sdisp = (int16_t)sdisp;
+	case 14:
+		for (l = 0; l < n; l++)
+			reg[l] += 1 & act[l];
+		break;
+	case 15:
+		for (l = 0; l < n; l++)
+			reg[l] -= 1 & act[l];
+		break;
+	case 16:
+		for (l = 0; l < n; l++) {
+			if (act[l])
+				tpr[l] = reg[l] ? taken : next;
+		}
+		break;
+	case 17:
+		for (l = 0; l < n; l++) {
+			if (act[l])
+				tpr[l] = reg[l] ? next : taken;
+		}
 		break;
 	}
 
-	/* Sanity checks */
-        if (flags & I89_CHECK) {
-		if (validate (insn, value))
-			return -1;
-		if ((flags & _I89_STORE) && (opcode != 51)) {
-			fprintf (stderr, "mov/store must follow mov/load\n");
-			return -1;
-		}
-	}
+	for (l = 0; l < n; l++)
+		ls->cycles[l] += clk & act[l];
+	if (opcode != 16 && opcode != 17) {
+		for (l = 0; l < n; l++)
+			tpr[l] = (tpr[l] & ~act[l]) | (next & act[l]);
+	}
+}
+
+/* Run a lane's next step through the interpreter. */
+static void
+lane_step (struct i89_lockstep *ls, unsigned l, enum i89_flags flags)
+{
+	int ret;
+
+	lane_scatter (ls, l);
+	ret = i89_step (ls->iop[l], ls->ch, flags);
+	lane_gather (ls, l);
+	ls->stats.scalar++;
+
+	if (ret != I89_OK && ret != I89_DMA && ret != I89_POLL)
+		ls->status[l] = ret;
+}
+
+/*
+ * Run all lanes for (at least) the given number of clock cycles each.
+ * Returns the number of lanes that stopped before that; see
+ * i89_lockstep_status() for why.
+ */
+
+unsigned
+i89_lockstep_run (struct i89_lockstep *ls, enum i89_flags flags, uint64_t cycles)
+{
+	const uint8_t *code, *page;
+	struct i89 *iop;
+	uint32_t tp, min;
+	unsigned l, n = ls->n, live, nact, stopped;
+	struct di di;
+	int vec;
+
+	for (l = 0; l < n; l++) {
+		lane_gather (ls, l);
+		ls->end[l] = ls->cycles[l] + cycles;
+		ls->status[l] = I89_OK;
+		ls->iop[l]->hit.kind = 0;
+	}
+
+	for (;;) {
+		/* The lanes at the lowest TP go next. */
+		live = 0;
+		min = UINT32_MAX;
+		for (l = 0; l < n; l++) {
+			if (ls->status[l] == I89_OK && ls->cycles[l] < ls->end[l]) {
+				live++;
+				if (ls->regs[TP][l] < min)
+					min = ls->regs[TP][l];
+			}
+		}
+		if (live == 0)
+			break;
+
+		nact = 0;
+		for (l = 0; l < n; l++) {
+			ls->act[l] = ls->status[l] == I89_OK && ls->cycles[l] < ls->end[l] &&
+				     ls->regs[TP][l] == min ? ~0 : 0;
+			nact += ls->act[l] & 1;
+		}
+		ls->stats.steps++;
+
+		/* Decode it from the first lane that can run in lockstep. */
+		vec = 0;
+		code = NULL;
+		tp = min;
+		for (l = 0; l < n && flags == I89_EXEC; l++) {
+			if (!ls->act[l] || !ls->ok[l] || (ls->tags[l] & (1 << TP)))
+				continue;
+			iop = ls->iop[l];
+			if (tp > 0xfffff)
+				break;
+			code = iop->map[PAGE(tp)];
+			if (code == NULL || (iop->pflags[PAGE(tp)] & I89_PAGE_BREAK))
+				break;
+			code += PAGE_OFF(tp);
+			vec = decode (code, I89_PAGE_SIZE - PAGE_OFF(tp), &di) &&
+			      valid (di.insn) && lane_op (&di);
+			break;
+		}
+
+		/* Lanes that can't join in, or have other code there, are
+		 * stepped on their own. So are the ones that might be in a
+		 * polling loop, for it to be tracked. */
+		for (l = 0; l < n; l++) {
+			if (!ls->act[l])
+				continue;
+			if (vec && ls->ok[l] && !ls->polling[l] && !(ls->tags[l] & (1 << TP))) {
+				iop = ls->iop[l];
+				page = iop->map[PAGE(tp)];
+				if (page && !(iop->pflags[PAGE(tp)] & I89_PAGE_BREAK) &&
+				    (page + PAGE_OFF(tp) == code ||
+				     memcmp (page + PAGE_OFF(tp), code, di.len) == 0))
+					continue;
+			}
+			ls->act[l] = 0;
+			nact--;
+			lane_step (ls, l, flags);
+		}
+
+		if (nact) {
+			lane_exec (ls, &di, min);
+			ls->stats.vector += nact;
+		}
+	}
+
+	stopped = 0;
+	for (l = 0; l < n; l++) {
+		lane_scatter (ls, l);
+		if (ls->status[l] != I89_OK)
+			stopped++;
+	}
+
+	return stopped;
+}
+
+/*
+ * What stopped a lane in the last i89_lockstep_run(): I89_OK if it ran
+ * for all the cycles, otherwise what i89_step() returned.
+ */
+
+int
+i89_lockstep_status (struct i89_lockstep *ls, unsigned lane)
+{
+	return ls->status[lane];
+}
+
+void
+i89_lockstep_stats (struct i89_lockstep *ls, struct i89_lockstep_stats *stats)
+{
+	*stats = ls->stats;
+}
+
+/*
+ * Reverse execution.
+ */
+
+/*
+ * Keep the state of the last steps steps, and up to bytes memory writes.
+ * Both are rounded up to a power of two. Returns -1 if out of memory, or
+ * if that is more than there can be.
+ */
+int
+i89_undo_enable (struct i89 *iop, unsigned steps, unsigned bytes)
+{
+	struct i89_undo *u;
+	unsigned page;
 
-	/* mov m,m (load part) */
-	if (opcode == 36) {
-		if (do_insn(iop, ch, _I89_STORE | flags & ~I89_PRINT_ADDR, rd, column))
-			return -1;
-		column = 0;
-	}
+	i89_undo_disable (iop);
 
-        if (flags & I89_PRINT_INSN) {
-		if (column && (flags & I89_PRINT_DATA)) {
-			for (; column < 20; column++)
-				putchar (' ');
-		}
-		if (print (insn, offset, value, sdisp))
-			return -1;
-		/* mov m,m (store part) */
-		if (opcode != 51)
-			putchar ('\n');
+	if (steps > 1u << 31 || bytes > 1u << 31)
+		return -1;
+
+	u = calloc (1, sizeof(*u));
+	if (u == NULL)
+		return -1;
+
+	/* Counters wrap; keep the ring sizes dividing their range. */
+	for (u->nstep = 1; u->nstep < steps; u->nstep <<= 1)
+		;
+	for (u->nmem = 16; u->nmem < bytes; u->nmem <<= 1)
+		;
+
+	u->step = calloc (u->nstep, sizeof(*u->step));
+	u->mem = calloc (u->nmem, sizeof(*u->mem));
+	if (u->step == NULL || u->mem == NULL) {
+		free (u->step);
+		free (u->mem);
+		free (u);
+		return -1;
 	}
 
-	if ((flags & I89_EXEC) == 0)
-		return 0;
+	iop->undo = u;
+	for (page = 0; page < I89_PAGES; page++)
+		remap (iop, page);
+	return 0;
+}
 
-	switch (opcode) {
+void
+i89_undo_disable (struct i89 *iop)
+{
+	struct i89_undo *u = iop->undo;
+	unsigned page;
 
-	case  2: REG = segoff (value); TAG_MEM;	break;	/* lpdi p,i */
-	case  8: REG += value;			break;	/* addi r,i */
-	case  9: REG |= value;			break;	/* ori r,i */
-	case 10: REG &= value;			break;	/* andi r,i */
-	case 11: REG = ~REG;			break;	/* not r */
-	case 12: REG = value; TAG_IO;		break;	/* movi r,i */
-	case 14: REG++;				break;	/* inc r */
-	case 15: REG--;				break;	/* dec r */
-	case 16: if (REG) JUMP;			break;	/* jnz r */
-	case 17: if (REG == 0) JUMP;		break;	/* jz r */
-	case 18: return 1;				/* hlt */
-	case 19: wr(value);			break;	/* mov m,i */
-	case 32: REG = rd; TAG_IO;		break;	/* mov r,m */
-	case 33: wr(REG);			break;	/* mov m,r */
-	case 34: REG = segoff (rd32); TAG_MEM;	break;	/* lpd p,m */
-	case 35:					/* movp p,m */
-		REG = rd20;
-		if (REG & (1 << 19))
-			TAG_IO;
-		else
-			TAG_MEM;
-		REG = (REG & 0xffff) | ((REG & 0xf00000) >> 4);
-		break;
-	case 36: /* handled above */		break;	/* movp p,m */
-	case 38: wr20(REG20);			break;	/* movp m,p */
-	case 39: wr20(REG20); JUMP;		break;	/* call */
-	case 40: REG += rd;			break;	/* add r,m */
-	case 41: REG |= rd;			break;	/* or r,m */
-	case 42: REG &= rd;			break;	/* and r,m */
-	case 43: REG = ~rd;			break;	/* not r,m */
-	case 44: if (MASK(rd) == 0) JUMP;	break;	/* jmce */
-	case 45: if (MASK(rd) != 0) JUMP;	break;	/* jmcne */
-	case 46: if (!(rd & BIT)) JUMP;		break;	/* jnbt */
-	case 47: if (rd & BIT) JUMP;		break;	/* jbt */
-	case 48: wr(rd + value);		break;	/* add m,i */
-	case 49: wr(rd | value);		break;	/* or m,i */
-	case 50: wr(rd & value);		break;	/* and m,i */
-	case 51: wr(value);			break;	/* mov m,m (store part) */
-	case 52: wr(rd + REG);			break;	/* add m,r */
-	case 53: wr(rd | REG);			break;	/* or m,r */
-	case 54: wr(rd & REG);			break;	/* and m,r */
-	case 55: wr(~rd);			break;	/* not m */
-	case 56: if (rd) JUMP;			break;	/* jnz m */
-	case 57: if (rd == 0) JUMP;		break;	/* jz m */
-	case 58: wr(rd + 1);			break;	/* inc m */
-	case 59: wr(rd - 1);			break;	/* dec m */
-	case 61: wr(rd | 1 << bbb);		break;	/* setb */
-	case 62: wr(rd & ~ BIT);		break;	/* clr */
+	if (u == NULL)
+		return;
 
-	case  0:
-		/* Special instruction */
-		if (insn == 0x0000) {
-			/* nop */
-			break;
-		} else if (insn == 0x0040) {
-			if (iop->sintr)
-				iop->sintr (iop);
-			break;
-		} else if (insn == 0x0060) {
-			CHAN.xfer = 1;
-			/* Transfer begins at the end of next insn. */
-			return 0;
-		} else if (insn & 0x0080) {
-			CHAN.wid = (insn & 0x0060) >> 5;
-			break;
-		}
-		/* Fallthrough. */
-	default:
-		fprintf (stderr, "Unknown: %d\n", opcode);
+	iop->undo = NULL;
+	for (page = 0; page < I89_PAGES; page++)
+		remap (iop, page);
+	free (u->step);
+	free (u->mem);
+	free (u);
+}
+
+static void
+unjournal (struct i89 *iop, const struct undo_mem *m)
+{
+	unsigned page = PAGE(m->addr);
+
+	if (iop->pflags[page] & I89_PAGE_CODE)
+		invalidate (iop, page);
+	if (iop->map[page] && !(iop->pflags[page] & I89_PAGE_RO))
+		iop->map[page][PAGE_OFF(m->addr)] = m->old;
+	else
+		bus_write8 (iop, m->addr, m->old);
+}
+
+/*
+ * Undo the last instruction, transfer cycle or channel attention, on
+ * whichever channel it was. Returns the channel, or -1 if the journal
+ * has nothing more.
+ */
+
+int
+i89_step_back (struct i89 *iop)
+{
+	struct i89_undo *u = iop->undo;
+	const struct undo_step *s;
+	int ch;
+
+	if (u == NULL || u->head == u->tail)
 		return -1;
+
+	s = &u->step[--u->head % u->nstep];
+	while (u->mhead != s->mem)
+		unjournal (iop, &u->mem[--u->mhead % u->nmem]);
+
+	ch = s->ch;
+	memcpy (CHAN.regs, s->regs, sizeof(CHAN.regs));
+	iop->cycles = s->cycles;
+	CHAN.tags = s->tags;
+	CHAN.wid = s->wid;
+	CHAN.xfer = s->xfer;
+	CHAN.dma = s->dma;
+	CHAN.eop = s->eop;
+	CHAN.park = s->park;
+	CHAN.park_until = s->park_until;
+	CHAN.poll_tp = s->poll_tp;
+	CHAN.poll_clk = s->poll_clk;
+	memcpy (CHAN.poll, s->poll, sizeof(CHAN.poll));
+	CHAN.npoll = s->npoll;
+	CHAN.halt = s->halt;
+	CHAN.is = s->is;
+	CHAN.nointr = s->nointr;
+	CHAN.prio = s->prio;
+	CHAN.blimit = s->blimit;
+	CHAN.ccb = s->ccb;
+
+	if (s->kind == UNDO_ATTN) {
+		memcpy (CHAN.susp.regs, s->susp_regs, sizeof(CHAN.susp.regs));
+		CHAN.susp.tags = s->susp_tags;
+		CHAN.susp.xfer = s->susp_xfer;
+		CHAN.susp.dma = s->susp_dma;
+		CHAN.susp.valid = s->susp_valid;
 	}
 
-	if (CHAN.xfer)
-		return dma (iop, ch);
+	return ch;
+}
 
-	return 0;
+/*
+ * Step back until the channel is about to execute the instruction at
+ * tp again. Returns -1, having undone all there was, if it doesn't get
+ * there.
+ */
+
+int
+i89_run_back_to (struct i89 *iop, int ch, uint32_t tp)
+{
+	struct i89_undo *u = iop->undo;
+	int kind;
+
+	while (u && u->head != u->tail) {
+		kind = u->step[(u->head - 1) % u->nstep].kind;
+		if (i89_step_back (iop) == ch && kind == UNDO_INSN &&
+		    (CHAN.regs[TP] & 0xfffff) == (tp & 0xfffff))
+			return 0;
+	}
+
+	return -1;
 }
 
 int
 i89_insn (struct i89 *iop, enum i89_flags flags)
 {
-	do_insn (iop, 0, flags, 0, 0);
+	return i89_step (iop, 0, flags);
 }
 
 static void
@@ -769,17 +3196,15 @@ i89_dump (struct i89 *iop)
 	dump_chan (iop, 1);
 }
 
-static uint32_t
-memptr (struct i89 *iop, uint32_t addr)
-{
-	return segoff(in (iop, addr, 0, 3));
-}
+/*
+ * Locate the channel control block through the SCP and the SCB, like the
+ * first channel attention after reset does.
+ */
 
-void
-i89_attn (struct i89 *iop, int ch)
+uint32_t
+i89_cb (struct i89 *iop)
 {
 	uint32_t scb;
-	uint32_t pb0, pb1;
 
 	if (iop->cb == 0) {
 		in8 (iop, 0xffff6, 0); // sys bus
@@ -789,8 +3214,372 @@ i89_attn (struct i89 *iop, int ch)
 		iop->cb = memptr (iop, scb + 2);
 	}
 
-	in8 (iop, iop->cb + 8 * ch + 0, 0); // ccw0
-	in8 (iop, iop->cb + 8 * ch + 1, 0); // busy0
-	CHAN.regs[PP] = memptr (iop, iop->cb + 0 + 2);
-	CHAN.regs[TP] = memptr (iop, CHAN.regs[PP]);
+	return iop->cb;
+}
+
+/*
+ * Channel commands.
+ *
+ * Suspend saves TP and the PSW in the first four bytes of the parameter
+ * block, resume loads them from there. The 8089 leaves the rest of the
+ * channel alone while it is suspended. Here, the registers are also kept
+ * aside, so that the host can start an urgent program on the suspended
+ * channel and then resume the preempted one: once it points the CB back
+ * to the parameter block of the suspended program.
+ */
+
+#define CCW_CF		0x07
+#define CCW_ICF		0x18
+#define CCW_B		0x20
+#define CCW_P		0x80
+
+#define CF_UPDATE	0
+#define CF_LOCAL	1
+#define CF_SYSTEM	3
+#define CF_RESUME	5
+#define CF_SUSPEND	6
+#define CF_HALT		7
+
+#define ICF_ACK		0x08
+#define ICF_ENABLE	0x10
+#define ICF_DISABLE	0x18
+
+#define PSW_D		0x01
+#define PSW_S		0x02
+#define PSW_IC		0x08
+#define PSW_IS		0x10
+#define PSW_B		0x20
+#define PSW_XF		0x40
+#define PSW_P		0x80
+
+static void
+busy (struct i89 *iop, int ch, uint8_t value)
+{
+	out8 (iop, iop->cb + 8 * ch + 1, value, 0);
+}
+
+static void
+suspend (struct i89 *iop, int ch)
+{
+	uint8_t psw;
+
+	psw = CHAN.wid;
+	psw |= CHAN.nointr ? 0 : PSW_IC;
+	psw |= CHAN.is ? PSW_IS : 0;
+	psw |= CHAN.blimit ? PSW_B : 0;
+	psw |= CHAN.xfer || CHAN.dma ? PSW_XF : 0;
+	psw |= CHAN.prio ? PSW_P : 0;
+	out (iop, CHAN.regs[PP], CHAN.regs[TP] & 0xffff, 0, 1);
+	out8 (iop, CHAN.regs[PP] + 2, (CHAN.regs[TP] & 0xf0000) >> 12 | TAG(TP) << 3, 0);
+	out8 (iop, CHAN.regs[PP] + 3, psw, 0);
+
+	memcpy (CHAN.susp.regs, CHAN.regs, sizeof(CHAN.regs));
+	CHAN.susp.tags = CHAN.tags;
+	CHAN.susp.xfer = CHAN.xfer;
+	CHAN.susp.dma = CHAN.dma;
+	CHAN.susp.valid = 1;
+
+	CHAN.halt = 1;
+	CHAN.park = 0;
+}
+
+static void
+resume (struct i89 *iop, int ch, uint32_t pb)
+{
+	uint32_t tp;
+	uint8_t psw;
+
+	if (CHAN.susp.valid && CHAN.susp.regs[PP] == pb) {
+		memcpy (CHAN.regs, CHAN.susp.regs, sizeof(CHAN.regs));
+		CHAN.tags = CHAN.susp.tags;
+		CHAN.xfer = CHAN.susp.xfer;
+		CHAN.dma = CHAN.susp.dma;
+	}
+	CHAN.susp.valid = 0;
+
+	tp = in (iop, pb, 0, 2);
+	psw = in8 (iop, pb + 3, 0);
+	CHAN.regs[PP] = pb;
+	CHAN.regs[TP] = (tp & 0xffff) | ((tp & 0xf00000) >> 4);
+	CHAN.tags &= ~(1 << PP | 1 << TP);
+	CHAN.tags |= !!(tp & (1 << 19)) << TP;
+	CHAN.wid = psw & (PSW_S | PSW_D);
+	CHAN.nointr = !(psw & PSW_IC);
+	CHAN.is = !!(psw & PSW_IS);
+	CHAN.halt = 0;
+}
+
+void
+i89_attn (struct i89 *iop, int ch)
+{
+	uint32_t ccb = i89_cb (iop) + 8 * ch;
+	uint8_t ccw;
+
+	if (iop->undo)
+		checkpoint (iop, ch, UNDO_ATTN);
+
+	ccw = in8 (iop, ccb + 0, 0);
+	event (iop, ch, I89_EVENT_ATTN, ccw);
+
+	switch (ccw & CCW_ICF) {
+	case ICF_ACK:
+		CHAN.is = 0;
+		break;
+	case ICF_ENABLE:
+		CHAN.nointr = 0;
+		if (CHAN.is)
+			bus_sintr (iop);
+		break;
+	case ICF_DISABLE:
+		CHAN.nointr = 1;
+		break;
+	}
+	CHAN.blimit = !!(ccw & CCW_B);
+	CHAN.prio = !!(ccw & CCW_P);
+
+	switch (ccw & CCW_CF) {
+	case CF_UPDATE:
+		break;
+	case CF_LOCAL:
+	case CF_SYSTEM:
+		complete (iop, ch);
+		start (iop, ch, memptr (iop, ccb + 2), (ccw & CCW_CF) == CF_LOCAL);
+		CHAN.ccb = 1;
+		busy (iop, ch, 0xff);
+		break;
+	case CF_RESUME:
+		if (!CHAN.halt)
+			break;
+		complete (iop, ch);
+		resume (iop, ch, memptr (iop, ccb + 2));
+		CHAN.ccb = 1;
+		busy (iop, ch, 0xff);
+		break;
+	case CF_SUSPEND:
+		if (CHAN.halt)
+			break;
+		suspend (iop, ch);
+		busy (iop, ch, 0x00);
+		break;
+	case CF_HALT:
+		/* What the block in hand got done is posted as it is. */
+		complete (iop, ch);
+		CHAN.halt = 1;
+		CHAN.park = 0;
+		CHAN.xfer = 0;
+		CHAN.dma = 0;
+		CHAN.eop = 0;
+		busy (iop, ch, 0x00);
+		break;
+	default:
+		/* Reserved. */
+		break;
+	}
+
+	PROBE3(attn, ch, ccw, CHAN.regs[PP]);
+}
+
+/*
+ * Ahead of time verification. The code reachable from an entry point is
+ * walked and each instruction is checked like I89_CHECK does it, and
+ * then some: mov m,m must come in whole, and jumps must stay within the
+ * memory space. The instructions that pass are noted; running with
+ * I89_CHECK then doesn't check them again, and can use the translation
+ * cache for them.
+ *
+ * The walk can't follow movp tp or jumps by computed amounts, nor look
+ * at code that is not mapped or crosses a page. Such code, and anything
+ * that changes, is checked when it runs, and noted if it passes.
+ */
+
+/*
+ * Check the instruction at addr. Returns its length, 0 if it is to be
+ * left for the interpreter, -1 if bad. Where it may jump to is stored in
+ * target.
+ */
+
+static int
+verify_insn (struct i89 *iop, uint32_t addr, struct i89_decoded *d, uint32_t *target)
+{
+	const uint8_t *p = iop->map[PAGE(addr)];
+	int avail = I89_PAGE_SIZE - PAGE_OFF(addr);
+	uint16_t insn, insn2;
+	struct di di;
+	uint32_t raw;
+	int len;
+
+	if (p == NULL || avail < 2)
+		return 0;
+	p += PAGE_OFF(addr);
+	insn = p[0] | (p[1] << 8);
+	len = opcode == 37 ? 2 + (aa == 1) + 2 : length (insn);
+	if (len > avail)
+		return 0;
+
+	if (validate (insn, 0))
+		goto bad;
+	if (opcode == 51) {
+		fprintf (stderr, "mov/store must follow mov/load\n");
+		goto bad;
+	}
+	if (opcode == 36) {
+		if (avail - len < 2)
+			return 0;
+		insn2 = p[len] | (p[len + 1] << 8);
+		if (validate (insn2, 0))
+			goto bad;
+		if ((insn2 >> 10) != 51) {
+			fprintf (stderr, "mov/load must be followed by mov/store\n");
+			goto bad;
+		}
+		if (len + length (insn2) > avail)
+			return 0;
+	}
+
+	if (i89_decode (p, avail, addr, d) == 0) {
+		fprintf (stderr, "Bad instruction\n");
+		goto bad;
+	}
+
+	switch (d->flow) {
+	case I89_FLOW_JUMP:
+	case I89_FLOW_BRANCH:
+	case I89_FLOW_CALL:
+		if (opcode == 37) {
+			raw = addr + d->len + (int8_t)p[d->len - 1];
+		} else {
+			decode (p, avail, &di);
+			if (opcode == 2)
+				raw = segoff (di.value);
+			else
+				raw = addr + d->len + (int16_t)di.value;
+		}
+		if (raw > 0xfffff) {
+			fprintf (stderr, "Jump out of the memory space\n");
+			goto bad;
+		}
+		*target = raw;
+		break;
+	default:
+		break;
+	}
+
+	return d->len;
+
+bad:
+	fprintf (stderr, "%05x: bad instruction %04x\n", addr, insn);
+	return -1;
+}
+
+/*
+ * Verify the program that starts at tp in the memory space. Returns the
+ * number of bad instructions, or -1 if out of memory.
+ */
+
+int
+i89_verify (struct i89 *iop, uint32_t tp)
+{
+	struct i89_decoded d;
+	uint32_t *todo, *tmp, addr, target;
+	unsigned ntodo = 0, size = 64;
+	uint8_t *seen;
+	int bad = 0, len;
+
+	if (iop->verify == NULL) {
+		iop->verify = calloc (1, sizeof(*iop->verify));
+		if (iop->verify == NULL)
+			return -1;
+	}
+
+	seen = calloc (1, 0x100000 / 8);
+	todo = malloc (size * sizeof(*todo));
+	if (seen == NULL || todo == NULL) {
+		free (seen);
+		free (todo);
+		return -1;
+	}
+
+	todo[ntodo++] = tp;
+	while (ntodo) {
+		addr = todo[--ntodo];
+		if (addr > 0xfffff || (seen[addr / 8] >> (addr % 8)) & 1)
+			continue;
+		seen[addr / 8] |= 1 << (addr % 8);
+
+		target = ~0;
+		len = verify_insn (iop, addr, &d, &target);
+		if (len < 0)
+			bad++;
+		if (len <= 0)
+			continue;
+		if (verified_mark (iop, addr, addr + len)) {
+			bad = -1;
+			break;
+		}
+
+		if (ntodo + 2 > size) {
+			tmp = realloc (todo, 2 * size * sizeof(*todo));
+			if (tmp == NULL) {
+				bad = -1;
+				break;
+			}
+			todo = tmp;
+			size *= 2;
+		}
+		switch (d.flow) {
+		case I89_FLOW_NEXT:
+		case I89_FLOW_BRANCH:
+		case I89_FLOW_CALL:
+			todo[ntodo++] = addr + len;
+			break;
+		default:
+			break;
+		}
+		if (target != ~0U)
+			todo[ntodo++] = target;
+	}
+
+	free (seen);
+	free (todo);
+	return bad;
+}
+
+/*
+ * Verify the programs the channel control block starts. A channel that
+ * is not told to start in the system space is left alone.
+ */
+
+int
+i89_verify_cb (struct i89 *iop)
+{
+	uint32_t ccb;
+	int ch, ret, bad = 0;
+
+	for (ch = 0; ch < 2; ch++) {
+		ccb = i89_cb (iop) + 8 * ch;
+		if ((in8 (iop, ccb + 0, 0) & CCW_CF) != CF_SYSTEM)
+			continue;
+		ret = i89_verify (iop, memptr (iop, memptr (iop, ccb + 2)));
+		if (ret < 0)
+			return ret;
+		bad += ret;
+	}
+
+	return bad;
+}
+
+/* Forget what has been verified. */
+void
+i89_verify_free (struct i89 *iop)
+{
+	struct i89_verify *v = iop->verify;
+	unsigned page;
+
+	if (v == NULL)
+		return;
+
+	iop->verify = NULL;
+	for (page = 0; page < I89_PAGES; page++)
+		free (v->bits[page]);
+	free (v);
 }
@@ -11,6 +11,9 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef I89_H
+#define I89_H
+
 enum i89_regs { GA, GB, GC, BC, TP, IX, CC, MC, PP, NUM_REGS, BAD_REG };
 
 enum i89_flags {
@@ -22,6 +25,164 @@ enum i89_flags {
 	_I89_STORE	= 0x80,
 };
 
+enum i89_status {
+	I89_ERROR	= -1,
+	I89_OK		= 0,
+	I89_HALT	= 1,
+	I89_DMA		= 2,	/* Transfer in progress */
+	I89_DMA_WAIT	= 3,	/* Synchronized transfer waiting for DRQ */
+	I89_POLL	= 4,	/* Parked in a polling loop */
+	I89_BREAK	= 5,	/* Stopped at a breakpoint */
+	I89_WATCH	= 6,	/* Stopped after touching a watchpoint */
+};
+
+#define I89_POLL_PORTS	4
+
+/* Functions i89_reset() calls, see i89_keep(). */
+#define I89_KEEP	8
+
+#define I89_PAGE_SHIFT	12
+#define I89_PAGE_SIZE	(1 << I89_PAGE_SHIFT)
+#define I89_PAGES	(0x100000 >> I89_PAGE_SHIFT)
+
+enum i89_page_flags {
+	I89_PAGE_CODE	= 0x01,	/* Holds translated or verified code */
+	I89_PAGE_RO	= 0x02,	/* Mapped read-only */
+	I89_PAGE_RWATCH	= 0x04,	/* Has read watchpoints */
+	I89_PAGE_WWATCH	= 0x08,	/* Has write watchpoints */
+	I89_PAGE_BREAK	= 0x10,	/* Has breakpoints */
+};
+
+enum i89_watch_kind {
+	I89_WATCH_EXEC	= 0x01,
+	I89_WATCH_READ	= 0x02,
+	I89_WATCH_WRITE	= 0x04,
+	I89_WATCH_IO	= 0x08,	/* Addresses are I/O ports */
+};
+
+/*
+ * Decoded instruction, for analysis tools.
+ */
+
+enum i89_flow {
+	I89_FLOW_NEXT,		/* Goes on with the next instruction */
+	I89_FLOW_JUMP,		/* Goes to target */
+	I89_FLOW_BRANCH,	/* Goes to target or the next instruction */
+	I89_FLOW_CALL,		/* Calls target */
+	I89_FLOW_RETURN,	/* Loads TP from memory (movp tp) */
+	I89_FLOW_HALT,
+	I89_FLOW_INDIRECT,	/* Computes TP otherwise */
+};
+
+struct i89_decoded {
+	uint16_t insn;
+	uint8_t len;
+	uint8_t clocks;
+	enum i89_flow flow;
+	uint32_t target;
+};
+
+/*
+ * Channel events, see the event callback in struct i89.
+ */
+
+enum i89_event {
+	I89_EVENT_ATTN,		/* Channel attention, arg is the CCW; called
+				 * before the command is carried out */
+	I89_EVENT_SINTR,
+	I89_EVENT_HALT,
+};
+
+enum i89_lat_unit {
+	I89_LAT_CYCLES,		/* Emulated clock cycles */
+	I89_LAT_NS,		/* Host time */
+	I89_LAT_UNITS,
+};
+
+struct i89_tc;
+struct i89_thread;
+struct i89_mem;
+struct i89_image;
+struct i89_watch;
+struct i89_pool;
+struct i89_bus;
+struct i89_lat;
+struct i89_pace;
+struct i89_dev;
+struct i89_disk;
+struct i89_obj;
+struct i89_undo;
+struct i89_verify;
+struct i89_lockstep;
+
+enum i89_arb {
+	I89_ARB_RQGT,	/* Local bus shared with the CPU through RQ/GT */
+	I89_ARB_8289,	/* System bus with a bus arbiter per master */
+};
+
+#define I89_BUS_MASTERS	16
+
+struct i89_bus_stats {
+	uint64_t accesses;
+	uint64_t busy;		/* Clocks the master had the bus for */
+	uint64_t stall;		/* Clocks spent waiting for the bus */
+	uint64_t wait;		/* Wait states */
+};
+
+/* What an object file loaded, see i89_load(). */
+struct i89_extent {
+	uint32_t addr;
+	uint32_t len;
+};
+
+struct i89_sym {
+	uint32_t addr;
+	char *name;
+};
+
+struct i89_lockstep_stats {
+	uint64_t steps;
+	uint64_t vector;	/* Instructions run in lockstep, by lane */
+	uint64_t scalar;	/* Steps run by the interpreter, by lane */
+};
+
+struct i89_pace_stats {
+	uint64_t batches;
+	uint64_t late;		/* Batches that ended behind the host clock */
+	uint64_t resyncs;	/* Times a lag was given up on */
+	int64_t drift;		/* Host clock minus the emulated one, in ns */
+	uint64_t max_lag;	/* Nanoseconds */
+	uint64_t lost;		/* Nanoseconds given up on */
+	uint64_t slept;		/* Nanoseconds */
+	uint64_t spun;		/* Nanoseconds */
+	uint64_t max_jitter;	/* Longest a wake up was late, in ns */
+};
+
+/*
+ * Command submission ring. The host queues parameter blocks in sq and
+ * the channel runs them back to back, without a channel attention for
+ * each; when a program halts, its parameter block is posted to cq along
+ * with its status byte. An idle channel starts on a block as soon as it
+ * is queued. A channel command that stops the block in hand, such as
+ * halt, posts it with whatever status byte it has.
+ */
+
+#define I89_RING_SIZE	64
+
+struct i89_ring {
+	uint32_t sq[I89_RING_SIZE];
+	unsigned sq_head, sq_tail;
+
+	struct {
+		uint32_t pb;
+		uint8_t status;
+	} cq[I89_RING_SIZE];
+	unsigned cq_head, cq_tail;
+
+	/* Offset of the status byte in the parameter block. */
+	uint8_t status;
+};
+
 struct i89 {
 	uint32_t cb;
 	struct {
@@ -29,10 +190,107 @@ struct i89 {
 		unsigned tags:NUM_REGS;
 		unsigned wid:2;
 		unsigned xfer:1;
+		unsigned dma:1;		/* In transfer cycles */
+		unsigned eop:1;		/* External terminate latched */
+		unsigned nodrq:1;	/* DRQ deasserted */
+		unsigned park:1;	/* Parked in a polling loop */
+		unsigned halt:1;	/* Halted */
+		unsigned queued:1;	/* Running a block from the ring */
+		unsigned ccb:1;		/* Started from the CB, owns its busy flag */
+		unsigned nointr:1;	/* Interrupts disabled */
+		unsigned is:1;		/* Interrupt not acknowledged yet */
+		unsigned prio:1;	/* Not modeled, kept for the PSW */
+		unsigned blimit:1;	/* Not modeled, kept for the PSW */
+
+		/* Context of a suspended program, see i89_attn(). */
+		struct {
+			uint32_t regs[NUM_REGS];
+			unsigned tags:NUM_REGS;
+			unsigned xfer:1;
+			unsigned dma:1;
+			unsigned valid:1;
+		} susp;
+
+		/* Polling loop being tracked or parked in. */
+		uint32_t poll_tp;
+		uint32_t poll_clk;
+		uint64_t park_until;
+		uint16_t poll[I89_POLL_PORTS];
+		uint8_t npoll;
+
+		struct i89_ring *ring;
 	} chan[2];
 
+	/* System memory pages backed by host memory. The library keeps
+	 * rmap, wmap and pflags; use i89_map() to set them up. */
+	uint8_t *map[I89_PAGES];
+	uint8_t *rmap[I89_PAGES];
+	uint8_t *wmap[I89_PAGES];
+	uint8_t pflags[I89_PAGES];
+
+	/* Sparse memory the callbacks use, see i89_mem_attach(). */
+	struct i89_mem *mem;
+	struct i89 *mem_next;
+
+	/* Contention model the IOP is on, see i89_bus_attach(). */
+	struct i89_bus *bus;
+
+	/* Latency tracking, see i89_lat_attach(). */
+	struct i89_lat *lat;
+
+	/* Device models in front of the port callbacks, see i89_dev_hdc(). */
+	struct i89_dev *devs;
+
+	/* Translation cache, see i89_tc_new(). */
+	struct i89_tc *tc;
+
+	/* What i89_reset() calls to keep attachments, see i89_keep(). */
+	void (*keep[I89_KEEP])(struct i89 *iop, const struct i89 *own);
+
+	/* Clock cycles executed. */
+	uint64_t cycles;
+
+	/* Cycles a channel may stay parked in a polling loop before it
+	 * polls again; 0 disables polling loop detection. */
+	uint32_t poll_limit;
+
+	/* Transfer cycles per step; 0 runs a transfer to termination. */
+	unsigned burst;
+
+	/* Breakpoints and watchpoints, see i89_watch(). */
+	struct i89_watch *watch;
+
+	/* Undo journal, see i89_undo_enable(). */
+	struct i89_undo *undo;
+
+	/* Code known to be good, see i89_verify(). */
+	struct i89_verify *verify;
+
+	/* Edge coverage, for fuzzers. If set, each instruction i89_step()
+	 * executes bumps a counter for the pair of it and the previous one
+	 * in cov, which has ncov of them. */
+	uint8_t *cov;
+	uint32_t ncov;
+	uint32_t cov_prev;
+
+	/* What the last I89_BREAK or I89_WATCH stopped at. */
+	struct {
+		enum i89_watch_kind kind;
+		uint32_t addr;
+	} hit;
+
+	/* Conditional stops: if set, called on a breakpoint or watchpoint
+	 * hit, and only a non-zero return stops the channel. */
+	int (*stop)(struct i89 *iop, enum i89_watch_kind kind, uint32_t addr);
+
 	void (*sintr)(struct i89 *iop);
 
+	/* Called on a channel attention, sintr and hlt, if set. */
+	void (*event)(struct i89 *iop, int ch, enum i89_event event, unsigned arg);
+
+	/* Called around tsl on memory that is not directly mapped. */
+	void (*lock)(struct i89 *iop, int locked);
+
 	uint8_t (*read8)(struct i89 *iop, uint32_t addr);
 	uint16_t (*read16)(struct i89 *iop, uint32_t addr);
 	void (*write8)(struct i89 *iop, uint32_t addr, uint8_t value);
@@ -42,8 +300,121 @@ struct i89 {
 	uint16_t (*in16)(struct i89 *iop, uint16_t addr);
 	void (*out8)(struct i89 *iop, uint16_t addr, uint8_t value);
 	void (*out16)(struct i89 *iop, uint16_t addr, uint16_t value);
+
+	/* Streaming ports, optional. A transfer between a port that is not
+	 * incremented and memory that is directly mapped asks for, or hands
+	 * over, up to len bytes of port data at once. Return how many bytes
+	 * were moved. Once none are, the rest of the transfer goes through
+	 * in8/in16 or out8/out16 as usual. Only whole transfer cycles
+	 * count: an odd byte moved in a transfer two bytes wide is moved
+	 * again with the rest of its cycle. */
+	unsigned (*in_block)(struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len);
+	unsigned (*out_block)(struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len);
 };
 
 void i89_dump (struct i89 *iop);
 void i89_attn (struct i89 *iop, int ch);
+uint32_t i89_cb (struct i89 *iop);
+void i89_reset (struct i89 *iop, const struct i89 *tmpl);
+int i89_keep (struct i89 *iop, void (*fn)(struct i89 *iop, const struct i89 *own));
+void i89_unkeep (struct i89 *iop, void (*fn)(struct i89 *iop, const struct i89 *own));
+void i89_map (struct i89 *iop, uint32_t addr, uint32_t len, uint8_t *host);
+void i89_map_ro (struct i89 *iop, uint32_t addr, uint32_t len, uint8_t *host);
+void i89_invalidate (struct i89 *iop, uint32_t addr, uint32_t len);
+struct i89_tc *i89_tc_new (void);
+void i89_tc_free (struct i89_tc *tc);
+void i89_tc_freeze (struct i89_tc *tc, uint8_t *const pages[I89_PAGES]);
+void i89_tc_share (struct i89_tc *tc, const struct i89_tc *frozen);
+int i89_compare (const struct i89 *a, const struct i89 *b);
+int i89_submit (struct i89 *iop, int ch, uint32_t pb);
+int i89_reap (struct i89 *iop, int ch, uint32_t *pb, uint8_t *status);
 int i89_insn (struct i89 *iop, enum i89_flags flags);
+int i89_decode (const uint8_t *p, int avail, uint32_t addr, struct i89_decoded *d);
+int i89_verify (struct i89 *iop, uint32_t tp);
+int i89_verify_cb (struct i89 *iop);
+void i89_verify_free (struct i89 *iop);
+int i89_step (struct i89 *iop, int ch, enum i89_flags flags);
+int i89_xfer (struct i89 *iop, int ch, unsigned cycles);
+void i89_drq (struct i89 *iop, int ch, int level);
+void i89_eop (struct i89 *iop, int ch);
+void i89_port (struct i89 *iop, uint16_t port);
+int i89_run (struct i89 *iop, int ch, enum i89_flags flags, uint64_t cycles);
+int i89_watch (struct i89 *iop, enum i89_watch_kind kind, uint32_t addr, uint32_t len);
+void i89_unwatch (struct i89 *iop, enum i89_watch_kind kind, uint32_t addr, uint32_t len);
+void i89_watch_free (struct i89 *iop);
+int i89_undo_enable (struct i89 *iop, unsigned steps, unsigned bytes);
+void i89_undo_disable (struct i89 *iop);
+int i89_step_back (struct i89 *iop);
+int i89_run_back_to (struct i89 *iop, int ch, uint32_t tp);
+struct i89_lockstep *i89_lockstep_new (struct i89 **iops, unsigned n, int ch);
+void i89_lockstep_free (struct i89_lockstep *ls);
+unsigned i89_lockstep_run (struct i89_lockstep *ls, enum i89_flags flags, uint64_t cycles);
+int i89_lockstep_status (struct i89_lockstep *ls, unsigned lane);
+void i89_lockstep_stats (struct i89_lockstep *ls, struct i89_lockstep_stats *stats);
+
+struct i89_mem *i89_mem_new (uint8_t fill);
+void i89_mem_free (struct i89_mem *mem);
+uint32_t i89_mem_size (struct i89_mem *mem);
+int i89_mem_write (struct i89_mem *mem, uint32_t addr, const void *buf, uint32_t len);
+uint64_t i89_mem_lost (struct i89_mem *mem);
+void i89_mem_attach (struct i89 *iop, struct i89_mem *mem);
+struct i89_mem *i89_mem_overlay (struct i89_mem *mem);
+void i89_mem_reset (struct i89_mem *mem);
+struct i89_image *i89_image_new (struct i89_mem *mem);
+void i89_image_put (struct i89_image *image);
+int i89_image_attach (struct i89 *iop, struct i89_mem *mem, struct i89_image *image);
+int i89_image_share (struct i89_image *image, struct i89 *iop);
+
+struct i89_obj *i89_load (struct i89_mem *mem, int fd, uint32_t base);
+void i89_obj_free (struct i89_obj *obj);
+int64_t i89_obj_entry (const struct i89_obj *obj);
+const struct i89_extent *i89_obj_extents (const struct i89_obj *obj, unsigned *n);
+const struct i89_sym *i89_obj_syms (const struct i89_obj *obj, unsigned *n);
+
+struct i89_pool *i89_pool_new (const struct i89 *tmpl);
+struct i89 *i89_pool_get (struct i89_pool *pool);
+void i89_pool_put (struct i89_pool *pool, struct i89 *iop);
+void i89_pool_free (struct i89_pool *pool);
+
+struct i89_bus *i89_bus_new (enum i89_arb arb);
+void i89_bus_free (struct i89_bus *bus);
+int i89_bus_region (struct i89_bus *bus, int io, uint32_t addr, uint32_t len, unsigned wait);
+int i89_bus_attach (struct i89_bus *bus, struct i89 *iop, const char *name, int local);
+int i89_bus_host (struct i89_bus *bus, const char *name, unsigned load);
+void i89_bus_advance (struct i89_bus *bus, uint64_t until);
+void i89_bus_stats (struct i89_bus *bus, int master, struct i89_bus_stats *stats);
+void i89_bus_report (struct i89_bus *bus);
+
+struct i89_lat *i89_lat_attach (struct i89 *iop);
+void i89_lat_detach (struct i89 *iop);
+void i89_lat_reset (struct i89_lat *lat);
+uint64_t i89_lat_count (struct i89_lat *lat, int ch, int cmd);
+uint64_t i89_lat_percentile (struct i89_lat *lat, int ch, int cmd, enum i89_lat_unit unit, double pct);
+void i89_lat_report (struct i89_lat *lat);
+int i89_lat_export (struct i89_lat *lat, int fd);
+
+struct i89_pace *i89_pace_new (unsigned hz);
+void i89_pace_free (struct i89_pace *pace);
+void i89_pace_tune (struct i89_pace *pace, unsigned batch_us, unsigned spin_us, unsigned max_lag_us);
+int i89_pace_run (struct i89_pace *pace, struct i89 *iop, int ch, enum i89_flags flags, uint64_t cycles);
+void i89_pace_stats (struct i89_pace *pace, struct i89_pace_stats *stats);
+
+struct i89_disk *i89_disk_open (const char *path, int ro, unsigned cyls, unsigned heads, unsigned spt, unsigned ssize);
+void i89_disk_close (struct i89_disk *disk);
+void i89_disk_timing (struct i89_disk *disk, unsigned rev, unsigned step, unsigned settle);
+int i89_disk_sync (struct i89_disk *disk);
+int i89_dev_hdc (struct i89 *iop, uint16_t base, struct i89_disk *d0, struct i89_disk *d1);
+int i89_dev_fdc (struct i89 *iop, uint16_t base, struct i89_disk *disk[4]);
+void i89_dev_free (struct i89 *iop);
+
+struct i89_thread *i89_thread_start (struct i89 *iop, enum i89_flags flags);
+int i89_thread_attn (struct i89_thread *t, int ch);
+int i89_thread_submit (struct i89_thread *t, int ch, uint32_t pb);
+int i89_thread_drq (struct i89_thread *t, int ch, int level);
+int i89_thread_port (struct i89_thread *t, uint16_t port);
+int i89_thread_fd (struct i89_thread *t);
+int i89_thread_sintr (struct i89_thread *t);
+uint64_t i89_thread_lost (struct i89_thread *t);
+void i89_thread_stop (struct i89_thread *t);
+
+#endif /* I89_H */
@@ -0,0 +1,492 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bus contention model, for finding out how much the masters on a shared
+ * bus (IOPs and a host CPU) slow each other down.
+ *
+ * Each access of an attached IOP takes a bus cycle plus the wait states
+ * of the region it falls in. The cycles are booked in a calendar of bus
+ * clocks: an access gets the first free stretch at or after the clock
+ * count of the IOP at the time. Whenever the bus changes hands, the
+ * arbitration costs a few more clocks. The bus cycle itself is already
+ * in the instruction timings, so the IOP is only held back by the wait
+ * states and by as long as it had to wait for the bus: alone on a bus
+ * without wait states, it runs just as fast as without one. As the masters book their cycles in whatever order
+ * the host runs them, the calendar only looks a window of clocks back;
+ * run the masters in turns of (much) fewer clocks than that.
+ *
+ * The IOP in the local configuration shares its bus with the CPU for
+ * both memory and I/O; in the remote one its I/O space is on a bus of
+ * its own, with no contention.
+ *
+ * All memory accesses of an attached IOP need to go through the
+ * callbacks, therefore the IOP has nothing mapped while it is attached.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "8089.h"
+
+#define BUS_CLOCKS	4
+#define WINDOW		(1 << 16)
+#define REGIONS		16
+
+struct master {
+	const char *name;
+	struct i89 *iop;	/* NULL for the host CPU */
+	int local;
+
+	/* Host CPU: share of the clocks it'd use the bus for, in percent,
+	 * and when it wants it next. */
+	unsigned load;
+	uint64_t next;
+
+	struct i89_bus_stats stats;
+
+	uint8_t (*read8)(struct i89 *iop, uint32_t addr);
+	uint16_t (*read16)(struct i89 *iop, uint32_t addr);
+	void (*write8)(struct i89 *iop, uint32_t addr, uint8_t value);
+	void (*write16)(struct i89 *iop, uint32_t addr, uint16_t value);
+	uint8_t (*in8)(struct i89 *iop, uint16_t addr);
+	uint16_t (*in16)(struct i89 *iop, uint16_t addr);
+	void (*out8)(struct i89 *iop, uint16_t addr, uint8_t value);
+	void (*out16)(struct i89 *iop, uint16_t addr, uint16_t value);
+	void (*lock)(struct i89 *iop, int locked);
+	uint64_t locked;	/* When the bus was locked, plus one */
+
+	/* End of the last cycle booked. An IOP's clock is never behind
+	 * it: the instruction timings leave out the fetches. */
+	uint64_t cursor;
+};
+
+struct i89_bus {
+	unsigned handover;
+	uint64_t end;
+
+	struct {
+		int io;
+		uint32_t start, end;
+		unsigned wait;
+	} region[REGIONS];
+	int nregions;
+
+	struct master master[I89_BUS_MASTERS];
+	int nmasters;
+
+	/* Calendar: clock t is taken if slot[t % WINDOW] is t + 1. */
+	uint64_t slot[WINDOW];
+	uint8_t owner[WINDOW];
+};
+
+struct i89_bus *
+i89_bus_new (enum i89_arb arb)
+{
+	struct i89_bus *bus;
+
+	bus = calloc (1, sizeof(*bus));
+	if (bus == NULL)
+		return NULL;
+
+	/* Clocks lost when the bus changes hands; rough figures. */
+	switch (arb) {
+	case I89_ARB_RQGT:
+		bus->handover = 2;
+		break;
+	case I89_ARB_8289:
+		bus->handover = 4;
+		break;
+	}
+
+	return bus;
+}
+
+/* Wait states for a range of memory or, with io set, I/O space. */
+int
+i89_bus_region (struct i89_bus *bus, int io, uint32_t addr, uint32_t len, unsigned wait)
+{
+	if (bus->nregions == REGIONS)
+		return -1;
+
+	bus->region[bus->nregions].io = io;
+	bus->region[bus->nregions].start = addr;
+	bus->region[bus->nregions].end = addr + len;
+	bus->region[bus->nregions].wait = wait;
+	bus->nregions++;
+
+	return 0;
+}
+
+static unsigned
+waits (struct i89_bus *bus, int io, uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < bus->nregions; i++) {
+		if (bus->region[i].io == io && bus->region[i].start <= addr &&
+		    addr < bus->region[i].end)
+			return bus->region[i].wait;
+	}
+
+	return 0;
+}
+
+static int
+taken (struct i89_bus *bus, uint64_t t)
+{
+	return bus->slot[t % WINDOW] == t + 1;
+}
+
+/*
+ * Book n clocks of the bus for the master, starting no earlier than t.
+ * Returns how long the master has to wait.
+ */
+
+static uint64_t
+acquire (struct i89_bus *bus, struct master *m, uint64_t t, unsigned n)
+{
+	int id = m - bus->master;
+	unsigned need, i;
+	uint64_t s = t;
+
+	for (;;) {
+		need = n;
+		if (s && taken (bus, s - 1) && bus->owner[(s - 1) % WINDOW] != id)
+			need += bus->handover;
+		for (i = 0; i < need && !taken (bus, s + i); i++)
+			;
+		if (i == need)
+			break;
+		s += i + 1;
+	}
+
+	for (i = 0; i < need; i++) {
+		bus->slot[(s + i) % WINDOW] = s + i + 1;
+		bus->owner[(s + i) % WINDOW] = id;
+	}
+	if (bus->end < s + need)
+		bus->end = s + need;
+
+	m->stats.accesses++;
+	m->stats.busy += need;
+	m->stats.stall += s - t + need - n;
+
+	return s - t + need - n;
+}
+
+static struct master *
+master (struct i89 *iop)
+{
+	struct i89_bus *bus = iop->bus;
+	int i;
+
+	for (i = 0; i < bus->nmasters; i++) {
+		if (bus->master[i].iop == iop)
+			break;
+	}
+
+	return &bus->master[i];
+}
+
+static struct master *
+cycle (struct i89 *iop, int io, uint32_t addr)
+{
+	struct master *m = master (iop);
+	unsigned wait = waits (iop->bus, io, addr);
+	uint64_t t, stall;
+
+	m->stats.wait += wait;
+	if (io && !m->local) {
+		iop->cycles += wait;
+		return m;
+	}
+
+	/* Accesses of one instruction follow each other on the bus. */
+	t = iop->cycles > m->cursor ? iop->cycles : m->cursor;
+	stall = acquire (iop->bus, m, t, BUS_CLOCKS + wait);
+	m->cursor = t + stall + BUS_CLOCKS + wait;
+	iop->cycles += stall + wait;
+
+	return m;
+}
+
+/* Keep the memory going through the callbacks. */
+static void
+unmap (struct i89 *iop, uint32_t addr)
+{
+	if (iop->map[(addr >> I89_PAGE_SHIFT) % I89_PAGES])
+		i89_map (iop, addr & ~(I89_PAGE_SIZE - 1), I89_PAGE_SIZE, NULL);
+}
+
+static uint8_t
+read8 (struct i89 *iop, uint32_t addr)
+{
+	uint8_t value = cycle (iop, 0, addr)->read8 (iop, addr);
+
+	unmap (iop, addr);
+	return value;
+}
+
+static uint16_t
+read16 (struct i89 *iop, uint32_t addr)
+{
+	struct master *m = cycle (iop, 0, addr);
+	uint16_t value;
+
+	if (m->read16)
+		value = m->read16 (iop, addr);
+	else
+		value = m->read8 (iop, addr) | (m->read8 (iop, addr + 1) << 8);
+	unmap (iop, addr);
+	unmap (iop, addr + 1);
+	return value;
+}
+
+static void
+write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	cycle (iop, 0, addr)->write8 (iop, addr, value);
+	unmap (iop, addr);
+}
+
+static void
+write16 (struct i89 *iop, uint32_t addr, uint16_t value)
+{
+	struct master *m = cycle (iop, 0, addr);
+
+	if (m->write16) {
+		m->write16 (iop, addr, value);
+	} else {
+		m->write8 (iop, addr, value);
+		m->write8 (iop, addr + 1, value >> 8);
+	}
+	unmap (iop, addr);
+	unmap (iop, addr + 1);
+}
+
+static uint8_t
+in8 (struct i89 *iop, uint16_t addr)
+{
+	return cycle (iop, 1, addr)->in8 (iop, addr);
+}
+
+static uint16_t
+in16 (struct i89 *iop, uint16_t addr)
+{
+	struct master *m = cycle (iop, 1, addr);
+
+	if (m->in16)
+		return m->in16 (iop, addr);
+	return m->in8 (iop, addr) | (m->in8 (iop, addr + 1) << 8);
+}
+
+static void
+out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+	cycle (iop, 1, addr)->out8 (iop, addr, value);
+}
+
+static void
+out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+	struct master *m = cycle (iop, 1, addr);
+
+	if (m->out16) {
+		m->out16 (iop, addr, value);
+	} else {
+		m->out8 (iop, addr, value);
+		m->out8 (iop, addr + 1, value >> 8);
+	}
+}
+
+/* A locked sequence keeps the bus from everyone else. */
+static void
+lock (struct i89 *iop, int locked)
+{
+	struct master *m = master (iop);
+	uint64_t t;
+
+	if (locked) {
+		m->locked = iop->cycles + 1;
+	} else if (m->locked) {
+		for (t = m->locked - 1; t < iop->cycles; t++) {
+			if (taken (iop->bus, t))
+				continue;
+			iop->bus->slot[t % WINDOW] = t + 1;
+			iop->bus->owner[t % WINDOW] = m - iop->bus->master;
+			m->stats.busy++;
+		}
+		m->locked = 0;
+	}
+
+	if (m->lock)
+		m->lock (iop, locked);
+}
+
+static struct master *
+add (struct i89_bus *bus, const char *name)
+{
+	struct master *m;
+
+	if (bus->nmasters == I89_BUS_MASTERS)
+		return NULL;
+
+	m = &bus->master[bus->nmasters++];
+	m->name = name;
+	return m;
+}
+
+/* After i89_reset(): the bus still goes between the IOP and the rest. */
+static void
+keep (struct i89 *iop, const struct i89 *own)
+{
+	iop->bus = own->bus;
+	iop->read8 = read8;
+	iop->read16 = read16;
+	iop->write8 = write8;
+	iop->write16 = write16;
+	iop->in8 = in8;
+	iop->in16 = in16;
+	iop->out8 = out8;
+	iop->out16 = out16;
+	iop->lock = lock;
+	i89_map (iop, 0, 0x100000, NULL);
+}
+
+/*
+ * Put the IOP on the bus, in the local configuration if local is set.
+ * Returns the master number, or -1 if there are too many.
+ */
+
+int
+i89_bus_attach (struct i89_bus *bus, struct i89 *iop, const char *name, int local)
+{
+	struct master *m = add (bus, name);
+
+	if (m == NULL)
+		return -1;
+
+	m->iop = iop;
+	m->local = local;
+	m->read8 = iop->read8;
+	m->read16 = iop->read16;
+	m->write8 = iop->write8;
+	m->write16 = iop->write16;
+	m->in8 = iop->in8;
+	m->in16 = iop->in16;
+	m->out8 = iop->out8;
+	m->out16 = iop->out16;
+	m->lock = iop->lock;
+
+	iop->bus = bus;
+	keep (iop, iop);
+	i89_keep (iop, keep);
+
+	return m - bus->master;
+}
+
+/* Detach the IOPs and give them their callbacks back. */
+void
+i89_bus_free (struct i89_bus *bus)
+{
+	struct master *m;
+	int i;
+
+	for (i = 0; i < bus->nmasters; i++) {
+		m = &bus->master[i];
+		if (m->iop == NULL)
+			continue;
+		m->iop->read8 = m->read8;
+		m->iop->read16 = m->read16;
+		m->iop->write8 = m->write8;
+		m->iop->write16 = m->write16;
+		m->iop->in8 = m->in8;
+		m->iop->in16 = m->in16;
+		m->iop->out8 = m->out8;
+		m->iop->out16 = m->out16;
+		m->iop->lock = m->lock;
+		m->iop->bus = NULL;
+		i89_unkeep (m->iop, keep);
+	}
+
+	free (bus);
+}
+
+/*
+ * Add a host CPU that, left alone, uses the bus for the given percentage
+ * of clocks. It is run with i89_bus_advance().
+ */
+
+int
+i89_bus_host (struct i89_bus *bus, const char *name, unsigned load)
+{
+	struct master *m = add (bus, name);
+
+	if (m == NULL)
+		return -1;
+
+	m->load = load ? load : 1;
+	return m - bus->master;
+}
+
+/* Run the host CPUs up to the given clock. */
+void
+i89_bus_advance (struct i89_bus *bus, uint64_t until)
+{
+	struct master *m;
+	int i;
+
+	for (i = 0; i < bus->nmasters; i++) {
+		m = &bus->master[i];
+		if (m->iop)
+			continue;
+		while (m->next < until) {
+			m->next += acquire (bus, m, m->next, BUS_CLOCKS);
+			m->next += BUS_CLOCKS * 100 / m->load;
+		}
+	}
+}
+
+void
+i89_bus_stats (struct i89_bus *bus, int master, struct i89_bus_stats *stats)
+{
+	*stats = bus->master[master].stats;
+}
+
+void
+i89_bus_report (struct i89_bus *bus)
+{
+	struct i89_bus_stats *s;
+	uint64_t busy = 0;
+	int i;
+
+	printf ("%-12s %10s %12s %6s %12s %12s\n",
+		"master", "accesses", "busy", "util", "stall", "wait");
+	for (i = 0; i < bus->nmasters; i++) {
+		s = &bus->master[i].stats;
+		busy += s->busy;
+		printf ("%-12s %10llu %12llu %5.1f%% %12llu %12llu\n",
+			bus->master[i].name ? bus->master[i].name : "?",
+			(unsigned long long)s->accesses,
+			(unsigned long long)s->busy,
+			bus->end ? 100.0 * s->busy / bus->end : 0.0,
+			(unsigned long long)s->stall,
+			(unsigned long long)s->wait);
+	}
+	printf ("%-12s %10s %12llu %5.1f%% in %llu clocks\n", "bus", "",
+		(unsigned long long)busy,
+		bus->end ? 100.0 * busy / bus->end : 0.0,
+		(unsigned long long)bus->end);
+}
@@ -0,0 +1,975 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Device models: disk controllers in the I/O space of an IOP, with the
+ * sectors in disk image files. The images are mapped shared, so that a
+ * transfer copies straight between the page cache and the memory of the
+ * IOP, and writes end up in the file.
+ *
+ * The devices of an IOP sit in front of its port callbacks, which still
+ * get the accesses to the ports no device claims. All their state is in
+ * the IOP's struct i89_dev; any number of IOPs can have their own.
+ *
+ * Registers are on even port addresses and 8 bits wide; the odd address
+ * above each is a mirror. A 16-bit access is two 8-bit ones, so that a
+ * 16-bit transfer from a data port gets two bytes of the data.
+ *
+ * Time is emulated clocks: a seek keeps the drive busy for as long as it
+ * takes the heads to get there, and the first byte of a sector is not
+ * there until the sector comes under the heads. An access that comes
+ * too early holds the IOP up until then, as a not ready device would.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+#define DEVICES		8
+
+struct i89_disk {
+	uint8_t *data;
+	size_t size;
+	int ro;
+
+	unsigned cyls, heads, spt, ssize;
+
+	/* Timing, in clocks. */
+	uint64_t rev;		/* A revolution */
+	uint64_t step;		/* Moving the heads by a cylinder */
+	uint64_t settle;	/* Heads settling after a seek */
+};
+
+struct device {
+	uint16_t base;
+	uint16_t len;
+	uint8_t (*in)(struct device *dev, struct i89 *iop, unsigned reg);
+	void (*out)(struct device *dev, struct i89 *iop, unsigned reg, uint8_t value);
+
+	/* Data port streaming, if the device can. */
+	uint16_t data;
+	unsigned (*in_block)(struct device *dev, struct i89 *iop, uint8_t *buf, unsigned len);
+	unsigned (*out_block)(struct device *dev, struct i89 *iop, const uint8_t *buf, unsigned len);
+};
+
+struct i89_dev {
+	struct device *dev[DEVICES];
+	int ndevs;
+
+	/* What the ports no device claims go to. */
+	uint8_t (*in8)(struct i89 *iop, uint16_t addr);
+	uint16_t (*in16)(struct i89 *iop, uint16_t addr);
+	void (*out8)(struct i89 *iop, uint16_t addr, uint8_t value);
+	void (*out16)(struct i89 *iop, uint16_t addr, uint16_t value);
+	unsigned (*in_block)(struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len);
+	unsigned (*out_block)(struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len);
+};
+
+/*
+ * Disk images.
+ */
+
+/*
+ * Map an image of a disk with the given geometry. A writable image that
+ * is too short is extended; a read-only one must be large enough.
+ */
+
+struct i89_disk *
+i89_disk_open (const char *path, int ro, unsigned cyls, unsigned heads,
+	       unsigned spt, unsigned ssize)
+{
+	struct i89_disk *disk;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	size = (size_t)cyls * heads * spt * ssize;
+	if (size == 0)
+		return NULL;
+
+	fd = open (path, ro ? O_RDONLY : O_RDWR);
+	if (fd == -1)
+		return NULL;
+	if (fstat (fd, &st) == -1)
+		goto err;
+	if ((size_t)st.st_size < size) {
+		if (ro || ftruncate (fd, size) == -1)
+			goto err;
+	}
+
+	disk = calloc (1, sizeof(*disk));
+	if (disk == NULL)
+		goto err;
+
+	disk->data = mmap (NULL, size, ro ? PROT_READ : PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	close (fd);
+	if (disk->data == MAP_FAILED) {
+		free (disk);
+		return NULL;
+	}
+
+	disk->size = size;
+	disk->ro = ro;
+	disk->cyls = cyls;
+	disk->heads = heads;
+	disk->spt = spt;
+	disk->ssize = ssize;
+
+	/* A 3600 RPM hard disk with a 5 MHz IOP. */
+	i89_disk_timing (disk, 83333, 500, 3000);
+	return disk;
+err:
+	close (fd);
+	return NULL;
+}
+
+void
+i89_disk_close (struct i89_disk *disk)
+{
+	munmap (disk->data, disk->size);
+	free (disk);
+}
+
+/* Clocks a revolution, a step from a cylinder to the next and a settle take. */
+void
+i89_disk_timing (struct i89_disk *disk, unsigned rev, unsigned step, unsigned settle)
+{
+	disk->rev = rev ? rev : 1;
+	disk->step = step;
+	disk->settle = settle;
+}
+
+/* Write the changes out to the file now rather than eventually. */
+int
+i89_disk_sync (struct i89_disk *disk)
+{
+	return msync (disk->data, disk->size, MS_SYNC);
+}
+
+static uint8_t *
+sector (struct i89_disk *disk, unsigned c, unsigned h, unsigned s)
+{
+	if (c >= disk->cyls || h >= disk->heads || s >= disk->spt)
+		return NULL;
+	return disk->data + (((size_t)c * disk->heads + h) * disk->spt + s) * disk->ssize;
+}
+
+/* When sector s next starts to pass under the heads. */
+static uint64_t
+rotate (struct i89_disk *disk, uint64_t now, unsigned s)
+{
+	uint64_t start = disk->rev * s / disk->spt;
+
+	return now + (start + disk->rev - now % disk->rev) % disk->rev;
+}
+
+static uint64_t
+seek_time (struct i89_disk *disk, unsigned from, unsigned to)
+{
+	if (from == to)
+		return 0;
+	return disk->settle + disk->step * (from > to ? from - to : to - from);
+}
+
+/* Hold the IOP up until the data is there. */
+static void
+stall (struct i89 *iop, uint64_t until)
+{
+	if (iop->cycles < until)
+		iop->cycles = until;
+}
+
+/*
+ * Hard disk controller: the one the firmware in tst.c drives.
+ *
+ *   base + 0	data; out of a transfer, the sector register
+ *   base + 2	drive (bit 4) and head (bits 0-3)
+ *   base + 4	out: cylinder, low byte then high byte;
+ *		in: seek status, HS_SELECTED and HS_SEEK_DONE
+ *   base + 6	out: command; in: status
+ *
+ * The command is 0x80 to reset, 0x20 to select, 0x10 to seek to the
+ * cylinder, an odd number to read a sector and an even one to write it.
+ * A read with bit 3 set is a long one that has five ECC bytes after
+ * the data; a write with bit 2 set formats the sector: it takes four ID
+ * bytes and fills the sector with 0xe5.
+ */
+
+#define HDC_DATA		0
+#define HDC_DH			2
+#define HDC_CYL			4
+#define HDC_CMD			6
+
+#define HDC_READY		0x80
+#define HDC_WRITE_FAULT		0x20
+#define HDC_ID_NOT_FOUND	0x10
+#define HDC_BUSY		0x01
+
+#define HS_SELECTED		0x01
+#define HS_SEEK_DONE		0x02
+
+#define HDC_ECC			5
+#define HDC_ID			4
+
+enum phase { IDLE, READ, WRITE, RESULT };
+
+struct hdc {
+	struct device dev;
+	struct i89_disk *disk[2];
+
+	uint8_t dh, sec, status, seek_status;
+	uint16_t cyl;
+	unsigned pos[2];		/* Cylinder the heads are on */
+	uint64_t ready;			/* The end of the seek */
+
+	enum phase phase;
+	int format;
+	uint8_t *ptr;
+	unsigned len, done, data_len;
+	uint64_t data_at;
+};
+
+static void
+hdc_update (struct hdc *hdc, struct i89 *iop)
+{
+	if ((hdc->status & HDC_BUSY) && hdc->phase == IDLE && iop->cycles >= hdc->ready) {
+		hdc->status &= ~HDC_BUSY;
+		hdc->seek_status |= HS_SEEK_DONE;
+	}
+}
+
+static void
+hdc_start (struct hdc *hdc, struct i89 *iop, uint8_t cmd)
+{
+	struct i89_disk *disk = hdc->disk[(hdc->dh >> 4) & 1];
+	int read = cmd & 1;
+
+	hdc->status = HDC_READY;
+	hdc->ptr = disk ? sector (disk, hdc->cyl, hdc->dh & 0x0f, hdc->sec) : NULL;
+	if (hdc->ptr == NULL) {
+		hdc->status |= HDC_ID_NOT_FOUND;
+		return;
+	}
+	if (!read && disk->ro) {
+		hdc->status |= HDC_WRITE_FAULT;
+		return;
+	}
+
+	hdc->phase = read ? READ : WRITE;
+	hdc->format = !read && (cmd & 0x04);
+	hdc->data_len = disk->ssize;
+	if (read)
+		hdc->len = disk->ssize + (cmd & 0x08 ? HDC_ECC : 0);
+	else
+		hdc->len = hdc->format ? HDC_ID : disk->ssize;
+	hdc->done = 0;
+	hdc->data_at = rotate (disk, iop->cycles, hdc->sec);
+	hdc->status |= HDC_BUSY;
+}
+
+static void
+hdc_done (struct hdc *hdc, unsigned n)
+{
+	hdc->done += n;
+	if (hdc->done < hdc->len)
+		return;
+
+	if (hdc->format)
+		memset (hdc->ptr, 0xe5, hdc->data_len);
+	hdc->phase = IDLE;
+	hdc->status &= ~HDC_BUSY;
+}
+
+static unsigned
+hdc_in_block (struct device *dev, struct i89 *iop, uint8_t *buf, unsigned len)
+{
+	struct hdc *hdc = (struct hdc *)dev;
+	unsigned n, data;
+
+	if (hdc->phase != READ)
+		return 0;
+
+	stall (iop, hdc->data_at);
+	if (len > hdc->len - hdc->done)
+		len = hdc->len - hdc->done;
+
+	/* The data, then the ECC bytes, which are always good. */
+	data = hdc->done < hdc->data_len ? hdc->data_len - hdc->done : 0;
+	n = len < data ? len : data;
+	memcpy (buf, hdc->ptr + hdc->done, n);
+	memset (buf + n, 0, len - n);
+
+	hdc_done (hdc, len);
+	return len;
+}
+
+static unsigned
+hdc_out_block (struct device *dev, struct i89 *iop, const uint8_t *buf, unsigned len)
+{
+	struct hdc *hdc = (struct hdc *)dev;
+
+	if (hdc->phase != WRITE)
+		return 0;
+
+	stall (iop, hdc->data_at);
+	if (len > hdc->len - hdc->done)
+		len = hdc->len - hdc->done;
+	if (!hdc->format)
+		memcpy (hdc->ptr + hdc->done, buf, len);
+
+	hdc_done (hdc, len);
+	return len;
+}
+
+static uint8_t
+hdc_in (struct device *dev, struct i89 *iop, unsigned reg)
+{
+	struct hdc *hdc = (struct hdc *)dev;
+	uint8_t value;
+
+	switch (reg) {
+	case HDC_DATA:
+		if (hdc_in_block (dev, iop, &value, 1))
+			return value;
+		return 0xff;
+	case HDC_DH:
+		return hdc->dh;
+	case HDC_CYL:
+		hdc_update (hdc, iop);
+		return hdc->seek_status;
+	default:
+		hdc_update (hdc, iop);
+		return hdc->status;
+	}
+}
+
+static void
+hdc_out (struct device *dev, struct i89 *iop, unsigned reg, uint8_t value)
+{
+	struct hdc *hdc = (struct hdc *)dev;
+	struct i89_disk *disk;
+	int drive;
+
+	switch (reg) {
+	case HDC_DATA:
+		if (hdc->phase == WRITE)
+			hdc_out_block (dev, iop, &value, 1);
+		else
+			hdc->sec = value;
+		break;
+	case HDC_DH:
+		hdc->dh = value;
+		if (hdc->disk[(value >> 4) & 1])
+			hdc->status |= HDC_READY;
+		else
+			hdc->status &= ~HDC_READY;
+		break;
+	case HDC_CYL:
+		hdc->cyl = hdc->cyl >> 8 | value << 8;
+		break;
+	default:
+		hdc_update (hdc, iop);
+		hdc->phase = IDLE;
+		drive = (hdc->dh >> 4) & 1;
+		disk = hdc->disk[drive];
+
+		if (value == 0x80) {
+			/* Reset. The heads stay where they are. */
+			hdc->status = 0;
+			hdc->seek_status = 0;
+			hdc->dh = hdc->sec = 0;
+			hdc->cyl = 0;
+		} else if (value == 0x20) {
+			hdc->seek_status |= HS_SELECTED;
+		} else if (value == 0x10) {
+			hdc->seek_status &= ~HS_SEEK_DONE;
+			hdc->status |= HDC_BUSY;
+			hdc->ready = iop->cycles;
+			if (disk) {
+				hdc->ready += seek_time (disk, hdc->pos[drive], hdc->cyl);
+				hdc->pos[drive] = hdc->cyl;
+			}
+		} else if (value & 0x0f) {
+			hdc_start (hdc, iop, value);
+		}
+		break;
+	}
+}
+
+/*
+ * Floppy disk controller: a subset of the Intel 8272.
+ *
+ *   base + 0	in: main status register
+ *   base + 2	data: commands and their results and, in the execution
+ *		phase, the sector data
+ *
+ * The commands are specify, sense drive status, sense interrupt status,
+ * recalibrate, seek, read data, write data and read ID; the others are
+ * invalid. There is no terminal count input: a read or write goes on to
+ * the end of the track, that is the EOT sector, and ends normally there.
+ * The step rate comes from the disk timing rather than from specify.
+ */
+
+#define FDC_MSR			0
+#define FDC_DATA		2
+
+#define MSR_RQM			0x80
+#define MSR_DIO			0x40
+#define MSR_CB			0x10
+
+#define ST0_IC_ABNORMAL		0x40
+#define ST0_IC_INVALID		0x80
+#define ST0_SE			0x20
+#define ST1_ND			0x04
+#define ST1_NW			0x02
+#define ST3_WP			0x40
+#define ST3_RY			0x20
+#define ST3_T0			0x10
+#define ST3_TS			0x08
+
+#define FDC_SPECIFY		0x03
+#define FDC_SENSE_DRIVE		0x04
+#define FDC_WRITE		0x05
+#define FDC_READ		0x06
+#define FDC_RECALIBRATE		0x07
+#define FDC_SENSE_INT		0x08
+#define FDC_READ_ID		0x0a
+#define FDC_SEEK		0x0f
+
+struct fdc {
+	struct device dev;
+	struct i89_disk *disk[4];
+
+	enum phase phase;
+	uint8_t cmd[9];
+	unsigned ncmd, want;
+	uint8_t res[7];
+	unsigned nres, rpos;
+
+	uint8_t pcn[4];
+	uint64_t ready[4];
+	uint8_t seeked;			/* Drives with a seek to sense */
+
+	/* Execution phase. */
+	struct i89_disk *disk_x;
+	unsigned c, h, r, eot;
+	uint8_t *ptr;
+	unsigned done;
+	uint64_t data_at;
+};
+
+static unsigned
+fdc_length (uint8_t cmd)
+{
+	switch (cmd & 0x1f) {
+	case FDC_SPECIFY:
+	case FDC_SEEK:
+		return 3;
+	case FDC_SENSE_DRIVE:
+	case FDC_RECALIBRATE:
+	case FDC_READ_ID:
+		return 2;
+	case FDC_READ:
+	case FDC_WRITE:
+		return 9;
+	default:
+		return 1;
+	}
+}
+
+static void
+fdc_result (struct fdc *fdc, const uint8_t *res, unsigned n)
+{
+	memcpy (fdc->res, res, n);
+	fdc->nres = n;
+	fdc->rpos = 0;
+	fdc->phase = RESULT;
+}
+
+/* The status and ID that end a read, write or read ID. */
+static void
+fdc_rw_result (struct fdc *fdc, uint8_t st0, uint8_t st1, uint8_t n)
+{
+	uint8_t res[7] = { st0 | fdc->h << 2 | (fdc->cmd[1] & 3), st1, 0,
+			   fdc->c, fdc->h, fdc->r, n };
+
+	fdc_result (fdc, res, 7);
+}
+
+static void
+fdc_seek (struct fdc *fdc, struct i89 *iop, unsigned drive, unsigned cyl)
+{
+	struct i89_disk *disk = fdc->disk[drive];
+
+	fdc->ready[drive] = iop->cycles;
+	if (disk)
+		fdc->ready[drive] += seek_time (disk, fdc->pcn[drive], cyl);
+	fdc->pcn[drive] = cyl;
+	fdc->seeked |= 1 << drive;
+	fdc->phase = IDLE;
+}
+
+static void
+fdc_sector (struct fdc *fdc)
+{
+	fdc->ptr = sector (fdc->disk_x, fdc->c, fdc->h, fdc->r - 1);
+	fdc->done = 0;
+}
+
+static void
+fdc_command (struct fdc *fdc, struct i89 *iop)
+{
+	unsigned drive = fdc->cmd[1] & 3;
+	struct i89_disk *disk = fdc->disk[drive];
+	uint8_t res[2];
+	int i;
+
+	switch (fdc->cmd[0] & 0x1f) {
+	case FDC_SPECIFY:
+		fdc->phase = IDLE;
+		return;
+	case FDC_SENSE_DRIVE:
+		res[0] = drive | (fdc->cmd[1] & 4);
+		if (disk) {
+			res[0] |= ST3_RY;
+			if (disk->ro)
+				res[0] |= ST3_WP;
+			if (disk->heads > 1)
+				res[0] |= ST3_TS;
+		}
+		if (fdc->pcn[drive] == 0)
+			res[0] |= ST3_T0;
+		fdc_result (fdc, res, 1);
+		return;
+	case FDC_RECALIBRATE:
+		fdc_seek (fdc, iop, drive, 0);
+		return;
+	case FDC_SEEK:
+		fdc_seek (fdc, iop, drive, fdc->cmd[2]);
+		return;
+	case FDC_SENSE_INT:
+		for (i = 0; i < 4; i++) {
+			if ((fdc->seeked & 1 << i) && iop->cycles >= fdc->ready[i])
+				break;
+		}
+		if (i == 4) {
+			res[0] = ST0_IC_INVALID;
+			fdc_result (fdc, res, 1);
+			return;
+		}
+		fdc->seeked &= ~(1 << i);
+		res[0] = ST0_SE | i;
+		res[1] = fdc->pcn[i];
+		fdc_result (fdc, res, 2);
+		return;
+	case FDC_READ_ID:
+		fdc->h = (fdc->cmd[1] >> 2) & 1;
+		fdc->c = fdc->pcn[drive];
+		if (disk == NULL || fdc->h >= disk->heads) {
+			fdc->r = 0;
+			fdc_rw_result (fdc, ST0_IC_ABNORMAL, ST1_ND, 0);
+			return;
+		}
+		/* The next sector to come under the heads. */
+		stall (iop, fdc->ready[drive]);
+		fdc->r = (iop->cycles % disk->rev * disk->spt / disk->rev + 1) % disk->spt + 1;
+		fdc_rw_result (fdc, 0, 0, __builtin_ctz (disk->ssize) - 7);
+		return;
+	case FDC_READ:
+	case FDC_WRITE:
+		fdc->c = fdc->cmd[2];
+		fdc->h = fdc->cmd[3];
+		fdc->r = fdc->cmd[4];
+		fdc->eot = fdc->cmd[6];
+		fdc->disk_x = disk;
+		if (disk == NULL || fdc->c != fdc->pcn[drive] ||
+		    fdc->r == 0 || fdc->r > fdc->eot || fdc->eot > disk->spt ||
+		    (128U << (fdc->cmd[5] & 7)) != disk->ssize ||
+		    sector (disk, fdc->c, fdc->h, fdc->r - 1) == NULL) {
+			fdc_rw_result (fdc, ST0_IC_ABNORMAL, ST1_ND, fdc->cmd[5]);
+			return;
+		}
+		if ((fdc->cmd[0] & 0x1f) == FDC_WRITE && disk->ro) {
+			fdc_rw_result (fdc, ST0_IC_ABNORMAL, ST1_NW, fdc->cmd[5]);
+			return;
+		}
+		stall (iop, fdc->ready[drive]);
+		fdc->data_at = rotate (disk, iop->cycles, fdc->r - 1);
+		fdc->phase = (fdc->cmd[0] & 0x1f) == FDC_READ ? READ : WRITE;
+		fdc_sector (fdc);
+		return;
+	default:
+		res[0] = ST0_IC_INVALID;
+		fdc_result (fdc, res, 1);
+		return;
+	}
+}
+
+/* Bytes of the sector transferred; on to the next one at its end. */
+static void
+fdc_done (struct fdc *fdc, unsigned n)
+{
+	struct i89_disk *disk = fdc->disk_x;
+
+	fdc->done += n;
+	if (fdc->done < disk->ssize)
+		return;
+
+	if (fdc->r == fdc->eot) {
+		fdc->r = 1;
+		fdc->c++;
+		fdc_rw_result (fdc, 0, 0, fdc->cmd[5]);
+		return;
+	}
+
+	fdc->r++;
+	fdc->data_at += disk->rev / disk->spt;
+	fdc_sector (fdc);
+}
+
+static unsigned
+fdc_in_block (struct device *dev, struct i89 *iop, uint8_t *buf, unsigned len)
+{
+	struct fdc *fdc = (struct fdc *)dev;
+
+	if (fdc->phase != READ)
+		return 0;
+
+	stall (iop, fdc->data_at);
+	if (len > fdc->disk_x->ssize - fdc->done)
+		len = fdc->disk_x->ssize - fdc->done;
+	memcpy (buf, fdc->ptr + fdc->done, len);
+
+	fdc_done (fdc, len);
+	return len;
+}
+
+static unsigned
+fdc_out_block (struct device *dev, struct i89 *iop, const uint8_t *buf, unsigned len)
+{
+	struct fdc *fdc = (struct fdc *)dev;
+
+	if (fdc->phase != WRITE)
+		return 0;
+
+	stall (iop, fdc->data_at);
+	if (len > fdc->disk_x->ssize - fdc->done)
+		len = fdc->disk_x->ssize - fdc->done;
+	memcpy (fdc->ptr + fdc->done, buf, len);
+
+	fdc_done (fdc, len);
+	return len;
+}
+
+static uint8_t
+fdc_in (struct device *dev, struct i89 *iop, unsigned reg)
+{
+	struct fdc *fdc = (struct fdc *)dev;
+	uint8_t value;
+	int i;
+
+	if (reg == FDC_DATA) {
+		if (fdc->phase == RESULT) {
+			value = fdc->res[fdc->rpos++];
+			if (fdc->rpos == fdc->nres)
+				fdc->phase = IDLE;
+			return value;
+		}
+		if (fdc_in_block (dev, iop, &value, 1))
+			return value;
+		return 0xff;
+	}
+
+	switch (fdc->phase) {
+	case IDLE:
+		value = MSR_RQM;
+		if (fdc->ncmd)
+			value |= MSR_CB;
+		for (i = 0; i < 4; i++) {
+			if (iop->cycles < fdc->ready[i])
+				value |= 1 << i;
+		}
+		return value;
+	case READ:
+		return MSR_RQM | MSR_DIO | MSR_CB;
+	case WRITE:
+		return MSR_RQM | MSR_CB;
+	default:
+		return MSR_RQM | MSR_DIO | MSR_CB;
+	}
+}
+
+static void
+fdc_out (struct device *dev, struct i89 *iop, unsigned reg, uint8_t value)
+{
+	struct fdc *fdc = (struct fdc *)dev;
+
+	if (reg != FDC_DATA)
+		return;
+
+	switch (fdc->phase) {
+	case IDLE:
+		if (fdc->ncmd == 0)
+			fdc->want = fdc_length (value);
+		fdc->cmd[fdc->ncmd++] = value;
+		if (fdc->ncmd == fdc->want) {
+			fdc->ncmd = 0;
+			fdc_command (fdc, iop);
+		}
+		break;
+	case WRITE:
+		fdc_out_block (dev, iop, &value, 1);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * The port callbacks.
+ */
+
+static struct device *
+find (struct i89 *iop, uint16_t addr)
+{
+	struct i89_dev *devs = iop->devs;
+	struct device *dev;
+	int i;
+
+	for (i = 0; i < devs->ndevs; i++) {
+		dev = devs->dev[i];
+		if ((uint16_t)(addr - dev->base) < dev->len)
+			return dev;
+	}
+
+	return NULL;
+}
+
+static uint8_t
+in8 (struct i89 *iop, uint16_t addr)
+{
+	struct device *dev = find (iop, addr);
+
+	if (dev)
+		return dev->in (dev, iop, (uint16_t)(addr - dev->base) & ~1);
+	if (iop->devs->in8)
+		return iop->devs->in8 (iop, addr);
+	return 0xff;
+}
+
+static uint16_t
+in16 (struct i89 *iop, uint16_t addr)
+{
+	uint16_t value;
+
+	/* Without a wide callback, the host ports get it a byte at a time. */
+	if (find (iop, addr) == NULL && iop->devs->in16)
+		return iop->devs->in16 (iop, addr);
+
+	value = in8 (iop, addr);
+	return value | in8 (iop, addr + 1) << 8;
+}
+
+static void
+out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+	struct device *dev = find (iop, addr);
+
+	if (dev)
+		dev->out (dev, iop, (uint16_t)(addr - dev->base) & ~1, value);
+	else if (iop->devs->out8)
+		iop->devs->out8 (iop, addr, value);
+}
+
+static void
+out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+	if (find (iop, addr) == NULL && iop->devs->out16) {
+		iop->devs->out16 (iop, addr, value);
+		return;
+	}
+
+	out8 (iop, addr, value);
+	out8 (iop, addr + 1, value >> 8);
+}
+
+static unsigned
+in_block (struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	struct device *dev = find (iop, addr);
+
+	if (dev == NULL) {
+		if (iop->devs->in_block)
+			return iop->devs->in_block (iop, addr, buf, len);
+		return 0;
+	}
+
+	if (dev->in_block == NULL || ((uint16_t)(addr - dev->base) & ~1) != dev->data)
+		return 0;
+	return dev->in_block (dev, iop, buf, len);
+}
+
+static unsigned
+out_block (struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	struct device *dev = find (iop, addr);
+
+	if (dev == NULL) {
+		if (iop->devs->out_block)
+			return iop->devs->out_block (iop, addr, buf, len);
+		return 0;
+	}
+
+	if (dev->out_block == NULL || ((uint16_t)(addr - dev->base) & ~1) != dev->data)
+		return 0;
+	return dev->out_block (dev, iop, buf, len);
+}
+
+static void
+callbacks (struct i89 *iop)
+{
+	iop->in8 = in8;
+	iop->in16 = in16;
+	iop->out8 = out8;
+	iop->out16 = out16;
+	iop->in_block = in_block;
+	iop->out_block = out_block;
+}
+
+/* After i89_reset(): the devices are still in front of the ports. */
+static void
+keep (struct i89 *iop, const struct i89 *own)
+{
+	iop->devs = own->devs;
+	callbacks (iop);
+}
+
+static struct i89_dev *
+attach (struct i89 *iop)
+{
+	struct i89_dev *devs = iop->devs;
+
+	if (devs)
+		return devs;
+
+	devs = calloc (1, sizeof(*devs));
+	if (devs == NULL)
+		return NULL;
+
+	devs->in8 = iop->in8;
+	devs->in16 = iop->in16;
+	devs->out8 = iop->out8;
+	devs->out16 = iop->out16;
+	devs->in_block = iop->in_block;
+	devs->out_block = iop->out_block;
+
+	callbacks (iop);
+	iop->devs = devs;
+	i89_keep (iop, keep);
+
+	return devs;
+}
+
+static int
+add (struct i89 *iop, struct device *dev)
+{
+	struct i89_dev *devs = attach (iop);
+
+	if (devs == NULL || devs->ndevs == DEVICES) {
+		free (dev);
+		return -1;
+	}
+
+	devs->dev[devs->ndevs++] = dev;
+	return 0;
+}
+
+/*
+ * Put a hard disk controller at base, with up to two drives; a NULL
+ * disk is a drive that is not there.
+ */
+
+int
+i89_dev_hdc (struct i89 *iop, uint16_t base, struct i89_disk *d0, struct i89_disk *d1)
+{
+	struct hdc *hdc;
+
+	hdc = calloc (1, sizeof(*hdc));
+	if (hdc == NULL)
+		return -1;
+
+	hdc->dev.base = base;
+	hdc->dev.len = 8;
+	hdc->dev.in = hdc_in;
+	hdc->dev.out = hdc_out;
+	hdc->dev.data = HDC_DATA;
+	hdc->dev.in_block = hdc_in_block;
+	hdc->dev.out_block = hdc_out_block;
+	hdc->disk[0] = d0;
+	hdc->disk[1] = d1;
+
+	return add (iop, &hdc->dev);
+}
+
+/* Put a floppy disk controller at base, with up to four drives. */
+int
+i89_dev_fdc (struct i89 *iop, uint16_t base, struct i89_disk *disk[4])
+{
+	struct fdc *fdc;
+
+	fdc = calloc (1, sizeof(*fdc));
+	if (fdc == NULL)
+		return -1;
+
+	fdc->dev.base = base;
+	fdc->dev.len = 4;
+	fdc->dev.in = fdc_in;
+	fdc->dev.out = fdc_out;
+	fdc->dev.data = FDC_DATA;
+	fdc->dev.in_block = fdc_in_block;
+	fdc->dev.out_block = fdc_out_block;
+	memcpy (fdc->disk, disk, sizeof(fdc->disk));
+
+	return add (iop, &fdc->dev);
+}
+
+/* Remove the devices and give the port callbacks back. The disks stay. */
+void
+i89_dev_free (struct i89 *iop)
+{
+	struct i89_dev *devs = iop->devs;
+	int i;
+
+	if (devs == NULL)
+		return;
+
+	iop->in8 = devs->in8;
+	iop->in16 = devs->in16;
+	iop->out8 = devs->out8;
+	iop->out16 = devs->out16;
+	iop->in_block = devs->in_block;
+	iop->out_block = devs->out_block;
+	iop->devs = NULL;
+	i89_unkeep (iop, keep);
+
+	for (i = 0; i < devs->ndevs; i++)
+		free (devs->dev[i]);
+	free (devs);
+}
@@ -15,6 +15,8 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "8089.h"
 
@@ -35,47 +37,164 @@ read8 (struct i89 *iop, uint32_t addr)
 	return mem[addr];
 }
 
+static const struct i89_sym *syms;
+static unsigned nsyms;
+
+static int
+by_addr (const void *a, const void *b)
+{
+	const struct i89_sym *sa = a, *sb = b;
+
+	return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+/* Disassemble from addr to the end of the extent it is in. */
+static int
+range (struct i89 *iop, const struct i89_extent *extent, unsigned nextents,
+	uint32_t addr, enum i89_flags flags)
+{
+	struct i89_sym key = { 0, };
+	const struct i89_sym *s;
+	uint32_t stop = addr;
+	unsigned i;
+
+	for (i = 0; i < nextents; i++) {
+		if (addr >= extent[i].addr && addr - extent[i].addr < extent[i].len)
+			stop = extent[i].addr + extent[i].len;
+	}
+
+	iop->chan[0].regs[TP] = addr;
+	while (iop->chan[0].regs[TP] < stop) {
+		key.addr = iop->chan[0].regs[TP];
+		s = bsearch (&key, syms, nsyms, sizeof(*syms), by_addr);
+		if (s)
+			printf ("%s:\n", s->name);
+		if (i89_insn (iop, flags))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr, "Usage: %s [-o [-b <base>] [-e <entry>]...] [<iop.bin>]\n", argv0);
+}
+
 int
 main (int argc, char *argv[])
 {
 	struct i89 iop = { 0, };
 	enum i89_flags flags;
+	const struct i89_extent *extent;
+	struct i89_sym *sorted;
+	struct i89_mem *omem;
+	struct i89_obj *obj;
+	uint32_t entry[64];
+	unsigned nentries = 0;
+	unsigned nextents, i;
+	unsigned long base = 0;
+	int object = 0;
 	int br;
 	int fd;
+	int opt;
 
-	iop.read8 = read8;
-	end = iop.chan[0].regs[TP];
+	while ((opt = getopt (argc, argv, "b:e:o")) != -1) {
+		switch (opt) {
+		case 'b':
+			base = strtoul (optarg, NULL, 0);
+			break;
+		case 'e':
+			if (nentries == sizeof(entry) / sizeof(entry[0])) {
+				usage (argv[0]);
+				return 1;
+			}
+			entry[nentries++] = strtoul (optarg, NULL, 0) & 0xfffff;
+			break;
+		case 'o':
+			object = 1;
+			break;
+		default:
+			usage (argv[0]);
+			return 1;
+		}
+	}
 
-	switch (argc) {
-	case 1:
+	switch (argc - optind) {
+	case 0:
 		fd = STDIN_FILENO;
 		break;
-	case 2:
-		fd = open (argv[1], O_RDONLY);
+	case 1:
+		fd = open (argv[optind], O_RDONLY);
 		if (fd == -1) {
-			perror (argv[1]);
+			perror (argv[optind]);
 			return 1;
 		}
 		break;
-	case 10:
+	case 9:
 		fprintf (stderr, "Are you stupid?\n");
 	default:
-		fprintf (stderr, "Usage: %s [<iop.bin>]\n", argv[0]);
+		usage (argv[0]);
 		return 1;
 	}
 
+	flags = I89_CHECK;
+	flags |= I89_PRINT_INSN;
+	flags |= I89_PRINT_ADDR | I89_PRINT_DATA;
+
+	if (object) {
+		omem = i89_mem_new (0xff);
+		if (omem == NULL) {
+			perror ("i89_mem_new");
+			return 1;
+		}
+		obj = i89_load (omem, fd, base);
+		if (obj == NULL) {
+			fprintf (stderr, "%s: Not a valid Intel HEX or OMF-86 file\n",
+				 optind < argc ? argv[optind] : "<stdin>");
+			return 1;
+		}
+		i89_mem_attach (&iop, omem);
+
+		syms = i89_obj_syms (obj, &nsyms);
+		sorted = malloc (nsyms * sizeof(*sorted) + 1);
+		if (sorted == NULL) {
+			perror ("malloc");
+			return 1;
+		}
+		memcpy (sorted, syms, nsyms * sizeof(*sorted));
+		qsort (sorted, nsyms, sizeof(*sorted), by_addr);
+		syms = sorted;
+
+		/* The entry points given, or the start address, or everything. */
+		extent = i89_obj_extents (obj, &nextents);
+		if (nentries == 0 && i89_obj_entry (obj) != -1)
+			entry[nentries++] = i89_obj_entry (obj);
+		for (i = 0; i < nentries; i++) {
+			if (range (&iop, extent, nextents, entry[i], flags))
+				return 1;
+		}
+		for (i = 0; nentries == 0 && i < nextents; i++) {
+			if (range (&iop, extent, nextents, extent[i].addr, flags))
+				return 1;
+		}
+
+		return 0;
+	}
+
+	iop.read8 = read8;
+	end = iop.chan[0].regs[TP];
+
 	do {
 		br = read (fd, &mem[end], sizeof(mem) - end);
 		if (br == -1) {
-			perror (argv[1]);
+			perror (argv[optind]);
 			return 1;
 		}
 		end += br;
 	} while (br);
 
-	flags = I89_CHECK;
-	flags |= I89_PRINT_INSN;
-	flags |= I89_PRINT_ADDR | I89_PRINT_DATA;
 	while (iop.chan[0].regs[TP] < end) {
 		if (i89_insn (&iop, flags))
 			return 1;
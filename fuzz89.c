@@ -0,0 +1,289 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fuzzing harness for channel programs, for libFuzzer or anything else
+ * that calls LLVMFuzzerTestOneInput(). All runs happen in the one process:
+ * the IOP comes from an instance pool, which resets it cheaply between
+ * the test cases.
+ *
+ * The channel program is loaded at PROG_ADDR from the file named by the
+ * FUZZ89_PROGRAM environment variable. A test case is:
+ *
+ *   1 byte	the channel to start (bit 0)
+ *   32 bytes	the parameter block past the TP pointer
+ *   the rest	what the I/O port reads return, in order; 0xff past the end
+ *
+ * Without FUZZ89_PROGRAM, the program comes from the test case too: a
+ * length byte and as many bytes of code, right after the parameter
+ * block. The program runs for at most FUZZ89_CYCLES clocks (100000 by
+ * default).
+ *
+ * The edge coverage the IOP collects is handed to libFuzzer as extra
+ * counters; the library itself is not instrumented. Collecting coverage
+ * takes the IOP off the translation cache, so the programs run on the
+ * interpreter. Build with "make fuzz89 CC=clang"; "make fuzz89-replay"
+ * makes a program that just runs the test cases named on its command
+ * line, for reproducing crashes without libFuzzer.
+ *
+ * With -O2, "fuzz89-replay -n 100000" on a program of a dozen
+ * instructions does some 250000 test cases per second of CPU time,
+ * mostly spent resetting the IOP. A test case that spins for the whole
+ * budget takes about 1.4 ms; lower FUZZ89_CYCLES to keep the rate up.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+#define CB_ADDR		0x00400
+#define PB_ADDR		0x01000
+#define PB_LEN		32
+#define PROG_ADDR	0x10000
+#define PROG_MAX	0x10000
+
+#define COV_SIZE	(1 << 16)
+
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t cov[COV_SIZE];
+
+static struct i89_pool *pool;
+static int have_prog;
+static uint64_t budget = 100000;
+
+/* Port reads come from the test case. */
+static const uint8_t *in_data;
+static size_t in_len;
+
+static uint8_t
+in8 (struct i89 *iop, uint16_t addr)
+{
+	if (in_len == 0)
+		return 0xff;
+	in_len--;
+	return *in_data++;
+}
+
+static uint16_t
+in16 (struct i89 *iop, uint16_t addr)
+{
+	uint16_t value = in8 (iop, addr);
+
+	return value | in8 (iop, addr) << 8;
+}
+
+static unsigned
+in_block (struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	if (len > in_len)
+		len = in_len;
+	memcpy (buf, in_data, len);
+	in_data += len;
+	in_len -= len;
+	return len;
+}
+
+static void
+out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+}
+
+static void
+out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+}
+
+static int
+load (struct i89_mem *mem, const char *file)
+{
+	uint8_t buf[PROG_MAX];
+	ssize_t len;
+	int fd;
+
+	fd = open (file, O_RDONLY);
+	if (fd == -1) {
+		perror (file);
+		return -1;
+	}
+	len = read (fd, buf, sizeof(buf));
+	close (fd);
+	if (len <= 0) {
+		fprintf (stderr, "%s: Can't read the program\n", file);
+		return -1;
+	}
+
+	return i89_mem_write (mem, PROG_ADDR, buf, len);
+}
+
+static int
+setup (void)
+{
+	static const uint8_t scp[] = {
+		0x01, 0x00,		/* SYSBUS: 16 bits */
+		(CB_ADDR + 0x10) & 0xff, (CB_ADDR + 0x10) >> 8, 0x00, 0x00,
+	};
+	static const uint8_t scb[] = {
+		0x00, 0x00,
+		CB_ADDR & 0xff, CB_ADDR >> 8, 0x00, 0x00,
+	};
+	static const uint8_t cb[] = {
+		/* Start in system space, PB at PB_ADDR; for both channels. */
+		0x03, 0x00, PB_ADDR & 0xff, PB_ADDR >> 8, 0x00, 0x00, 0x00, 0x00,
+		0x03, 0x00, PB_ADDR & 0xff, PB_ADDR >> 8, 0x00, 0x00, 0x00, 0x00,
+	};
+	static const uint8_t pb[] = {
+		0x00, 0x00, (PROG_ADDR >> 4) & 0xff, PROG_ADDR >> 12,
+	};
+	struct i89 tmpl = { 0, };
+	struct i89_image *image;
+	struct i89_mem *mem, *over;
+	const char *env;
+
+	mem = i89_mem_new (0xff);
+	if (mem == NULL)
+		return -1;
+	if (i89_mem_write (mem, 0xffff6, scp, sizeof(scp)) ||
+	    i89_mem_write (mem, CB_ADDR + 0x10, scb, sizeof(scb)) ||
+	    i89_mem_write (mem, CB_ADDR, cb, sizeof(cb)) ||
+	    i89_mem_write (mem, PB_ADDR, pb, sizeof(pb)))
+		return -1;
+
+	env = getenv ("FUZZ89_PROGRAM");
+	if (env) {
+		if (load (mem, env))
+			return -1;
+		have_prog = 1;
+	}
+	env = getenv ("FUZZ89_CYCLES");
+	if (env)
+		budget = strtoull (env, NULL, 0);
+
+	image = i89_image_new (mem);
+	over = i89_mem_new (0xff);
+	if (image == NULL || over == NULL)
+		return -1;
+
+	if (i89_image_attach (&tmpl, over, image))
+		return -1;
+	i89_image_put (image);
+	tmpl.in8 = in8;
+	tmpl.in16 = in16;
+	tmpl.out8 = out8;
+	tmpl.out16 = out16;
+	tmpl.in_block = in_block;
+	tmpl.cov = cov;
+	tmpl.ncov = COV_SIZE;
+	/* Transfers needn't terminate; keep them within the budget. */
+	tmpl.burst = 64;
+
+	pool = i89_pool_new (&tmpl);
+	i89_mem_free (tmpl.mem);
+	return pool ? 0 : -1;
+}
+
+int
+LLVMFuzzerInitialize (int *argc, char ***argv)
+{
+	if (setup ())
+		abort ();
+	return 0;
+}
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+	struct i89 *iop;
+	uint64_t end;
+	size_t len;
+	int ch, ret;
+
+	if (size < 1 + PB_LEN)
+		return -1;
+
+	iop = i89_pool_get (pool);
+	if (iop == NULL)
+		abort ();
+
+	ch = data[0] & 1;
+	if (i89_mem_write (iop->mem, PB_ADDR + 4, data + 1, PB_LEN))
+		abort ();
+	data += 1 + PB_LEN;
+	size -= 1 + PB_LEN;
+
+	if (!have_prog) {
+		if (size < 1 || size - 1 < data[0]) {
+			i89_pool_put (pool, iop);
+			return -1;
+		}
+		len = data[0];
+		if (i89_mem_write (iop->mem, PROG_ADDR, data + 1, len))
+			abort ();
+		data += 1 + len;
+		size -= 1 + len;
+	}
+	in_data = data;
+	in_len = size;
+
+	i89_attn (iop, ch);
+	end = iop->cycles + budget;
+	do {
+		ret = i89_run (iop, ch, I89_EXEC, end - iop->cycles);
+	} while (iop->cycles < end && (ret == I89_OK || ret == I89_DMA || ret == I89_POLL));
+
+	i89_pool_put (pool, iop);
+	return 0;
+}
+
+#ifdef FUZZ89_REPLAY
+
+/* Run the test cases given on the command line, possibly many times. */
+int
+main (int argc, char *argv[])
+{
+	static uint8_t buf[1 << 20];
+	unsigned long times = 1, n;
+	ssize_t len;
+	int fd, i;
+
+	if (argc > 2 && strcmp (argv[1], "-n") == 0) {
+		times = strtoul (argv[2], NULL, 0);
+		argc -= 2;
+		argv += 2;
+	}
+
+	LLVMFuzzerInitialize (&argc, &argv);
+	for (i = 1; i < argc; i++) {
+		fd = open (argv[i], O_RDONLY);
+		if (fd == -1) {
+			perror (argv[i]);
+			return 1;
+		}
+		len = read (fd, buf, sizeof(buf));
+		close (fd);
+		if (len < 0) {
+			perror (argv[i]);
+			return 1;
+		}
+		for (n = 0; n < times; n++)
+			LLVMFuzzerTestOneInput (buf, len);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Latency tracking. Measures how long a channel program takes from the
+ * channel attention that starts it to its completion, which is the first
+ * sintr or hlt it executes, both in emulated clock cycles and in host
+ * time. The latencies are kept per channel and per command (start in
+ * local space, start in system space and resume) in histograms with a
+ * relative error of under one percent, so that long runs can be asked
+ * for percentiles without keeping every sample around.
+ *
+ * A suspend or halt command drops the measurement in progress. So does
+ * a new start: only the latest one is measured.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "8089.h"
+
+#define CF_LOCAL	1
+#define CF_SYSTEM	3
+#define CF_RESUME	5
+#define CF_SUSPEND	6
+#define CF_HALT		7
+
+#define CMDS		3
+
+/*
+ * A histogram bucket covers 2^SUB_BITS values exactly; above that, each
+ * power of two is split into 2^(SUB_BITS - 1) equally wide buckets.
+ */
+
+#define SUB_BITS	7
+#define SUB		(1 << SUB_BITS)
+#define BUCKETS		(SUB + (64 - SUB_BITS) * (SUB / 2))
+
+struct hist {
+	uint64_t count;
+	uint64_t min, max;
+	uint64_t n[BUCKETS];
+};
+
+struct i89_lat {
+	struct hist hist[2][CMDS][I89_LAT_UNITS];
+
+	/* Measurement in progress. */
+	struct {
+		int cmd;		/* -1 if none */
+		uint64_t cycles;
+		struct timespec ts;
+	} pending[2];
+
+	void (*event)(struct i89 *iop, int ch, enum i89_event event, unsigned arg);
+};
+
+static const char *const cmd_names[CMDS] = { "local", "system", "resume" };
+static const char *const unit_names[I89_LAT_UNITS] = { "cycles", "ns" };
+
+static unsigned
+bucket (uint64_t value)
+{
+	unsigned shift;
+
+	if (value < SUB)
+		return value;
+
+	shift = 64 - __builtin_clzll (value) - SUB_BITS;
+	return SUB + (shift - 1) * (SUB / 2) + (value >> shift) - SUB / 2;
+}
+
+/* The highest value that falls into a bucket. */
+static uint64_t
+highest (unsigned i)
+{
+	unsigned shift;
+
+	if (i < SUB)
+		return i;
+
+	shift = (i - SUB) / (SUB / 2) + 1;
+	return (((uint64_t)(i - SUB) % (SUB / 2) + SUB / 2 + 1) << shift) - 1;
+}
+
+/* The middle of a bucket: within half its width of any value in it. */
+static uint64_t
+middle (unsigned i)
+{
+	unsigned shift;
+
+	if (i < SUB)
+		return i;
+
+	shift = (i - SUB) / (SUB / 2) + 1;
+	return highest (i) - ((uint64_t)1 << (shift - 1));
+}
+
+static void
+record (struct hist *h, uint64_t value)
+{
+	if (h->count == 0 || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->n[bucket (value)]++;
+}
+
+static int
+command (unsigned ccw)
+{
+	switch (ccw & 0x07) {
+	case CF_LOCAL:
+		return 0;
+	case CF_SYSTEM:
+		return 1;
+	case CF_RESUME:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void
+event (struct i89 *iop, int ch, enum i89_event ev, unsigned arg)
+{
+	struct i89_lat *lat = iop->lat;
+	struct timespec ts;
+	int cmd = lat->pending[ch].cmd;
+	int64_t ns;
+
+	switch (ev) {
+	case I89_EVENT_ATTN:
+		switch (arg & 0x07) {
+		case CF_LOCAL:
+		case CF_SYSTEM:
+		case CF_RESUME:
+			/* Resuming a channel that runs does nothing. */
+			if (command (arg) == 2 && !iop->chan[ch].halt)
+				break;
+			lat->pending[ch].cmd = command (arg);
+			lat->pending[ch].cycles = iop->cycles;
+			clock_gettime (CLOCK_MONOTONIC, &lat->pending[ch].ts);
+			break;
+		case CF_SUSPEND:
+		case CF_HALT:
+			lat->pending[ch].cmd = -1;
+			break;
+		}
+		break;
+	case I89_EVENT_SINTR:
+	case I89_EVENT_HALT:
+		if (cmd == -1)
+			break;
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		ns = (ts.tv_sec - lat->pending[ch].ts.tv_sec) * 1000000000LL +
+		     ts.tv_nsec - lat->pending[ch].ts.tv_nsec;
+		record (&lat->hist[ch][cmd][I89_LAT_CYCLES],
+			iop->cycles - lat->pending[ch].cycles);
+		record (&lat->hist[ch][cmd][I89_LAT_NS], ns > 0 ? ns : 0);
+		lat->pending[ch].cmd = -1;
+		break;
+	}
+
+	if (lat->event)
+		lat->event (iop, ch, ev, arg);
+}
+
+/* After i89_reset(): the latencies are still tracked. */
+static void
+keep (struct i89 *iop, const struct i89 *own)
+{
+	iop->lat = own->lat;
+	iop->event = event;
+}
+
+/*
+ * Start tracking the latencies on an IOP. Any event callback that was
+ * set is still called.
+ */
+
+struct i89_lat *
+i89_lat_attach (struct i89 *iop)
+{
+	struct i89_lat *lat;
+
+	lat = malloc (sizeof(*lat));
+	if (lat == NULL)
+		return NULL;
+	i89_lat_reset (lat);
+
+	lat->event = iop->event;
+	iop->lat = lat;
+	iop->event = event;
+	i89_keep (iop, keep);
+
+	return lat;
+}
+
+/* Stop tracking and give the event callback back. */
+void
+i89_lat_detach (struct i89 *iop)
+{
+	struct i89_lat *lat = iop->lat;
+
+	if (lat == NULL)
+		return;
+
+	iop->event = lat->event;
+	iop->lat = NULL;
+	i89_unkeep (iop, keep);
+	free (lat);
+}
+
+/* Forget the samples, and the measurements in progress. */
+void
+i89_lat_reset (struct i89_lat *lat)
+{
+	int ch;
+
+	for (ch = 0; ch < 2; ch++) {
+		memset (lat->hist[ch], 0, sizeof(lat->hist[ch]));
+		lat->pending[ch].cmd = -1;
+	}
+}
+
+/*
+ * The histograms to look at: a channel, or -1 for both, and a command
+ * (0 for start in local space, 1 for system space, 2 for resume), or
+ * -1 for all.
+ */
+
+static int
+pick (const struct i89_lat *lat, int ch, int cmd, enum i89_lat_unit unit,
+	const struct hist **sel)
+{
+	int n = 0;
+	int c, k;
+
+	for (c = 0; c < 2; c++) {
+		if (ch != -1 && ch != c)
+			continue;
+		for (k = 0; k < CMDS; k++) {
+			if (cmd != -1 && cmd != k)
+				continue;
+			sel[n++] = &lat->hist[c][k][unit];
+		}
+	}
+
+	return n;
+}
+
+uint64_t
+i89_lat_count (struct i89_lat *lat, int ch, int cmd)
+{
+	const struct hist *sel[2 * CMDS];
+	uint64_t count = 0;
+	int i, n;
+
+	n = pick (lat, ch, cmd, I89_LAT_CYCLES, sel);
+	for (i = 0; i < n; i++)
+		count += sel[i]->count;
+
+	return count;
+}
+
+/*
+ * The latency that pct percent of the samples don't exceed, as the
+ * middle of its bucket. 0 with no samples.
+ */
+
+uint64_t
+i89_lat_percentile (struct i89_lat *lat, int ch, int cmd,
+		    enum i89_lat_unit unit, double pct)
+{
+	const struct hist *sel[2 * CMDS];
+	uint64_t count = 0, min = UINT64_MAX, max = 0;
+	uint64_t want, seen, v;
+	unsigned b;
+	int i, n;
+
+	n = pick (lat, ch, cmd, unit, sel);
+	for (i = 0; i < n; i++) {
+		count += sel[i]->count;
+		if (sel[i]->count && sel[i]->min < min)
+			min = sel[i]->min;
+		if (sel[i]->max > max)
+			max = sel[i]->max;
+	}
+	if (count == 0)
+		return 0;
+
+	want = pct / 100.0 * count + 0.5;
+	if (want == 0)
+		want = 1;
+	if (want >= count)
+		return max;
+
+	seen = 0;
+	for (b = 0; b < BUCKETS; b++) {
+		for (i = 0; i < n; i++)
+			seen += sel[i]->n[b];
+		if (seen >= want)
+			break;
+	}
+
+	v = middle (b);
+	if (v < min)
+		return min;
+	return v < max ? v : max;
+}
+
+void
+i89_lat_report (struct i89_lat *lat)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	const struct hist *h;
+	enum i89_lat_unit unit;
+	int ch, cmd, i;
+
+	printf ("%-2s %-7s %-6s %10s %12s %12s %12s %12s %12s %12s\n",
+		"ch", "command", "unit", "count", "min",
+		"p50", "p90", "p99", "p99.9", "max");
+	for (ch = 0; ch < 2; ch++) {
+		for (cmd = 0; cmd < CMDS; cmd++) {
+			for (unit = 0; unit < I89_LAT_UNITS; unit++) {
+				h = &lat->hist[ch][cmd][unit];
+				if (h->count == 0)
+					continue;
+				printf ("%-2d %-7s %-6s %10llu %12llu", ch,
+					cmd_names[cmd], unit_names[unit],
+					(unsigned long long)h->count,
+					(unsigned long long)h->min);
+				for (i = 0; i < 4; i++) {
+					printf (" %12llu", (unsigned long long)
+						i89_lat_percentile (lat, ch, cmd, unit, pcts[i]));
+				}
+				printf (" %12llu\n", (unsigned long long)h->max);
+			}
+		}
+	}
+}
+
+/*
+ * Write the histograms out as CSV: one line for each bucket that has
+ * samples in it, with the highest value it covers and the sample count.
+ */
+
+int
+i89_lat_export (struct i89_lat *lat, int fd)
+{
+	const struct hist *h;
+	enum i89_lat_unit unit;
+	int ch, cmd;
+	unsigned b;
+
+	if (dprintf (fd, "channel,command,unit,value,count\n") < 0)
+		return -1;
+
+	for (ch = 0; ch < 2; ch++) {
+		for (cmd = 0; cmd < CMDS; cmd++) {
+			for (unit = 0; unit < I89_LAT_UNITS; unit++) {
+				h = &lat->hist[ch][cmd][unit];
+				for (b = 0; b < BUCKETS && h->count; b++) {
+					if (h->n[b] == 0)
+						continue;
+					if (dprintf (fd, "%d,%s,%s,%llu,%llu\n", ch,
+						     cmd_names[cmd], unit_names[unit],
+						     (unsigned long long)highest (b),
+						     (unsigned long long)h->n[b]) < 0)
+						return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
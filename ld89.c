@@ -0,0 +1,653 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loader for Intel HEX and OMF-86 object files. The file is read once,
+ * front to back, through a buffer that holds at most one record at a
+ * time; the data goes straight into sparse memory at its load address.
+ * Along the way, the loader notes the address ranges that got data, the
+ * start address and, for OMF-86, the public symbols.
+ *
+ * Intel HEX is loaded the base address given up from where its records
+ * say, start address included. OMF-86 modules are expected to be located
+ * already, as LOC86 leaves them, or to need no fixups: FIXUPP records
+ * are skipped. Relocatable segments are laid out one after another from
+ * the base address, with the alignment they ask for.
+ *
+ * The iterated data of a record expands to at most the whole address
+ * space, through at most LIDATA_DEPTH levels of nested blocks.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+#define BUF_SIZE	(1 << 17)
+#define SEGMENTS	256
+#define LIDATA_DEPTH	16
+#define LIDATA_MAX	0x100000
+
+#define OMF_THEADR	0x80
+#define OMF_LHEADR	0x82
+#define OMF_PEDATA	0x84
+#define OMF_PIDATA	0x86
+#define OMF_MODEND	0x8a
+#define OMF_PUBDEF	0x90
+#define OMF_SEGDEF	0x98
+#define OMF_LEDATA	0xa0
+#define OMF_LIDATA	0xa2
+
+struct i89_obj {
+	struct i89_extent *extent;
+	unsigned nextents, maxextents;
+
+	struct i89_sym *sym;
+	unsigned nsyms, maxsyms;
+
+	int have_entry;
+	uint32_t entry;
+};
+
+struct reader {
+	int fd;
+	int eof, error;
+	unsigned pos, len;
+	uint8_t buf[BUF_SIZE];
+};
+
+struct ctx {
+	struct reader r;
+	struct i89_mem *mem;
+	struct i89_obj *obj;
+	uint32_t base;
+
+	/* OMF-86 segments, by index; 0 is unused. */
+	uint32_t seg[SEGMENTS];
+	unsigned nsegs;
+	uint32_t next;
+};
+
+/* Have n bytes in the buffer, unless the file ends first. */
+static unsigned
+fill (struct reader *r, unsigned n)
+{
+	ssize_t br;
+
+	if (r->len - r->pos >= n)
+		return n;
+
+	memmove (r->buf, r->buf + r->pos, r->len - r->pos);
+	r->len -= r->pos;
+	r->pos = 0;
+
+	while (r->len < n && !r->eof) {
+		br = read (r->fd, r->buf + r->len, BUF_SIZE - r->len);
+		if (br == -1) {
+			r->error = 1;
+			br = 0;
+		}
+		if (br == 0)
+			r->eof = 1;
+		r->len += br;
+	}
+
+	return r->len < n ? r->len : n;
+}
+
+static int
+grow (void **p, unsigned *max, unsigned n, size_t size)
+{
+	void *np;
+
+	if (n < *max)
+		return 0;
+
+	np = realloc (*p, (*max ? *max * 2 : 16) * size);
+	if (np == NULL)
+		return -1;
+	*p = np;
+	*max = *max ? *max * 2 : 16;
+	return 0;
+}
+
+/* Put data in memory, and note where. */
+static int
+place (struct ctx *c, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	struct i89_obj *obj = c->obj;
+	struct i89_extent *e;
+	uint32_t n;
+
+	while (len) {
+		addr &= 0xfffff;
+		n = 0x100000 - addr < len ? 0x100000 - addr : len;
+		if (i89_mem_write (c->mem, addr, data, n))
+			return -1;
+
+		/* Records mostly come in order: extend the last range. */
+		e = obj->nextents ? &obj->extent[obj->nextents - 1] : NULL;
+		if (e && addr == e->addr + e->len) {
+			e->len += n;
+		} else {
+			if (grow ((void **)&obj->extent, &obj->maxextents,
+				  obj->nextents, sizeof(*obj->extent)))
+				return -1;
+			e = &obj->extent[obj->nextents++];
+			e->addr = addr;
+			e->len = n;
+		}
+
+		addr += n;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+symbol (struct i89_obj *obj, const uint8_t *name, unsigned len, uint32_t addr)
+{
+	struct i89_sym *s;
+
+	if (grow ((void **)&obj->sym, &obj->maxsyms, obj->nsyms, sizeof(*obj->sym)))
+		return -1;
+
+	s = &obj->sym[obj->nsyms];
+	s->name = malloc (len + 1);
+	if (s->name == NULL)
+		return -1;
+	memcpy (s->name, name, len);
+	s->name[len] = '\0';
+	s->addr = addr & 0xfffff;
+	obj->nsyms++;
+	return 0;
+}
+
+/*
+ * Intel HEX.
+ */
+
+/* Digit values plus one; 0 for anything that isn't one. */
+static const uint8_t hexval[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/* Decode n hex digit pairs; -1 if any isn't one. */
+static int
+unhex (const uint8_t *p, uint8_t *out, unsigned n)
+{
+	unsigned ok = 1;
+	unsigned hi, lo;
+
+	while (n--) {
+		hi = hexval[p[0]];
+		lo = hexval[p[1]];
+		ok &= hi && lo;
+		*out++ = (hi - 1) << 4 | (lo - 1);
+		p += 2;
+	}
+
+	return ok ? 0 : -1;
+}
+
+static int
+load_hex (struct ctx *c)
+{
+	struct reader *r = &c->r;
+	uint8_t rec[5 + 255];
+	uint32_t base = 0;
+	uint8_t sum;
+	unsigned len;
+	unsigned i, n;
+
+	for (;;) {
+		/* Skip to the start of a record. */
+		while (fill (r, 1) && r->buf[r->pos] != ':')
+			r->pos++;
+		if (fill (r, 1) == 0)
+			return 0;
+		if (fill (r, 11) < 11)
+			return -1;
+
+		r->pos++;
+		if (unhex (r->buf + r->pos, rec, 1))
+			return -1;
+		n = rec[0] + 5;
+		if (fill (r, n * 2) < n * 2 || unhex (r->buf + r->pos, rec, n))
+			return -1;
+		r->pos += n * 2;
+
+		for (sum = 0, i = 0; i < n; i++)
+			sum += rec[i];
+		if (sum)
+			return -1;
+
+		/* The address and start address records have fixed lengths. */
+		switch (rec[3]) {
+		case 0x02:
+		case 0x04:
+			len = 2;
+			break;
+		case 0x03:
+		case 0x05:
+			len = 4;
+			break;
+		default:
+			len = rec[0];
+		}
+		if (rec[0] != len)
+			return -1;
+
+		switch (rec[3]) {
+		case 0x00:
+			if (place (c, c->base + base + (rec[1] << 8 | rec[2]), rec + 4, rec[0]))
+				return -1;
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+			base = (rec[4] << 8 | rec[5]) << 4;
+			break;
+		case 0x03:
+			c->obj->have_entry = 1;
+			c->obj->entry = (c->base + ((rec[4] << 8 | rec[5]) << 4) +
+					 (rec[6] << 8 | rec[7])) & 0xfffff;
+			break;
+		case 0x04:
+			base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+			break;
+		case 0x05:
+			c->obj->have_entry = 1;
+			c->obj->entry = (c->base + (rec[5] << 16 | rec[6] << 8 | rec[7])) & 0xfffff;
+			break;
+		default:
+			return -1;
+		}
+	}
+}
+
+/*
+ * OMF-86.
+ */
+
+static unsigned
+get_index (const uint8_t **p)
+{
+	unsigned i = *(*p)++;
+
+	if (i & 0x80)
+		i = (i & 0x7f) << 8 | *(*p)++;
+	return i;
+}
+
+static unsigned
+get_word (const uint8_t **p)
+{
+	unsigned w = (*p)[0] | (*p)[1] << 8;
+
+	*p += 2;
+	return w;
+}
+
+/*
+ * Expand an iterated data block at addr, or with emit unset just skip
+ * it. Returns the address past it, or -1 if the block runs past end,
+ * nests too deep or would expand past limit.
+ */
+
+static int64_t
+iterated (struct ctx *c, const uint8_t **p, const uint8_t *end, int64_t addr,
+	  int64_t limit, int emit, int depth)
+{
+	const uint8_t *body;
+	unsigned repeat, blocks, i, j;
+	int64_t next = addr;
+
+	if (depth == LIDATA_DEPTH || end - *p < 4)
+		return -1;
+	repeat = get_word (p);
+	blocks = get_word (p);
+	body = *p;
+
+	/* Nothing is repeated zero times, but the block is still there.
+	 * Skipping it takes one pass. */
+	if (repeat == 0 || !emit) {
+		emit = 0;
+		repeat = 1;
+	}
+
+	for (i = 0; i < repeat; i++) {
+		*p = body;
+		if (blocks == 0) {
+			if (*p >= end || end - *p - 1 < **p)
+				return -1;
+			if (emit && next + **p > limit)
+				return -1;
+			if (emit && place (c, next, *p + 1, **p))
+				return -1;
+			if (emit)
+				next += **p;
+			*p += 1 + **p;
+		} else {
+			for (j = 0; j < blocks; j++) {
+				next = iterated (c, p, end, next, limit, emit, depth + 1);
+				if (next == -1)
+					return -1;
+			}
+		}
+
+		/* A pass that put nothing anywhere won't the next time. */
+		if (next == addr)
+			break;
+	}
+
+	return next;
+}
+
+static int
+segdef (struct ctx *c, const uint8_t *p, const uint8_t *end)
+{
+	unsigned acbp, align;
+	uint32_t base, len;
+
+	if (c->nsegs == SEGMENTS - 1 || end - p < 3)
+		return -1;
+
+	acbp = *p++;
+	align = acbp >> 5;
+	if (align == 0) {
+		if (end - p < 3)
+			return -1;
+		base = get_word (&p) << 4;
+		base += *p++;
+	} else {
+		static const uint32_t mask[] = { 0, 0, 1, 15, 255, 3 };
+
+		if (align > 5)
+			return -1;
+		base = (c->next + mask[align]) & ~mask[align];
+	}
+	if (end - p < 2)
+		return -1;
+	len = get_word (&p);
+	if (acbp & 0x02)
+		len = 0x10000;
+
+	c->seg[++c->nsegs] = base;
+	if (align && base + len > c->next)
+		c->next = base + len;
+	return 0;
+}
+
+static int
+pubdef (struct ctx *c, const uint8_t *p, const uint8_t *end)
+{
+	uint32_t base;
+	unsigned seg;
+
+	if (end - p < 2)
+		return -1;
+	get_index (&p);
+	seg = get_index (&p);
+	if (seg == 0) {
+		if (end - p < 2)
+			return -1;
+		base = get_word (&p) << 4;
+	} else if (seg <= c->nsegs) {
+		base = c->seg[seg];
+	} else {
+		return -1;
+	}
+
+	while (p < end) {
+		if (end - p < 1 + *p + 3)
+			return -1;
+		if (symbol (c->obj, p + 1, *p, base + (p[1 + *p] | p[2 + *p] << 8)))
+			return -1;
+		p += 1 + *p + 2;
+		get_index (&p);
+	}
+
+	return 0;
+}
+
+static int
+modend (struct ctx *c, const uint8_t *p, const uint8_t *end)
+{
+	unsigned type, fix, frame, target;
+	uint32_t base;
+
+	if (p == end)
+		return -1;
+	type = *p++;
+	if (!(type & 0x40))
+		return 0;
+
+	if (!(type & 0x01)) {
+		/* Physical start address. */
+		if (end - p < 4)
+			return -1;
+		base = get_word (&p) << 4;
+		c->obj->entry = (base + get_word (&p)) & 0xfffff;
+		c->obj->have_entry = 1;
+		return 0;
+	}
+
+	/* Logical: only a target given by a segment is understood. */
+	if (p == end)
+		return -1;
+	fix = *p++;
+	frame = (fix >> 4) & 7;
+	target = fix & 3;
+	if (frame < 3)
+		get_index (&p);
+	else if (frame == 3)
+		p += 2;
+	if (target != 0 || p >= end)
+		return 0;
+	target = get_index (&p);
+	if (target == 0 || target > c->nsegs)
+		return -1;
+	if (!(fix & 0x04)) {
+		if (end - p < 2)
+			return -1;
+		base = get_word (&p);
+	} else {
+		base = 0;
+	}
+	c->obj->entry = (c->seg[target] + base) & 0xfffff;
+	c->obj->have_entry = 1;
+	return 0;
+}
+
+static int
+record (struct ctx *c, uint8_t type, const uint8_t *p, const uint8_t *end)
+{
+	uint32_t addr;
+	int64_t next, limit;
+	unsigned seg;
+
+	switch (type) {
+	case OMF_PEDATA:
+	case OMF_PIDATA:
+		if (end - p < 3)
+			return -1;
+		addr = get_word (&p) << 4;
+		addr += *p++;
+		break;
+	case OMF_LEDATA:
+	case OMF_LIDATA:
+		seg = get_index (&p);
+		if (seg == 0 || seg > c->nsegs || end - p < 2)
+			return -1;
+		addr = c->seg[seg] + get_word (&p);
+		break;
+	case OMF_SEGDEF:
+		return segdef (c, p, end);
+	case OMF_PUBDEF:
+		return pubdef (c, p, end);
+	case OMF_MODEND:
+		if (modend (c, p, end))
+			return -1;
+		/* Another module may follow. */
+		c->nsegs = 0;
+		return 0;
+	default:
+		return 0;
+	}
+
+	if (type == OMF_PEDATA || type == OMF_LEDATA)
+		return place (c, addr, p, end - p);
+
+	next = addr;
+	limit = next + LIDATA_MAX;
+	while (p < end) {
+		next = iterated (c, &p, end, next, limit, 1, 0);
+		if (next == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+load_omf (struct ctx *c)
+{
+	struct reader *r = &c->r;
+	const uint8_t *p;
+	unsigned len, i;
+	uint8_t sum;
+
+	for (;;) {
+		switch (fill (r, 3)) {
+		case 0:
+			return 0;
+		case 3:
+			break;
+		default:
+			return -1;
+		}
+		p = r->buf + r->pos;
+		len = p[1] | p[2] << 8;
+		if (len == 0 || fill (r, 3 + len) < 3 + len)
+			return -1;
+		p = r->buf + r->pos;
+
+		/* A checksum of 0 means there is none. */
+		if (p[2 + len]) {
+			for (sum = 0, i = 0; i < 3 + len; i++)
+				sum += p[i];
+			if (sum)
+				return -1;
+		}
+
+		if (record (c, p[0], p + 3, p + 2 + len))
+			return -1;
+		r->pos += 3 + len;
+	}
+}
+
+/*
+ * Load an object file from fd into mem, base up for Intel HEX and from
+ * base on for relocatable OMF-86 segments. The format is told from the
+ * first byte: a colon starts Intel HEX, a module header OMF-86.
+ * Returns NULL if the file is neither or is corrupt.
+ */
+
+struct i89_obj *
+i89_load (struct i89_mem *mem, int fd, uint32_t base)
+{
+	struct ctx *c;
+	struct i89_obj *obj;
+	int ret = -1;
+
+	c = malloc (sizeof(*c));
+	obj = calloc (1, sizeof(*obj));
+	if (c == NULL || obj == NULL)
+		goto out;
+
+	c->r.fd = fd;
+	c->r.eof = c->r.error = 0;
+	c->r.pos = c->r.len = 0;
+	c->mem = mem;
+	c->obj = obj;
+	c->base = base;
+	c->nsegs = 0;
+	c->next = base;
+
+	if (fill (&c->r, 1) == 0)
+		goto out;
+	switch (c->r.buf[0]) {
+	case ':':
+		ret = load_hex (c);
+		break;
+	case OMF_THEADR:
+	case OMF_LHEADR:
+		ret = load_omf (c);
+		break;
+	}
+	if (c->r.error)
+		ret = -1;
+
+out:
+	free (c);
+	if (ret) {
+		i89_obj_free (obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void
+i89_obj_free (struct i89_obj *obj)
+{
+	unsigned i;
+
+	if (obj == NULL)
+		return;
+
+	for (i = 0; i < obj->nsyms; i++)
+		free (obj->sym[i].name);
+	free (obj->sym);
+	free (obj->extent);
+	free (obj);
+}
+
+/* The start address; -1 if the file has none. */
+int64_t
+i89_obj_entry (const struct i89_obj *obj)
+{
+	return obj->have_entry ? (int64_t)obj->entry : -1;
+}
+
+/* The address ranges that got data, in file order. */
+const struct i89_extent *
+i89_obj_extents (const struct i89_obj *obj, unsigned *n)
+{
+	*n = obj->nextents;
+	return obj->extent;
+}
+
+/* The public symbols, in file order. */
+const struct i89_sym *
+i89_obj_syms (const struct i89_obj *obj, unsigned *n)
+{
+	*n = obj->nsyms;
+	return obj->sym;
+}
@@ -0,0 +1,429 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sparse system memory. Pages are allocated on the first write; until
+ * then they read as the fill value. Pages that exist are mapped into
+ * the IOP as soon as it touches them, so that further accesses don't
+ * even go through the callbacks.
+ *
+ * The memory can also be laid over an image: a read-only, reference
+ * counted set of pages shared by many IOPs. Pages of the image are mapped
+ * read-only and copied into the memory only when an IOP writes to them.
+ * Memory over an image comes with a translation cache for the IOP it is
+ * attached to: the IOPs may run on threads of their own, so they can't
+ * share one. What is translated from the image itself can be frozen and
+ * shared, though, see i89_image_share().
+ *
+ * Pages written since the last i89_mem_reset() are marked dirty; clean
+ * pages are mapped read-only so that the first write to them is seen.
+ * Resetting only needs to restore the dirty ones.
+ *
+ * The memory knows the IOPs it is attached to. A page of the image that
+ * one of them gets a copy of is remapped in all of them, and so are the
+ * pages i89_mem_write() changes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "8089.h"
+
+struct i89_mem {
+	uint8_t *page[I89_PAGES];
+	uint8_t dirty[I89_PAGES];
+	unsigned npages;
+	uint8_t fill;
+	struct i89_image *image;
+	struct i89_tc *tc;
+
+	/* Attached IOPs, linked through mem_next. */
+	struct i89 *iops;
+
+	/* Stores dropped for want of host memory. */
+	uint64_t lost;
+};
+
+struct i89_image {
+	unsigned ref;
+	struct i89_mem *mem;
+	struct i89_tc *tc;	/* Frozen, see i89_image_share() */
+};
+
+#define PAGE(a)		(((a) >> I89_PAGE_SHIFT) % I89_PAGES)
+#define PAGE_OFF(a)	((a) & (I89_PAGE_SIZE - 1))
+
+struct i89_mem *
+i89_mem_new (uint8_t fill)
+{
+	struct i89_mem *mem;
+
+	mem = calloc (1, sizeof(*mem));
+	if (mem == NULL)
+		return NULL;
+	mem->fill = fill;
+
+	return mem;
+}
+
+void
+i89_mem_free (struct i89_mem *mem)
+{
+	int i;
+
+	for (i = 0; i < I89_PAGES; i++)
+		free (mem->page[i]);
+	if (mem->image)
+		i89_image_put (mem->image);
+	if (mem->tc)
+		i89_tc_free (mem->tc);
+	free (mem);
+}
+
+uint32_t
+i89_mem_size (struct i89_mem *mem)
+{
+	return mem->npages * I89_PAGE_SIZE;
+}
+
+/* Several IOPs may share the memory from different threads. */
+static uint8_t *
+page (struct i89_mem *mem, unsigned p)
+{
+	uint8_t *new, *old = NULL;
+
+	if (mem->page[p])
+		return mem->page[p];
+
+	new = malloc (I89_PAGE_SIZE);
+	if (new == NULL)
+		return NULL;
+	if (mem->image && mem->image->mem->page[p])
+		memcpy (new, mem->image->mem->page[p], I89_PAGE_SIZE);
+	else
+		memset (new, mem->fill, I89_PAGE_SIZE);
+
+	if (!__atomic_compare_exchange_n (&mem->page[p], &old, new,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free (new);
+		return old;
+	}
+
+	__atomic_fetch_add (&mem->npages, 1, __ATOMIC_RELAXED);
+	return new;
+}
+
+/*
+ * Point the attached IOPs that still map an older page at the memory's
+ * own one. They may be running on other threads: until they see the new
+ * pointer, they keep reading the image they had.
+ */
+static void
+remap (struct i89_mem *mem, uint32_t addr)
+{
+	unsigned p = PAGE(addr);
+	struct i89 *iop;
+
+	for (iop = mem->iops; iop; iop = iop->mem_next) {
+		if (iop->map[p] && iop->map[p] != mem->page[p])
+			i89_map (iop, addr & ~(I89_PAGE_SIZE - 1), I89_PAGE_SIZE, mem->page[p]);
+	}
+}
+
+/*
+ * Store into the memory from the host, while the IOPs attached to it
+ * are not running. Returns -1 if out of memory.
+ */
+
+int
+i89_mem_write (struct i89_mem *mem, uint32_t addr, const void *buf, uint32_t len)
+{
+	const uint8_t *p = buf;
+	struct i89 *iop;
+	uint8_t *dst;
+	uint32_t n;
+
+	while (len) {
+		n = I89_PAGE_SIZE - PAGE_OFF(addr);
+		if (n > len)
+			n = len;
+		dst = page (mem, PAGE(addr));
+		if (dst == NULL)
+			return -1;
+		memcpy (dst + PAGE_OFF(addr), p, n);
+		mem->dirty[PAGE(addr)] = 1;
+
+		remap (mem, addr);
+		for (iop = mem->iops; iop; iop = iop->mem_next)
+			i89_invalidate (iop, addr, n);
+
+		addr += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Stores the IOPs made that were dropped for want of host memory. */
+uint64_t
+i89_mem_lost (struct i89_mem *mem)
+{
+	return __atomic_load_n (&mem->lost, __ATOMIC_RELAXED);
+}
+
+static uint8_t
+read8 (struct i89 *iop, uint32_t addr)
+{
+	struct i89_mem *mem = iop->mem;
+	uint8_t *p = mem->page[PAGE(addr)];
+
+	if (p == NULL && mem->image)
+		p = mem->image->mem->page[PAGE(addr)];
+	if (p == NULL)
+		return mem->fill;
+	if (p != mem->page[PAGE(addr)] || !mem->dirty[PAGE(addr)]) {
+		i89_map_ro (iop, addr & ~(I89_PAGE_SIZE - 1), I89_PAGE_SIZE, p);
+		return p[PAGE_OFF(addr)];
+	}
+
+	i89_map (iop, addr & ~(I89_PAGE_SIZE - 1), I89_PAGE_SIZE, p);
+	return p[PAGE_OFF(addr)];
+}
+
+static void
+write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	struct i89_mem *mem = iop->mem;
+	uint8_t *p = page (mem, PAGE(addr));
+
+	/* Nothing the IOP could be told; count it. */
+	if (p == NULL) {
+		__atomic_add_fetch (&mem->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	mem->dirty[PAGE(addr)] = 1;
+	i89_map (iop, addr & ~(I89_PAGE_SIZE - 1), I89_PAGE_SIZE, p);
+	p[PAGE_OFF(addr)] = value;
+	remap (mem, addr);
+}
+
+static void
+unlink_iop (struct i89_mem *mem, struct i89 *iop)
+{
+	struct i89 **p;
+
+	for (p = &mem->iops; *p; p = &(*p)->mem_next) {
+		if (*p == iop) {
+			*p = iop->mem_next;
+			return;
+		}
+	}
+}
+
+/* Map what the memory has, read-only where a write needs to be seen. */
+static void
+map (struct i89 *iop, struct i89_mem *mem)
+{
+	int i;
+
+	for (i = 0; i < I89_PAGES; i++) {
+		if (mem->page[i] == NULL && mem->image && mem->image->mem->page[i])
+			i89_map_ro (iop, i << I89_PAGE_SHIFT, I89_PAGE_SIZE, mem->image->mem->page[i]);
+		else if (mem->page[i] && !mem->dirty[i])
+			i89_map_ro (iop, i << I89_PAGE_SHIFT, I89_PAGE_SIZE, mem->page[i]);
+		else
+			i89_map (iop, i << I89_PAGE_SHIFT, I89_PAGE_SIZE, mem->page[i]);
+	}
+}
+
+static void
+callbacks (struct i89 *iop)
+{
+	iop->read8 = read8;
+	iop->read16 = NULL;
+	iop->write8 = write8;
+	iop->write16 = NULL;
+}
+
+/* After i89_reset(): the template's page map is not what this memory has. */
+static void
+keep (struct i89 *iop, const struct i89 *own)
+{
+	iop->mem = own->mem;
+	iop->mem_next = own->mem_next;
+	if (own->mem->tc)
+		iop->tc = own->mem->tc;
+	callbacks (iop);
+	map (iop, own->mem);
+}
+
+void
+i89_mem_attach (struct i89 *iop, struct i89_mem *mem)
+{
+	/* An IOP copied from another one may claim to be attached. */
+	if (iop->mem)
+		unlink_iop (iop->mem, iop);
+	unlink_iop (mem, iop);
+	iop->mem = mem;
+	iop->mem_next = mem->iops;
+	mem->iops = iop;
+
+	if (mem->tc)
+		iop->tc = mem->tc;
+	callbacks (iop);
+	map (iop, mem);
+	i89_keep (iop, keep);
+}
+
+/*
+ * Undo the writes since the last reset, bringing the dirty pages back
+ * to what the image (or the fill value) has. IOPs that have the memory
+ * attached need to be reset with i89_reset() or attached again, after.
+ */
+
+void
+i89_mem_reset (struct i89_mem *mem)
+{
+	const uint8_t *orig;
+	int i;
+
+	for (i = 0; i < I89_PAGES; i++) {
+		if (!mem->dirty[i])
+			continue;
+		orig = mem->image ? mem->image->mem->page[i] : NULL;
+		if (orig)
+			memcpy (mem->page[i], orig, I89_PAGE_SIZE);
+		else
+			memset (mem->page[i], mem->fill, I89_PAGE_SIZE);
+		mem->dirty[i] = 0;
+	}
+}
+
+/*
+ * New empty memory over the same image, and with the same fill value,
+ * as the given one.
+ */
+
+struct i89_mem *
+i89_mem_overlay (struct i89_mem *mem)
+{
+	struct i89_mem *new;
+
+	new = i89_mem_new (mem->fill);
+	if (new == NULL)
+		return NULL;
+	if (mem->image) {
+		__atomic_add_fetch (&mem->image->ref, 1, __ATOMIC_ACQ_REL);
+		new->image = mem->image;
+		new->tc = i89_tc_new ();
+		if (new->tc == NULL) {
+			i89_mem_free (new);
+			return NULL;
+		}
+		if (mem->image->tc)
+			i89_tc_share (new->tc, mem->image->tc);
+	}
+
+	return new;
+}
+
+/*
+ * Turn the memory into an image. The caller holds the only reference.
+ */
+
+struct i89_image *
+i89_image_new (struct i89_mem *mem)
+{
+	struct i89_image *image;
+
+	image = calloc (1, sizeof(*image));
+	if (image == NULL)
+		return NULL;
+
+	image->mem = mem;
+	image->ref = 1;
+
+	return image;
+}
+
+void
+i89_image_put (struct i89_image *image)
+{
+	if (__atomic_sub_fetch (&image->ref, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (image->tc)
+		i89_tc_free (image->tc);
+	i89_mem_free (image->mem);
+	free (image);
+}
+
+/*
+ * Lay the (empty) memory over the image and attach it to the IOP.
+ * Returns -1 if out of memory.
+ */
+
+int
+i89_image_attach (struct i89 *iop, struct i89_mem *mem, struct i89_image *image)
+{
+	if (mem->tc == NULL) {
+		mem->tc = i89_tc_new ();
+		if (mem->tc == NULL)
+			return -1;
+	}
+
+	if (image->tc)
+		i89_tc_share (mem->tc, image->tc);
+
+	__atomic_add_fetch (&image->ref, 1, __ATOMIC_ACQ_REL);
+	if (mem->image)
+		i89_image_put (mem->image);
+	mem->image = image;
+	i89_mem_attach (iop, mem);
+	return 0;
+}
+
+/*
+ * Hand what the IOP, attached to memory over the image, translated from
+ * the image over to it. Warm-up is then paid once: memories laid over
+ * the image from now on start out with those blocks, which any number of
+ * IOPs may use from threads of their own. The IOP goes on with an empty
+ * cache that looks into them, too. Returns -1 if out of memory, or if
+ * the image already has a cache.
+ */
+
+int
+i89_image_share (struct i89_image *image, struct i89 *iop)
+{
+	struct i89_mem *mem = iop->mem;
+	struct i89_tc *tc;
+	struct i89 *other;
+
+	if (image->tc || mem == NULL || mem->image != image || mem->tc == NULL)
+		return -1;
+
+	tc = i89_tc_new ();
+	if (tc == NULL)
+		return -1;
+
+	i89_tc_freeze (mem->tc, image->mem->page);
+	image->tc = mem->tc;
+	i89_tc_share (tc, image->tc);
+	mem->tc = tc;
+	for (other = mem->iops; other; other = other->mem_next)
+		other->tc = tc;
+	return 0;
+}
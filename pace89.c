@@ -0,0 +1,205 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Real-time pacing, for runs against real hardware. The emulated clock
+ * is tied to the host's monotonic clock at the clock rate of the part
+ * (5 or 8 MHz): a channel is run in batches of cycles and after each
+ * batch the host waits until the wall clock catches up with it. The
+ * wait is a sleep for most of its length and a spin for the rest, so
+ * that the wake up is on time without keeping a core busy.
+ *
+ * Time goes on while the channel is halted; an idle channel is not run
+ * at all, the host just sleeps. A channel parked in a polling loop is
+ * cheap to run too, see poll_limit in struct i89.
+ *
+ * If the host falls behind, say because it was descheduled, the batches
+ * that follow are run without waiting until it catches up. A lag longer
+ * than max_lag is not made up for: it is given up on and counted.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "8089.h"
+
+struct i89_pace {
+	uint64_t hz;
+	uint64_t batch;		/* Cycles */
+	uint64_t spin;		/* Nanoseconds */
+	uint64_t max_lag;	/* Nanoseconds */
+
+	/* Host time emulated cycle 0 is at, and cycles run since. */
+	int started;
+	uint64_t t0;
+	uint64_t now;
+
+	struct i89_pace_stats stats;
+};
+
+static uint64_t
+host_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+cycles_ns (struct i89_pace *pace, uint64_t cycles)
+{
+	return cycles / pace->hz * 1000000000ULL +
+	       cycles % pace->hz * 1000000000ULL / pace->hz;
+}
+
+struct i89_pace *
+i89_pace_new (unsigned hz)
+{
+	struct i89_pace *pace;
+
+	if (hz == 0)
+		return NULL;
+
+	pace = calloc (1, sizeof(*pace));
+	if (pace == NULL)
+		return NULL;
+
+	pace->hz = hz;
+	i89_pace_tune (pace, 1000, 50, 50000);
+	return pace;
+}
+
+void
+i89_pace_free (struct i89_pace *pace)
+{
+	free (pace);
+}
+
+/*
+ * Batches of batch_us microseconds, the last spin_us of a wait are spun
+ * rather than slept, and a lag over max_lag_us is given up on.
+ */
+
+void
+i89_pace_tune (struct i89_pace *pace, unsigned batch_us, unsigned spin_us, unsigned max_lag_us)
+{
+	pace->batch = pace->hz * batch_us / 1000000;
+	if (pace->batch == 0)
+		pace->batch = 1;
+	pace->spin = spin_us * 1000ULL;
+	pace->max_lag = max_lag_us * 1000ULL;
+}
+
+/* Wait for the host clock to get to the emulated one. */
+static void
+wait (struct i89_pace *pace)
+{
+	struct i89_pace_stats *s = &pace->stats;
+	uint64_t deadline = pace->t0 + cycles_ns (pace, pace->now);
+	uint64_t t = host_ns ();
+	uint64_t start = t;
+	struct timespec ts;
+
+	if (t > deadline) {
+		s->late++;
+		if (t - deadline > s->max_lag)
+			s->max_lag = t - deadline;
+		if (t - deadline > pace->max_lag) {
+			s->resyncs++;
+			s->lost += t - deadline;
+			pace->t0 += t - deadline;
+		}
+		return;
+	}
+
+	if (deadline - t > pace->spin) {
+		ts.tv_sec = (deadline - pace->spin) / 1000000000ULL;
+		ts.tv_nsec = (deadline - pace->spin) % 1000000000ULL;
+		/* It returns the error rather than setting errno. On
+		 * anything but a signal, spin the rest of the way. */
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		t = host_ns ();
+		s->slept += t - start;
+		start = t;
+	}
+
+	while (t < deadline)
+		t = host_ns ();
+	s->spun += t - start;
+
+	if (t - deadline > s->max_jitter)
+		s->max_jitter = t - deadline;
+}
+
+/*
+ * Run a channel for cycles clocks in real time. Returns like i89_run(),
+ * except that a halted channel still takes up the time.
+ */
+
+int
+i89_pace_run (struct i89_pace *pace, struct i89 *iop, int ch,
+	      enum i89_flags flags, uint64_t cycles)
+{
+	uint64_t end = pace->now + cycles;
+	uint64_t before, n;
+	int ret = I89_OK;
+
+	if (!pace->started) {
+		pace->t0 = host_ns ();
+		pace->started = 1;
+	}
+
+	while (pace->now < end) {
+		n = end - pace->now < pace->batch ? end - pace->now : pace->batch;
+		before = iop->cycles;
+		ret = i89_run (iop, ch, flags, n);
+		pace->now += iop->cycles - before;
+		pace->stats.batches++;
+
+		switch (ret) {
+		case I89_OK:
+		case I89_DMA:
+		case I89_POLL:
+			break;
+		case I89_HALT:
+			/* Idle for the rest of the time. */
+			pace->now = end;
+			break;
+		default:
+			/* Stopped for the host to look at; whatever time
+			 * that takes is a lag. */
+			return ret;
+		}
+
+		wait (pace);
+	}
+
+	return ret;
+}
+
+/*
+ * Drift is how far the host clock is ahead of the emulated one now: it
+ * is negative while the emulator is waiting for it.
+ */
+
+void
+i89_pace_stats (struct i89_pace *pace, struct i89_pace_stats *stats)
+{
+	*stats = pace->stats;
+	if (pace->started)
+		stats->drift = host_ns () - (pace->t0 + cycles_ns (pace, pace->now));
+}
@@ -0,0 +1,124 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Instance pool. Many short runs of the same program don't need to set
+ * up an IOP and load its memory each time: the pool hands out IOPs that
+ * look like a template, each with its own memory laid over the image of
+ * the template's. An IOP that is given back is reset, which only copies
+ * the template and restores the pages it wrote to.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "8089.h"
+
+struct i89_pool {
+	struct i89 tmpl;
+	struct i89 **free;
+	unsigned nfree, size;
+};
+
+/*
+ * The template needs to have a memory laid over an image attached, see
+ * i89_image_attach(). Only what is in the image is used.
+ */
+
+struct i89_pool *
+i89_pool_new (const struct i89 *tmpl)
+{
+	struct i89_pool *pool;
+	struct i89_mem *mem;
+
+	pool = calloc (1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	mem = i89_mem_overlay (tmpl->mem);
+	if (mem == NULL) {
+		free (pool);
+		return NULL;
+	}
+
+	pool->tmpl = *tmpl;
+	pool->tmpl.watch = NULL;
+	i89_mem_attach (&pool->tmpl, mem);
+	i89_cb (&pool->tmpl);
+
+	return pool;
+}
+
+struct i89 *
+i89_pool_get (struct i89_pool *pool)
+{
+	struct i89 *iop;
+
+	if (pool->nfree)
+		return pool->free[--pool->nfree];
+
+	iop = calloc (1, sizeof(*iop));
+	if (iop == NULL)
+		return NULL;
+	iop->mem = i89_mem_overlay (pool->tmpl.mem);
+	if (iop->mem == NULL) {
+		free (iop);
+		return NULL;
+	}
+	/* For the translation cache of its own. */
+	i89_mem_attach (iop, iop->mem);
+	i89_reset (iop, &pool->tmpl);
+
+	return iop;
+}
+
+/* Give the IOP back, resetting it for the next user. */
+void
+i89_pool_put (struct i89_pool *pool, struct i89 *iop)
+{
+	struct i89 **slots;
+
+	/* Then the reset maps its pages as clean. */
+	i89_mem_reset (iop->mem);
+	i89_reset (iop, &pool->tmpl);
+
+	if (pool->nfree == pool->size) {
+		slots = realloc (pool->free, (pool->size * 2 + 8) * sizeof(*slots));
+		if (slots == NULL) {
+			i89_watch_free (iop);
+			i89_mem_free (iop->mem);
+			free (iop);
+			return;
+		}
+		pool->free = slots;
+		pool->size = pool->size * 2 + 8;
+	}
+	pool->free[pool->nfree++] = iop;
+}
+
+void
+i89_pool_free (struct i89_pool *pool)
+{
+	struct i89 *iop;
+
+	while (pool->nfree) {
+		iop = pool->free[--pool->nfree];
+		i89_watch_free (iop);
+		i89_mem_free (iop->mem);
+		free (iop);
+	}
+
+	i89_mem_free (pool->tmpl.mem);
+	free (pool->free);
+	free (pool);
+}
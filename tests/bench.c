@@ -0,0 +1,297 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * How fast the ways of running a channel program are, in emulated
+ * clock cycles per host second. Not part of "make check": numbers only
+ * mean something with optimization on, e.g.
+ *
+ *   make clean; make bench CFLAGS=-O2
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "8089.h"
+
+#define REGS		0x0000
+#define MEMS		0x0040
+#define DATA		0x2000
+#define LOOPS		5000
+#define SECONDS		0.5
+#define LANES		64
+
+static const uint8_t prog[] = {
+	/* REGS */
+	0x71, 0x30, 0x05, 0x00,		/* movi bc,5 */
+	0x60, 0x3c,			/* dec bc */
+	0x68, 0x40, 0xfb,		/* jnz bc,$-3 */
+	0x29, 0x20, 0x03,		/* addi gb,3 */
+	0x00, 0x3c,			/* dec ga */
+	0x10, 0x40, 0xee, 0xff,		/* ljnz ga,REGS */
+	0x20, 0x48,			/* hlt */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,
+
+	/* MEMS */
+	0x21, 0x82,			/* mov gb,[gc] */
+	0x29, 0x20, 0x03,		/* addi gb,3 */
+	0x21, 0x86,			/* mov [gc],gb */
+	0x40, 0x38,			/* inc gc */
+	0x40, 0x38,			/* inc gc */
+	0x00, 0x3c,			/* dec ga */
+	0x10, 0x40, 0xef, 0xff,		/* ljnz ga,MEMS */
+	0x20, 0x48,			/* hlt */
+};
+
+static uint8_t mem[0x100000];
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t
+read8 (struct i89 *iop, uint32_t addr)
+{
+	return mem[addr & 0xfffff];
+}
+
+static void
+write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	mem[addr & 0xfffff] = value;
+}
+
+/* Memory is mapped, unless there are callbacks for it. */
+static void
+setup (struct i89 *iop, uint32_t tp)
+{
+	struct i89_tc *tc = iop->tc;
+	struct i89_undo *undo = iop->undo;
+	uint8_t (*rd)(struct i89 *iop, uint32_t addr) = iop->read8;
+	void (*wr)(struct i89 *iop, uint32_t addr, uint8_t value) = iop->write8;
+
+	memset (iop, 0, sizeof(*iop));
+	memset (mem + DATA, 0, 2 * LOOPS);
+	iop->tc = tc;
+	iop->undo = undo;
+	if (rd == NULL)
+		i89_map (iop, 0, sizeof(mem), mem);
+	iop->read8 = rd;
+	iop->write8 = wr;
+	iop->chan[0].regs[TP] = tp;
+	iop->chan[0].regs[GA] = LOOPS;
+	iop->chan[0].regs[GC] = DATA;
+}
+
+/* Run the program at tp over and over; cycles per second. */
+static double
+bench (struct i89 *iop, uint32_t tp)
+{
+	uint64_t cycles = 0;
+	double start = now (), t;
+
+	do {
+		setup (iop, tp);
+		while (i89_run (iop, 0, I89_EXEC, 1000000) == I89_OK)
+			;
+		cycles += iop->cycles;
+		t = now () - start;
+	} while (t < SECONDS);
+
+	return cycles / t;
+}
+
+static void
+report (const char *name, double base, double rate)
+{
+	printf ("%-24s %8.1f Mcycles/s %6.2fx\n", name, rate / 1e6, rate / base);
+}
+
+static int
+tc (const char *name, uint32_t tp)
+{
+	struct i89 interp = { 0, }, cached = { 0, };
+	double base;
+
+	setup (&interp, tp);
+	base = bench (&interp, tp);
+
+	cached.tc = i89_tc_new ();
+	if (cached.tc == NULL)
+		return -1;
+	report (name, base, base);
+	report ("  translation cache", base, bench (&cached, tp));
+	i89_tc_free (cached.tc);
+
+	/* Same results, or the numbers mean nothing. */
+	if (i89_compare (&interp, &cached) || interp.cycles != cached.cycles) {
+		printf ("FAIL: %s: translated run ended elsewhere\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Memory reached through the callbacks; see tests/inline for the same
+ * with the bus built in. */
+static int
+callbacks (const char *name, uint32_t tp)
+{
+	struct i89 interp = { 0, }, cb = { 0, };
+	double base;
+
+	base = bench (&interp, tp);
+	cb.read8 = read8;
+	cb.write8 = write8;
+	report (name, base, base);
+	report ("  callbacks", base, bench (&cb, tp));
+
+	if (i89_compare (&interp, &cb)) {
+		printf ("FAIL: %s: run through callbacks ended elsewhere\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Each step journaled, against the translation cache it does without. */
+static int
+undo (const char *name, uint32_t tp)
+{
+	struct i89 interp = { 0, }, cached = { 0, }, journaled = { 0, };
+	double base;
+
+	base = bench (&interp, tp);
+	cached.tc = i89_tc_new ();
+	if (cached.tc == NULL || i89_undo_enable (&journaled, 4096, 4096))
+		return -1;
+	report (name, base, base);
+	report ("  translation cache", base, bench (&cached, tp));
+	report ("  undo journal", base, bench (&journaled, tp));
+	i89_tc_free (cached.tc);
+	i89_undo_disable (&journaled);
+
+	if (i89_compare (&interp, &journaled)) {
+		printf ("FAIL: %s: journaled run ended elsewhere\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* A sweep: lanes that count down from slightly different loop counts. */
+static void
+lanes (struct i89 *iops, uint32_t tp)
+{
+	int l;
+
+	for (l = 0; l < LANES; l++) {
+		setup (&iops[l], tp);
+		iops[l].chan[0].regs[GA] = LOOPS - l;
+		iops[l].chan[0].regs[GB] = l;
+	}
+}
+
+/* Run the lanes one after another, or in lockstep; cycles per second. */
+static double
+sweep (struct i89 *iops, uint32_t tp, struct i89_lockstep *ls)
+{
+	uint64_t cycles = 0;
+	double start = now (), t;
+	int l;
+
+	do {
+		lanes (iops, tp);
+		if (ls) {
+			while (i89_lockstep_run (ls, I89_EXEC, 1000000) < LANES)
+				;
+		} else {
+			for (l = 0; l < LANES; l++) {
+				while (i89_run (&iops[l], 0, I89_EXEC, 1000000) == I89_OK)
+					;
+			}
+		}
+		for (l = 0; l < LANES; l++)
+			cycles += iops[l].cycles;
+		t = now () - start;
+	} while (t < SECONDS);
+
+	return cycles / t;
+}
+
+static int
+lockstep (const char *name, uint32_t tp)
+{
+	static struct i89 interp[LANES], cached[LANES], locked[LANES];
+	struct i89 *iops[LANES];
+	struct i89_lockstep_stats stats;
+	struct i89_lockstep *ls;
+	struct i89_tc *tc;
+	double base;
+	int l;
+
+	for (l = 0; l < LANES; l++)
+		iops[l] = &locked[l];
+	ls = i89_lockstep_new (iops, LANES, 0);
+	tc = i89_tc_new ();
+	if (ls == NULL || tc == NULL)
+		return -1;
+	for (l = 0; l < LANES; l++)
+		cached[l].tc = tc;
+
+	base = sweep (interp, tp, NULL);
+	report (name, base, base);
+	report ("  translation cache", base, sweep (cached, tp, NULL));
+	report ("  lockstep", base, sweep (locked, tp, ls));
+	i89_lockstep_stats (ls, &stats);
+	printf ("%-24s %8.1f%% of the instructions\n", "  in lockstep",
+		100.0 * stats.vector / (stats.vector + stats.scalar));
+	i89_lockstep_free (ls);
+	i89_tc_free (tc);
+
+	for (l = 0; l < LANES; l++) {
+		if (i89_compare (&interp[l], &locked[l])) {
+			printf ("FAIL: %s: lane %d ended elsewhere in lockstep\n", name, l);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	memcpy (mem, prog, sizeof(prog));
+
+	if (tc ("registers", REGS))
+		return 1;
+	if (tc ("memory", MEMS))
+		return 1;
+	if (callbacks ("memory", MEMS))
+		return 1;
+	if (undo ("memory", MEMS))
+		return 1;
+	if (lockstep ("registers, 64 lanes", REGS))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An IOP alone on a bus without wait states runs as fast as with no bus
+ * model at all; wait states and a second master slow it down.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "8089.h"
+
+#define PROG		0x0100
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: bus: %s: %u, not %u\n", what, got, want);
+		failed = 1;
+	}
+}
+
+static uint8_t
+read8 (struct i89 *iop, uint32_t addr)
+{
+	return mem[addr & 0xfffff];
+}
+
+static void
+write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	mem[addr & 0xfffff] = value;
+}
+
+static void
+setup (struct i89 *iop)
+{
+	memset (iop, 0, sizeof(*iop));
+	iop->read8 = read8;
+	iop->write8 = write8;
+	iop->chan[0].regs[TP] = PROG;
+}
+
+/* Clocks the program takes, with the IOPs taking turns. */
+static unsigned
+run (struct i89 *iop, int n)
+{
+	int i, halted;
+
+	do {
+		halted = 1;
+		for (i = 0; i < n; i++) {
+			if (i89_run (&iop[i], 0, I89_EXEC, 2) != I89_HALT)
+				halted = 0;
+		}
+	} while (!halted);
+
+	return iop[0].cycles;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t prog[] = {
+		0x71, 0x30, 0x05, 0x00,		/* movi bc,5 */
+		0x71, 0x30, 0x06, 0x00,		/* movi bc,6 */
+		0x20, 0x48,			/* hlt */
+	};
+	struct i89_bus *bus;
+	struct i89 iop[2];
+	unsigned plain;
+
+	memcpy (mem + PROG, prog, sizeof(prog));
+
+	setup (&iop[0]);
+	plain = run (iop, 1);
+	expect ("plain", plain, 17);
+
+	bus = i89_bus_new (I89_ARB_8289);
+	if (bus == NULL)
+		return 1;
+	setup (&iop[0]);
+	i89_bus_attach (bus, &iop[0], "iop", 0);
+	expect ("alone", run (iop, 1), plain);
+	i89_bus_free (bus);
+
+	bus = i89_bus_new (I89_ARB_8289);
+	if (bus == NULL || i89_bus_region (bus, 0, 0, 0x100000, 1))
+		return 1;
+	setup (&iop[0]);
+	i89_bus_attach (bus, &iop[0], "iop", 0);
+	if (run (iop, 1) <= plain)
+		expect ("wait states", iop[0].cycles, plain + 1);
+	i89_bus_free (bus);
+
+	bus = i89_bus_new (I89_ARB_8289);
+	if (bus == NULL)
+		return 1;
+	setup (&iop[0]);
+	setup (&iop[1]);
+	i89_bus_attach (bus, &iop[0], "iop0", 0);
+	i89_bus_attach (bus, &iop[1], "iop1", 0);
+	if (run (iop, 2) <= plain)
+		expect ("contended", iop[0].cycles, plain + 1);
+	i89_bus_free (bus);
+
+	if (!failed)
+		printf ("PASS: bus\n");
+	return failed;
+}
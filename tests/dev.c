@@ -0,0 +1,212 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A channel program seeks and transfers a sector to and from the hard
+ * disk controller model, with a small image behind it. No port the
+ * controller claims gets to the host's callbacks.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+#define HDC		0xffd0
+#define CB		0x0400
+#define PB		0x0500
+#define READ		0x1000
+#define WRITE		0x1100
+#define DATA		0x2000
+
+/* Geometry of the image, and the sector the parameter block points to. */
+#define CYLS		4
+#define HEADS		2
+#define SPT		8
+#define SSIZE		256
+#define CYL		3
+#define HEAD		1
+#define SECTOR		5
+#define OFFSET		(((CYL * HEADS + HEAD) * SPT + SECTOR) * SSIZE)
+
+/*
+ * The parameter block:
+ *
+ *   0	TP
+ *   4	command
+ *   5	status the controller ended with
+ *   6	cylinder
+ *   8	drive and head
+ *   9	sector
+ *   a	byte count
+ *   c	buffer
+ */
+
+static const uint8_t seek[] = {
+	0x51, 0x30, 0xd0, 0xff,			/* movi gc,HDC */
+	0x02, 0x93, 0x08, 0x02, 0xce, 0x02,	/* movb [gc].2h,[pp].8h */
+	0xea, 0xba, 0x06, 0xfc,			/* jnbt [gc].6h,7,$ */
+	0x0a, 0x4e, 0x06, 0x20,			/* movbi [gc].6h,20h */
+	0x02, 0x93, 0x06, 0x02, 0xce, 0x04,	/* movb [gc].4h,[pp].6h */
+	0x02, 0x93, 0x07, 0x02, 0xce, 0x04,	/* movb [gc].4h,[pp].7h */
+	0x0a, 0x4e, 0x06, 0x10,			/* movbi [gc].6h,10h */
+	0x0a, 0xbe, 0x06, 0xfc,			/* jbt [gc].6h,0,$ */
+	0x02, 0x93, 0x09, 0x00, 0xce,		/* movb [gc],[pp].9h */
+	0x11, 0x30, 0xd0, 0xff,			/* movi ga,HDC */
+	0x23, 0x8b, 0x0c,			/* lpd gb,[pp].0ch */
+	0x63, 0x83, 0x0a,			/* mov bc,[pp].0ah */
+};
+
+static const uint8_t read_xfer[] = {
+	0xd1, 0x30, 0x28, 0x8a,			/* movi cc,8a28h */
+	0xa0, 0x00,				/* wid 8,16 */
+};
+
+static const uint8_t write_xfer[] = {
+	0xd1, 0x30, 0x28, 0x56,			/* movi cc,5628h */
+	0xc0, 0x00,				/* wid 16,8 */
+};
+
+static const uint8_t done[] = {
+	0x60, 0x00,				/* xfer */
+	0x02, 0x93, 0x04, 0x02, 0xce, 0x06,	/* movb [gc].6h,[pp].4h */
+	0x02, 0x92, 0x06, 0x02, 0xcf, 0x05,	/* movb [pp].5h,[gc].6h */
+	0x20, 0x48,				/* hlt */
+};
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static uint8_t
+in8 (struct i89 *iop, uint16_t addr)
+{
+	printf ("FAIL: dev: read from port %04x\n", addr);
+	failed = 1;
+	return 0xff;
+}
+
+static void
+out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+	printf ("FAIL: dev: write to port %04x\n", addr);
+	failed = 1;
+}
+
+static void
+program (uint32_t addr, const uint8_t *xfer)
+{
+	memcpy (mem + addr, seek, sizeof(seek));
+	addr += sizeof(seek);
+	memcpy (mem + addr, xfer, sizeof(read_xfer));
+	addr += sizeof(read_xfer);
+	memcpy (mem + addr, done, sizeof(done));
+}
+
+static int
+command (struct i89 *iop, uint16_t tp, uint8_t op)
+{
+	int ret;
+
+	mem[PB + 0] = tp;
+	mem[PB + 1] = tp >> 8;
+	mem[PB + 4] = op;
+	mem[PB + 5] = 0xff;
+
+	i89_attn (iop, 0);
+	do
+		ret = i89_run (iop, 0, I89_EXEC, 1000000);
+	while (ret == I89_OK || ret == I89_DMA || ret == I89_POLL);
+
+	/* Ready, and done with no error. */
+	if (ret != I89_HALT || mem[PB + 5] != 0x80) {
+		printf ("FAIL: dev: command %02x: %d, status %02x\n",
+			op, ret, mem[PB + 5]);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	char path[] = "/tmp/dev89-XXXXXX";
+	struct i89 iop = { 0, };
+	struct i89_disk *disk;
+	uint8_t buf[SSIZE];
+	int fd, i;
+
+	fd = mkstemp (path);
+	if (fd == -1) {
+		perror (path);
+		return 1;
+	}
+	disk = i89_disk_open (path, 0, CYLS, HEADS, SPT, SSIZE);
+	unlink (path);
+	if (disk == NULL) {
+		perror (path);
+		return 1;
+	}
+
+	program (READ, read_xfer);
+	program (WRITE, write_xfer);
+	mem[CB] = 0x03;
+	mem[CB + 2] = PB & 0xff;
+	mem[CB + 3] = PB >> 8;
+	mem[PB + 6] = CYL;
+	mem[PB + 8] = 0x10 | HEAD;	/* The second drive */
+	mem[PB + 9] = SECTOR;
+	mem[PB + 0xa] = SSIZE & 0xff;
+	mem[PB + 0xb] = SSIZE >> 8;
+	mem[PB + 0xc] = DATA & 0xff;
+	mem[PB + 0xd] = DATA >> 8;
+
+	iop.in8 = in8;
+	iop.out8 = out8;
+	iop.cb = CB;
+	i89_map (&iop, 0, sizeof(mem), mem);
+	if (i89_dev_hdc (&iop, HDC, NULL, disk))
+		return 1;
+
+	for (i = 0; i < SSIZE; i++)
+		buf[i] = i * 7 + 3;
+	if (pwrite (fd, buf, SSIZE, OFFSET) != SSIZE) {
+		perror (path);
+		return 1;
+	}
+
+	if (command (&iop, READ, 0x21) ||
+	    memcmp (mem + DATA, buf, SSIZE) != 0) {
+		printf ("FAIL: dev: read\n");
+		failed = 1;
+	}
+
+	/* Write it back changed. */
+	for (i = 0; i < SSIZE; i++)
+		mem[DATA + i] = i ^ 0x55;
+	if (command (&iop, WRITE, 0x02) ||
+	    pread (fd, buf, SSIZE, OFFSET) != SSIZE ||
+	    memcmp (mem + DATA, buf, SSIZE) != 0) {
+		printf ("FAIL: dev: write\n");
+		failed = 1;
+	}
+
+	i89_dev_free (&iop);
+	i89_disk_close (disk);
+	close (fd);
+	if (!failed)
+		printf ("PASS: dev\n");
+	return failed;
+}
@@ -0,0 +1,178 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The core built with a bus of its own, see I89_BUS in 8089.c. A program
+ * run through it, with nothing mapped, must end up just like one run
+ * from mapped memory. With -b, how fast that is, to hold against the
+ * "callbacks" line of tests/bench.
+ */
+
+#define I89_BUS
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "8089.h"
+
+static uint8_t mem[0x100000];
+
+static inline uint8_t
+bus_read8 (struct i89 *iop, uint32_t addr)
+{
+	return mem[addr & 0xfffff];
+}
+
+static inline uint16_t
+bus_read16 (struct i89 *iop, uint32_t addr)
+{
+	return mem[addr & 0xfffff] | mem[(addr + 1) & 0xfffff] << 8;
+}
+
+static inline void
+bus_write8 (struct i89 *iop, uint32_t addr, uint8_t value)
+{
+	mem[addr & 0xfffff] = value;
+}
+
+static inline void
+bus_write16 (struct i89 *iop, uint32_t addr, uint16_t value)
+{
+	mem[addr & 0xfffff] = value;
+	mem[(addr + 1) & 0xfffff] = value >> 8;
+}
+
+static inline uint8_t
+bus_in8 (struct i89 *iop, uint16_t addr)
+{
+	return 0xff;
+}
+
+static inline uint16_t
+bus_in16 (struct i89 *iop, uint16_t addr)
+{
+	return 0xffff;
+}
+
+static inline void
+bus_out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+}
+
+static inline void
+bus_out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+}
+
+static inline unsigned
+bus_in_block (struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	return 0;
+}
+
+static inline unsigned
+bus_out_block (struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	return 0;
+}
+
+static inline void
+bus_sintr (struct i89 *iop)
+{
+}
+
+static inline void
+bus_lock (struct i89 *iop, int locked)
+{
+}
+
+#include "8089.c"
+
+#define PROG		0x0000
+#define DATA		0x2000
+#define LOOPS		5000
+#define SECONDS		0.5
+
+static const uint8_t prog[] = {
+	0x21, 0x82,			/* mov gb,[gc] */
+	0x29, 0x20, 0x03,		/* addi gb,3 */
+	0x21, 0x86,			/* mov [gc],gb */
+	0x40, 0x38,			/* inc gc */
+	0x40, 0x38,			/* inc gc */
+	0x00, 0x3c,			/* dec ga */
+	0x10, 0x40, 0xef, 0xff,		/* ljnz ga,PROG */
+	0x20, 0x48,			/* hlt */
+};
+
+static uint8_t data[2 * LOOPS];
+
+static void
+run (struct i89 *iop, int mapped)
+{
+	memset (iop, 0, sizeof(*iop));
+	memset (mem + DATA, 0, sizeof(data));
+	if (mapped)
+		i89_map (iop, 0, sizeof(mem), mem);
+	iop->chan[0].regs[TP] = PROG;
+	iop->chan[0].regs[GA] = LOOPS;
+	iop->chan[0].regs[GC] = DATA;
+	while (i89_run (iop, 0, I89_EXEC, 1000000) == I89_OK)
+		;
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct i89 mapped, inlined;
+	uint64_t cycles = 0;
+	double start, t;
+
+	memcpy (mem + PROG, prog, sizeof(prog));
+
+	run (&mapped, 1);
+	memcpy (data, mem + DATA, sizeof(data));
+	run (&inlined, 0);
+
+	if (i89_compare (&mapped, &inlined) || memcmp (data, mem + DATA, sizeof(data)) ||
+	    mapped.chan[0].regs[GA] != 0 || mem[DATA] != 3) {
+		printf ("FAIL: inline: ga=%x tp=%x after %llu cycles\n",
+			inlined.chan[0].regs[GA], inlined.chan[0].regs[TP],
+			(unsigned long long)inlined.cycles);
+		return 1;
+	}
+
+	if (argc > 1 && strcmp (argv[1], "-b") == 0) {
+		start = now ();
+		do {
+			run (&inlined, 0);
+			cycles += inlined.cycles;
+			t = now () - start;
+		} while (t < SECONDS);
+		printf ("%-24s %8.1f Mcycles/s\n", "inlined bus", cycles / t / 1e6);
+		return 0;
+	}
+
+	printf ("PASS: inline\n");
+	return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Intel HEX and OMF-86 files load where they say, the base address
+ * moves them, and records that are short or expand without end are
+ * refused rather than read past or run for ever.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+#define BASE		0x2000
+
+static char path[] = "/tmp/ld89-XXXXXX";
+static int fd;
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: ld: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+/* The file is what the buffer holds. */
+static void
+file (const void *buf, size_t len)
+{
+	if (ftruncate (fd, 0) == -1 || pwrite (fd, buf, len, 0) != (ssize_t)len ||
+	    lseek (fd, 0, SEEK_SET) == -1) {
+		perror (path);
+		exit (1);
+	}
+}
+
+/* An Intel HEX record of the type, with a length byte of len. */
+static size_t
+hex (char *p, uint8_t len, uint16_t addr, uint8_t type, const uint8_t *data, unsigned n)
+{
+	uint8_t sum = len + (addr >> 8) + addr + type;
+	size_t l;
+	unsigned i;
+
+	l = sprintf (p, ":%02X%04X%02X", len, addr, type);
+	for (i = 0; i < n; i++) {
+		l += sprintf (p + l, "%02X", data[i]);
+		sum += data[i];
+	}
+	return l + sprintf (p + l, "%02X\n", (uint8_t)-sum);
+}
+
+/* An OMF-86 record of the type. */
+static size_t
+omf (uint8_t *p, uint8_t type, const uint8_t *body, unsigned n)
+{
+	uint8_t sum = 0;
+	unsigned i;
+
+	p[0] = type;
+	p[1] = n + 1;
+	p[2] = (n + 1) >> 8;
+	memcpy (p + 3, body, n);
+	for (i = 0; i < 3 + n; i++)
+		sum += p[i];
+	p[3 + n] = -sum;
+	return 4 + n;
+}
+
+static struct i89_obj *
+load (struct i89 *iop, uint32_t base)
+{
+	struct i89_mem *mem;
+	struct i89_obj *obj;
+
+	if (iop->mem)
+		i89_mem_free (iop->mem);
+	iop->mem = NULL;
+	mem = i89_mem_new (0xff);
+	if (mem == NULL)
+		exit (1);
+	obj = i89_load (mem, fd, base);
+	i89_mem_attach (iop, mem);
+	return obj;
+}
+
+static unsigned
+peek (struct i89 *iop, uint32_t addr)
+{
+	const uint8_t *page = iop->map[addr >> I89_PAGE_SHIFT];
+
+	return page ? page[addr & (I89_PAGE_SIZE - 1)] : 0xff;
+}
+
+static void
+test_hex (struct i89 *iop)
+{
+	static const uint8_t data[] = { 0x11, 0x22, 0x33, 0x44 };
+	static const uint8_t seg[] = { 0x10, 0x00 };
+	static const uint8_t start[] = { 0x01, 0x00, 0x00, 0x20 };
+	struct i89_obj *obj;
+	char buf[256];
+	size_t l;
+
+	l = hex (buf, 4, 0x0010, 0x00, data, 4);
+	l += hex (buf + l, 2, 0x0000, 0x02, seg, 2);
+	l += hex (buf + l, 4, 0x0020, 0x00, data, 4);
+	l += hex (buf + l, 4, 0x0000, 0x03, start, 4);
+	l += hex (buf + l, 0, 0x0000, 0x01, NULL, 0);
+	file (buf, l);
+
+	obj = load (iop, 0);
+	if (obj == NULL) {
+		expect ("hex", 0, 1);
+		return;
+	}
+	expect ("hex data", peek (iop, 0x0010), 0x11);
+	expect ("hex data", peek (iop, 0x0013), 0x44);
+	expect ("hex segment", peek (iop, 0x10020), 0x11);
+	expect ("hex entry", i89_obj_entry (obj), 0x1020);
+	i89_obj_free (obj);
+
+	lseek (fd, 0, SEEK_SET);
+	obj = load (iop, BASE);
+	if (obj == NULL) {
+		expect ("hex based", 0, 1);
+		return;
+	}
+	expect ("hex based", peek (iop, BASE + 0x0010), 0x11);
+	expect ("hex based", peek (iop, BASE + 0x10020), 0x11);
+	expect ("hex based entry", i89_obj_entry (obj), BASE + 0x1020);
+	i89_obj_free (obj);
+
+	/* The address and start records are read, so must be whole. */
+	l = hex (buf, 1, 0x0000, 0x02, seg, 1);
+	file (buf, l);
+	expect ("short segment", load (iop, 0) == NULL, 1);
+	l = hex (buf, 2, 0x0000, 0x05, start, 2);
+	file (buf, l);
+	expect ("short start", load (iop, 0) == NULL, 1);
+}
+
+static void
+test_omf (struct i89 *iop)
+{
+	static const uint8_t theadr[] = { 4, 'T', 'E', 'S', 'T' };
+	static const uint8_t pedata[] = {
+		0x00, 0x03, 0x04,		/* At 300:4 */
+		0xaa, 0xbb,
+	};
+	static const uint8_t pidata[] = {
+		0x00, 0x04, 0x00,		/* At 400:0 */
+		0x03, 0x00, 0x00, 0x00,		/* Three times */
+		0x02, 0xcc, 0xdd,
+	};
+	static const uint8_t modend[] = {
+		0xc0, 0x00, 0x03, 0x10, 0x00,	/* Start at 300:10 */
+	};
+	struct i89_obj *obj;
+	uint8_t buf[256], body[128];
+	size_t l;
+	int i, n;
+
+	l = omf (buf, 0x80, theadr, sizeof(theadr));
+	l += omf (buf + l, 0x84, pedata, sizeof(pedata));
+	l += omf (buf + l, 0x86, pidata, sizeof(pidata));
+	l += omf (buf + l, 0x8a, modend, sizeof(modend));
+	file (buf, l);
+
+	obj = load (iop, 0);
+	if (obj == NULL) {
+		expect ("omf", 0, 1);
+		return;
+	}
+	expect ("omf data", peek (iop, 0x3004), 0xaa);
+	expect ("omf data", peek (iop, 0x3005), 0xbb);
+	expect ("omf iterated", peek (iop, 0x4000), 0xcc);
+	expect ("omf iterated", peek (iop, 0x4005), 0xdd);
+	expect ("omf iterated end", peek (iop, 0x4006), 0xff);
+	expect ("omf entry", i89_obj_entry (obj), 0x3010);
+	i89_obj_free (obj);
+
+	/* Blocks nested too deep. */
+	memcpy (body, pidata, 3);
+	for (n = 3, i = 0; i < 20; i++, n += 4)
+		memcpy (body + n, "\x01\x00\x01\x00", 4);
+	memcpy (body + n, "\x01\x00\x00\x00\x01\x99", 6);
+	n += 6;
+	l = omf (buf, 0x80, theadr, sizeof(theadr));
+	l += omf (buf + l, 0x86, body, n);
+	file (buf, l);
+	expect ("nested", load (iop, 0) == NULL, 1);
+
+	/* More than there is memory for. */
+	memcpy (body + 3, "\xff\xff\x01\x00" "\xff\xff\x00\x00\x01\x99", 10);
+	l = omf (buf, 0x80, theadr, sizeof(theadr));
+	l += omf (buf + l, 0x86, body, 13);
+	file (buf, l);
+	expect ("too large", load (iop, 0) == NULL, 1);
+
+	/* Nothing, many times over, is soon done. */
+	for (n = 3, i = 0; i < 8; i++, n += 4)
+		memcpy (body + n, "\xff\xff\x01\x00", 4);
+	memcpy (body + n, "\xff\xff\x00\x00\x00", 5);
+	n += 5;
+	l = omf (buf, 0x80, theadr, sizeof(theadr));
+	l += omf (buf + l, 0x86, body, n);
+	file (buf, l);
+	obj = load (iop, 0);
+	expect ("empty", obj != NULL, 1);
+	i89_obj_free (obj);
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct i89 iop = { 0, };
+
+	fd = mkstemp (path);
+	if (fd == -1) {
+		perror (path);
+		return 1;
+	}
+	unlink (path);
+
+	test_hex (&iop);
+	test_omf (&iop);
+
+	i89_mem_free (iop.mem);
+	close (fd);
+	if (!failed)
+		printf ("PASS: ld\n");
+	return failed;
+}
@@ -0,0 +1,128 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * IOPs that have memory over an image attached see what is written to
+ * it, be it from the host or by another of them, and not the image; and
+ * code translated from the image and shared is not run in place of what
+ * was written over it.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "8089.h"
+
+#define LOAD		0x0100
+#define STORE		0x0110
+#define HOST		0x1000
+#define CODE		0x0200
+#define OTHER		0x3000
+
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: mem: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+/* Run the program at tp with gb and gc given; gb after. */
+static unsigned
+run (struct i89 *iop, uint32_t tp, uint16_t gb, uint16_t gc)
+{
+	iop->chan[0].regs[TP] = tp;
+	iop->chan[0].regs[GB] = gb;
+	iop->chan[0].regs[GC] = gc;
+	iop->chan[0].halt = 0;
+	if (i89_run (iop, 0, I89_EXEC, 1000) != I89_HALT)
+		expect ("halt", 0, 1);
+	return iop->chan[0].regs[GB];
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t load[] = {
+		0x21, 0x82,			/* mov gb,[gc] */
+		0x20, 0x48,			/* hlt */
+	};
+	static const uint8_t store[] = {
+		0x21, 0x86,			/* mov [gc],gb */
+		0x20, 0x48,			/* hlt */
+	};
+	static const uint8_t code[] = {
+		0x20, 0x48,			/* hlt */
+		0x20, 0x48,			/* hlt */
+	};
+	static const uint8_t host[] = { 0x22, 0x22 };
+	struct i89 a = { 0, }, b = { 0, }, c = { 0, };
+	struct i89_image *image;
+	struct i89_mem *mem, *over, *over2;
+
+	mem = i89_mem_new (0xff);
+	if (mem == NULL ||
+	    i89_mem_write (mem, LOAD, load, sizeof(load)) ||
+	    i89_mem_write (mem, STORE, store, sizeof(store)) ||
+	    i89_mem_write (mem, CODE, code, sizeof(code)) ||
+	    i89_mem_write (mem, HOST, "\x11\x11", 2) ||
+	    i89_mem_write (mem, OTHER, "\x33\x33", 2))
+		return 1;
+	image = i89_image_new (mem);
+	over = i89_mem_new (0xff);
+	if (image == NULL || over == NULL)
+		return 1;
+	if (i89_image_attach (&a, over, image))
+		return 1;
+	i89_image_put (image);
+	i89_mem_attach (&b, over);
+
+	/* Both have the image pages mapped now. */
+	expect ("image", run (&a, LOAD, 0, HOST), 0x1111);
+	expect ("image", run (&b, LOAD, 0, OTHER), 0x3333);
+
+	if (i89_mem_write (over, HOST, host, sizeof(host)))
+		return 1;
+	expect ("host write", run (&a, LOAD, 0, HOST), 0x2222);
+
+	run (&a, STORE, 0x4444, OTHER);
+	expect ("other's write", run (&b, LOAD, 0, OTHER), 0x4444);
+	expect ("lost", i89_mem_lost (over), 0);
+
+	/* Translated by one, run by another. */
+	run (&a, CODE, 0, 0);
+	if (i89_image_share (image, &a))
+		return 1;
+	over2 = i89_mem_overlay (over);
+	if (over2 == NULL)
+		return 1;
+	i89_mem_attach (&c, over2);
+	c.chan[0].regs[GA] = 5;
+	run (&c, CODE, 0, 0);
+	expect ("shared code", c.chan[0].regs[GA], 5);
+
+	run (&c, STORE, 0x3c00, CODE);		/* dec ga */
+	run (&c, CODE, 0, 0);
+	expect ("code written over", c.chan[0].regs[GA], 4);
+	run (&a, CODE, 0, 0);
+	expect ("code of the others", a.chan[0].regs[GA], 0);
+
+	i89_mem_free (over2);
+	i89_mem_free (over);
+	if (!failed)
+		printf ("PASS: mem\n");
+	return failed;
+}
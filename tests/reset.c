@@ -0,0 +1,104 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An IOP reset to a template keeps what is attached to it: it goes on
+ * with its own memory, mapped as that memory has it, and doesn't pick up
+ * the template's translation cache.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "8089.h"
+
+#define LOAD		0x0100
+#define DATA		0x2000
+
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: reset: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+static unsigned
+load (struct i89 *iop)
+{
+	iop->chan[0].regs[TP] = LOAD;
+	iop->chan[0].regs[GC] = DATA;
+	iop->chan[0].halt = 0;
+	if (i89_run (iop, 0, I89_EXEC, 1000) != I89_HALT)
+		expect ("halt", 0, 1);
+	return iop->chan[0].regs[GB];
+}
+
+static struct i89_mem *
+mem (const char *data)
+{
+	static const uint8_t prog[] = {
+		0x21, 0x82,			/* mov gb,[gc] */
+		0x20, 0x48,			/* hlt */
+	};
+	struct i89_mem *m;
+
+	m = i89_mem_new (0xff);
+	if (m == NULL || i89_mem_write (m, LOAD, prog, sizeof(prog)) ||
+	    i89_mem_write (m, DATA, data, 2))
+		return NULL;
+	return m;
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct i89 tmpl = { 0, }, iop = { 0, };
+	struct i89_mem *m1, *m2;
+
+	m1 = mem ("\x11\x11");
+	m2 = mem ("\x22\x22");
+	if (m1 == NULL || m2 == NULL)
+		return 1;
+
+	i89_mem_attach (&tmpl, m1);
+	tmpl.tc = i89_tc_new ();
+	if (tmpl.tc == NULL)
+		return 1;
+	expect ("template", load (&tmpl), 0x1111);
+
+	i89_mem_attach (&iop, m2);
+	if (i89_lat_attach (&iop) == NULL)
+		return 1;
+
+	i89_reset (&iop, &tmpl);
+	expect ("own memory", load (&iop), 0x2222);
+	expect ("own cache", iop.tc == NULL, 1);
+	expect ("latencies", iop.lat != NULL, 1);
+	expect ("template", load (&tmpl), 0x1111);
+
+	i89_lat_detach (&iop);
+	i89_reset (&iop, &tmpl);
+	expect ("detached", iop.lat == NULL, 1);
+	expect ("own memory", load (&iop), 0x2222);
+
+	i89_tc_free (tmpl.tc);
+	i89_mem_free (m1);
+	i89_mem_free (m2);
+	if (!failed)
+		printf ("PASS: reset\n");
+	return failed;
+}
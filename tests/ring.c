@@ -0,0 +1,106 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Blocks submitted to an idle channel run without a channel attention,
+ * and each one submitted gets a completion, also if it's halted.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "8089.h"
+
+#define CB		0x0400
+#define DONE		0x0100
+#define SPIN		0x0200
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: ring: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+/* A parameter block with the program at tp. */
+static void
+pb (uint32_t addr, uint16_t tp)
+{
+	mem[addr + 0] = tp;
+	mem[addr + 1] = tp >> 8;
+	mem[addr + 2] = 0;
+	mem[addr + 3] = 0;
+	mem[addr + 5] = 0xff;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t done[] = {
+		0x0a, 0x4f, 0x05, 0x42,		/* movbi [pp].5,42h */
+		0x20, 0x48,			/* hlt */
+	};
+	static const uint8_t spin[] = {
+		0x0a, 0x4f, 0x05, 0x17,		/* movbi [pp].5,17h */
+		0x88, 0x20, 0xfd,		/* jmp $ */
+	};
+	struct i89_ring ring = { 0, };
+	struct i89 iop = { 0, };
+	uint8_t status;
+	uint32_t addr;
+	int ret;
+
+	memcpy (mem + DONE, done, sizeof(done));
+	memcpy (mem + SPIN, spin, sizeof(spin));
+	pb (0x500, DONE);
+	pb (0x510, DONE);
+	pb (0x520, SPIN);
+
+	i89_map (&iop, 0, sizeof(mem), mem);
+	iop.cb = CB;
+	ring.status = 5;
+	iop.chan[0].ring = &ring;
+
+	/* Nothing is running: the blocks go without an attention. */
+	expect ("submit", i89_submit (&iop, 0, 0x500), 0);
+	expect ("submit", i89_submit (&iop, 0, 0x510), 0);
+	ret = i89_run (&iop, 0, I89_EXEC, 10000);
+	expect ("run", ret, I89_HALT);
+	expect ("reap", i89_reap (&iop, 0, &addr, &status), 1);
+	expect ("first", addr, 0x500);
+	expect ("first status", status, 0x42);
+	expect ("reap", i89_reap (&iop, 0, &addr, &status), 1);
+	expect ("second", addr, 0x510);
+	expect ("second status", status, 0x42);
+	expect ("reap", i89_reap (&iop, 0, &addr, &status), 0);
+
+	/* A halt command completes the block in hand. */
+	expect ("submit", i89_submit (&iop, 0, 0x520), 0);
+	i89_run (&iop, 0, I89_EXEC, 1000);
+	mem[CB] = 0x07;
+	i89_attn (&iop, 0);
+	expect ("halted", i89_run (&iop, 0, I89_EXEC, 1000), I89_HALT);
+	expect ("reap", i89_reap (&iop, 0, &addr, &status), 1);
+	expect ("halted block", addr, 0x520);
+	expect ("halted status", status, 0x17);
+
+	if (!failed)
+		printf ("PASS: ring\n");
+	return failed;
+}
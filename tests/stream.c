@@ -0,0 +1,183 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Transfers between a port and memory end up the same whether the port
+ * streams blocks or is read and written a unit at a time, also when the
+ * port hands over an odd number of bytes in a transfer a word wide, and
+ * when the transfer is run a few cycles at a time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "8089.h"
+
+#define PORT		0x0080
+#define BUF		0x1ffa		/* Runs into the next page */
+#define LEN		41
+#define CHUNK		5		/* Odd, to leave words halfway */
+
+static uint8_t mem[0x100000];
+static uint8_t dev[LEN + 1];
+static unsigned pos, blocks;
+static int failed;
+
+static uint8_t
+in8 (struct i89 *iop, uint16_t addr)
+{
+	return dev[pos++];
+}
+
+static uint16_t
+in16 (struct i89 *iop, uint16_t addr)
+{
+	pos += 2;
+	return dev[pos - 2] | dev[pos - 1] << 8;
+}
+
+static void
+out8 (struct i89 *iop, uint16_t addr, uint8_t value)
+{
+	dev[pos++] = value;
+}
+
+static void
+out16 (struct i89 *iop, uint16_t addr, uint16_t value)
+{
+	dev[pos++] = value;
+	dev[pos++] = value >> 8;
+}
+
+/*
+ * Only the whole transfer cycles are taken: the odd byte comes again. A
+ * transfer a word wide asks for whole words, except for a last odd byte.
+ */
+static unsigned
+taken (struct i89 *iop, unsigned len, unsigned n)
+{
+	return iop->chan[0].wid && len % 2 == 0 ? n & ~1 : n;
+}
+
+static unsigned
+in_block (struct i89 *iop, uint16_t addr, uint8_t *buf, unsigned len)
+{
+	unsigned n = len < CHUNK ? len : CHUNK;
+
+	memcpy (buf, dev + pos, n);
+	pos += taken (iop, len, n);
+	blocks++;
+	return n;
+}
+
+static unsigned
+out_block (struct i89 *iop, uint16_t addr, const uint8_t *buf, unsigned len)
+{
+	unsigned n = len < CHUNK ? len : CHUNK;
+
+	memcpy (dev + pos, buf, n);
+	pos += taken (iop, len, n);
+	blocks++;
+	return n;
+}
+
+/* Move LEN bytes between the port and BUF, burst cycles at a time. */
+static void
+xfer (struct i89 *iop, int streams, int to_mem, int wid, unsigned burst)
+{
+	int i;
+
+	memset (iop, 0, sizeof(*iop));
+	memset (mem + BUF, 0, LEN + 1);
+	for (i = 0; i < LEN + 1; i++) {
+		if (to_mem)
+			dev[i] = 0x40 + i;
+		else
+			mem[BUF + i] = 0x80 + i;
+	}
+	if (!to_mem)
+		memset (dev, 0, sizeof(dev));
+	pos = 0;
+
+	i89_map (iop, 0, sizeof(mem), mem);
+	iop->in8 = in8;
+	iop->in16 = in16;
+	iop->out8 = out8;
+	iop->out16 = out16;
+	if (streams) {
+		iop->in_block = in_block;
+		iop->out_block = out_block;
+	}
+
+	/* Source ga, destination gb; terminate on byte count. */
+	iop->chan[0].regs[GA] = to_mem ? PORT : BUF;
+	iop->chan[0].regs[GB] = to_mem ? BUF : PORT;
+	iop->chan[0].tags = 1 << (to_mem ? GA : GB);
+	iop->chan[0].regs[BC] = LEN;
+	iop->chan[0].regs[CC] = (to_mem ? 0x8000 : 0x4000) | 0x0008;
+	iop->chan[0].wid = wid;
+	iop->chan[0].dma = 1;
+
+	while (i89_xfer (iop, 0, burst) == I89_DMA)
+		;
+}
+
+static void
+check (int to_mem, int wid, unsigned burst)
+{
+	static uint8_t want[LEN + 1];
+	struct i89 unit, stream;
+	unsigned want_pos;
+
+	xfer (&unit, 0, to_mem, wid, burst);
+	memcpy (want, to_mem ? mem + BUF : dev, sizeof(want));
+	want_pos = pos;
+	blocks = 0;
+	xfer (&stream, 1, to_mem, wid, burst);
+	if (blocks == 0) {
+		printf ("FAIL: stream: %s, wid %d, burst %u: not streamed\n",
+			to_mem ? "in" : "out", wid, burst);
+		failed = 1;
+	}
+
+	if (i89_compare (&unit, &stream) || stream.chan[0].regs[BC] != unit.chan[0].regs[BC] ||
+	    memcmp (want, to_mem ? mem + BUF : dev, sizeof(want)) || pos != want_pos) {
+		printf ("FAIL: stream: %s, wid %d, burst %u: "
+			"gb=%x bc=%x after %llu cycles, not gb=%x bc=%x after %llu\n",
+			to_mem ? "in" : "out", wid, burst,
+			stream.chan[0].regs[GB], stream.chan[0].regs[BC],
+			(unsigned long long)stream.cycles,
+			unit.chan[0].regs[GB], unit.chan[0].regs[BC],
+			(unsigned long long)unit.cycles);
+		failed = 1;
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const unsigned bursts[] = { 0, 1, 3 };
+	int to_mem, wid, i;
+
+	for (to_mem = 0; to_mem < 2; to_mem++) {
+		for (wid = 0; wid < 4; wid++) {
+			for (i = 0; i < 3; i++)
+				check (to_mem, wid, bursts[i]);
+		}
+	}
+
+	if (!failed)
+		printf ("PASS: stream\n");
+	return failed;
+}
@@ -0,0 +1,131 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The translation cache must run programs just like the interpreter
+ * does, also where they run into the next page, and so must verified
+ * code.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "8089.h"
+
+static uint8_t mem[0x100000];
+static uint8_t orig[0x100000];
+static uint8_t *page;
+static int failed;
+
+static void
+run (struct i89 *iop, uint32_t tp, int tc, int verify)
+{
+	enum i89_flags flags = I89_EXEC;
+	int ret;
+
+	memset (iop, 0, sizeof(*iop));
+	i89_map (iop, 0, sizeof(mem), mem);
+	/* A page of its own, for the sanitizers to see reads past it. */
+	i89_map (iop, 0x1000, I89_PAGE_SIZE, page);
+	if (tc)
+		iop->tc = i89_tc_new ();
+	iop->chan[0].regs[TP] = tp;
+	if (verify) {
+		i89_verify (iop, tp);
+		flags |= I89_CHECK;
+	}
+
+	do {
+		ret = i89_run (iop, 0, flags, 1000);
+	} while (ret == I89_OK && iop->cycles < 1000);
+
+	if (iop->tc)
+		i89_tc_free (iop->tc);
+	iop->tc = NULL;
+	i89_verify_free (iop);
+}
+
+static void
+check (const char *name, uint32_t tp, uint32_t ga, uint32_t end, uint64_t cycles)
+{
+	struct i89 interp, tc, vf;
+
+	/* All start from the same memory, the program may write it. */
+	memcpy (orig, mem, sizeof(mem));
+	run (&interp, tp, 0, 0);
+	memcpy (mem, orig, sizeof(mem));
+	run (&tc, tp, 1, 0);
+	memcpy (mem, orig, sizeof(mem));
+	run (&vf, tp, 1, 1);
+
+	if (interp.chan[0].regs[GA] != ga || interp.chan[0].regs[TP] != end ||
+	    interp.cycles != cycles) {
+		printf ("FAIL: %s: interpreter ended with ga=%x tp=%x after %llu cycles\n",
+			name, interp.chan[0].regs[GA], interp.chan[0].regs[TP],
+			(unsigned long long)interp.cycles);
+		failed = 1;
+	}
+	if (i89_compare (&interp, &tc) || interp.cycles != tc.cycles) {
+		printf ("FAIL: %s: translated ga=%x tp=%x after %llu cycles\n",
+			name, tc.chan[0].regs[GA], tc.chan[0].regs[TP],
+			(unsigned long long)tc.cycles);
+		failed = 1;
+	}
+	if (i89_compare (&interp, &vf) || interp.cycles != vf.cycles) {
+		printf ("FAIL: %s: verified ga=%x tp=%x after %llu cycles\n",
+			name, vf.chan[0].regs[GA], vf.chan[0].regs[TP],
+			(unsigned long long)vf.cycles);
+		failed = 1;
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t nops[] = { 0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t hlt[] = { 0x20, 0x48 };
+	static const uint8_t inc_ga[] = { 0x00, 0x38 };
+	static const uint8_t smc[] = {
+		0x13, 0x4c, 0x35, 0x20, 0x48,	/* mov [ga].35h,4820h */
+		0xea, 0xbc, 0x00, 0x10,		/* jbt [ga],7,$+10h */
+	};
+
+	page = calloc (1, I89_PAGE_SIZE);
+	if (page == NULL)
+		return 1;
+
+	/* A block that runs up to the end of a page goes on in the next
+	 * one, not at the start of its own. */
+	memcpy (mem + 0x0000, inc_ga, sizeof(inc_ga));
+	memcpy (mem + 0x0002, hlt, sizeof(hlt));
+	memcpy (mem + 0x0ffc, nops, sizeof(nops));
+	memcpy (page, hlt, sizeof(hlt));
+	check ("page boundary", 0x0ffc, 0, 0x1002, 19);
+
+	/* A two byte instruction that ends the page. */
+	memcpy (page + I89_PAGE_SIZE - 2, inc_ga, sizeof(inc_ga));
+	memcpy (mem + 0x2000, hlt, sizeof(hlt));
+	check ("last in page", 0x1ffe, 1, 0x2002, 13);
+
+	/* A store that overwrites the next instruction, a hlt over the
+	 * jbt, with the two fused. */
+	memcpy (mem + 0x0030, smc, sizeof(smc));
+	check ("self-modifying", 0x0030, 0, 0x0037, 23);
+
+	free (page);
+	if (!failed)
+		printf ("PASS: tc\n");
+	return failed;
+}
@@ -0,0 +1,149 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A threaded IOP picks up blocks submitted to a halted channel, and
+ * doesn't keep running a channel that stopped at a watchpoint.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "8089.h"
+
+#define DONE		0x0100
+#define SPIN		0x0200
+#define WATCHED		0x2000
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: thr: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+static void
+pb (uint32_t addr, uint16_t tp)
+{
+	mem[addr + 0] = tp;
+	mem[addr + 1] = tp >> 8;
+	mem[addr + 2] = 0;
+	mem[addr + 3] = 0;
+	mem[addr + 5] = 0xff;
+}
+
+static double
+now (clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime (clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+nap (long ms)
+{
+	struct timespec ts = { 0, ms * 1000000 };
+
+	nanosleep (&ts, NULL);
+}
+
+/* Wait up to a second for a completion. */
+static int
+reap (struct i89 *iop, int ch, uint32_t *addr, uint8_t *status)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (i89_reap (iop, ch, addr, status))
+			return 1;
+		nap (1);
+	}
+	return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t done[] = {
+		0x0a, 0x4f, 0x05, 0x42,		/* movbi [pp].5,42h */
+		0x20, 0x48,			/* hlt */
+	};
+	static const uint8_t spin[] = {
+		0x0a, 0x4f, 0x05, 0x17,		/* movbi [pp].5,17h */
+		0x88, 0x20, 0xfd,		/* jmp $ */
+	};
+	struct i89_ring ring0 = { 0, }, ring1 = { 0, };
+	struct i89 iop = { 0, };
+	struct i89_thread *t;
+	double cpu;
+	uint8_t status;
+	uint32_t addr;
+
+	memcpy (mem + DONE, done, sizeof(done));
+	memcpy (mem + SPIN, spin, sizeof(spin));
+	pb (0x500, DONE);
+	pb (0x510, DONE);
+	pb (WATCHED, SPIN);
+
+	i89_map (&iop, 0, sizeof(mem), mem);
+	ring0.status = 5;
+	ring1.status = 5;
+	iop.chan[0].ring = &ring0;
+	iop.chan[1].ring = &ring1;
+	if (i89_watch (&iop, I89_WATCH_WRITE, WATCHED + 5, 1))
+		return 1;
+
+	t = i89_thread_start (&iop, I89_EXEC);
+	if (t == NULL)
+		return 1;
+
+	expect ("submit", i89_thread_submit (t, 0, 0x500), 0);
+	expect ("reap", reap (&iop, 0, &addr, &status), 1);
+	expect ("first", addr, 0x500);
+	expect ("first status", status, 0x42);
+
+	/* The channel is halted now; the next block still runs. */
+	expect ("submit", i89_thread_submit (t, 0, 0x510), 0);
+	expect ("reap", reap (&iop, 0, &addr, &status), 1);
+	expect ("second", addr, 0x510);
+	expect ("second status", status, 0x42);
+
+	/* Stopped at the watchpoint, the spinning program is not run
+	 * any further. */
+	expect ("submit", i89_thread_submit (t, 1, WATCHED), 0);
+	nap (50);
+	cpu = now (CLOCK_PROCESS_CPUTIME_ID);
+	nap (200);
+	cpu = now (CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	if (cpu > 0.05) {
+		printf ("FAIL: thr: %.0f ms of CPU time stopped at a watchpoint\n", cpu * 1e3);
+		failed = 1;
+	}
+
+	i89_thread_stop (t);
+	i89_watch_free (&iop);
+	expect ("watched", mem[WATCHED + 5], 0x17);
+
+	if (!failed)
+		printf ("PASS: thr\n");
+	return failed;
+}
@@ -0,0 +1,153 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stepping back goes through channel attentions and polling loops the
+ * channel parked in, and ends up exactly where the channel was on the
+ * way forward.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "8089.h"
+
+#define CB		0x0400
+#define PB		0x0500
+#define SPIN		0x0200
+#define STEPS		30
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static void
+expect (const char *what, unsigned got, unsigned want)
+{
+	if (got != want) {
+		printf ("FAIL: undo: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+struct state {
+	uint32_t regs[NUM_REGS];
+	uint64_t cycles;
+	uint64_t park_until;
+	uint32_t poll_clk;
+	unsigned tags;
+	unsigned park, halt, nointr, ccb, susp;
+	uint8_t busy;
+};
+
+static void
+save (struct i89 *iop, struct state *s)
+{
+	memcpy (s->regs, iop->chan[0].regs, sizeof(s->regs));
+	s->cycles = iop->cycles;
+	s->park_until = iop->chan[0].park_until;
+	s->poll_clk = iop->chan[0].poll_clk;
+	s->tags = iop->chan[0].tags;
+	s->park = iop->chan[0].park;
+	s->halt = iop->chan[0].halt;
+	s->nointr = iop->chan[0].nointr;
+	s->ccb = iop->chan[0].ccb;
+	s->susp = iop->chan[0].susp.valid;
+	s->busy = mem[CB + 1];
+}
+
+static void
+same (const char *what, struct i89 *iop, const struct state *want)
+{
+	struct state got;
+
+	save (iop, &got);
+	expect (what, memcmp (got.regs, want->regs, sizeof(got.regs)), 0);
+	expect (what, got.cycles, want->cycles);
+	expect (what, got.park_until, want->park_until);
+	expect (what, got.poll_clk, want->poll_clk);
+	expect (what, got.tags, want->tags);
+	expect (what, got.park, want->park);
+	expect (what, got.halt, want->halt);
+	expect (what, got.nointr, want->nointr);
+	expect (what, got.ccb, want->ccb);
+	expect (what, got.susp, want->susp);
+	expect (what, got.busy, want->busy);
+}
+
+static void
+attn (struct i89 *iop, uint8_t ccw)
+{
+	mem[CB] = ccw;
+	i89_attn (iop, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t spin[] = {
+		0x0a, 0x4f, 0x05, 0x17,		/* movbi [pp].5,17h */
+		0x88, 0x20, 0xfd,		/* jmp $ */
+	};
+	struct state trail[STEPS], start, suspend;
+	struct i89 iop = { 0, };
+	int i, n;
+
+	memcpy (mem + SPIN, spin, sizeof(spin));
+	mem[CB + 2] = PB & 0xff;
+	mem[CB + 3] = PB >> 8;
+	mem[PB + 0] = SPIN & 0xff;
+	mem[PB + 1] = SPIN >> 8;
+
+	i89_map (&iop, 0, sizeof(mem), mem);
+	iop.cb = CB;
+	iop.poll_limit = 40;
+	iop.chan[0].halt = 1;
+
+	/* Three steps are kept as four. */
+	if (i89_undo_enable (&iop, 3, 16))
+		return 1;
+	save (&iop, &start);
+	attn (&iop, 0x03 | 0x18);	/* Start in system space, no interrupts */
+	for (i = 0; i < 3; i++)
+		i89_step (&iop, 0, I89_EXEC);
+	for (n = 0; i89_step_back (&iop) == 0; n++)
+		;
+	expect ("steps kept", n, 4);
+	same ("before start", &iop, &start);
+
+	/* Several times parked and let go, then suspended. */
+	if (i89_undo_enable (&iop, 64, 64))
+		return 1;
+	attn (&iop, 0x03 | 0x18);
+	for (i = 0; i < STEPS; i++) {
+		save (&iop, &trail[i]);
+		i89_step (&iop, 0, I89_EXEC);
+	}
+	save (&iop, &suspend);
+	attn (&iop, 0x06);
+	expect ("suspended", iop.chan[0].susp.valid, 1);
+	expect ("suspended", iop.chan[0].halt, 1);
+
+	expect ("back", i89_step_back (&iop), 0);
+	same ("before suspend", &iop, &suspend);
+	for (i = STEPS - 1; i >= 0; i--) {
+		expect ("back", i89_step_back (&iop), 0);
+		same ("on the way back", &iop, &trail[i]);
+	}
+
+	i89_undo_disable (&iop);
+	if (!failed)
+		printf ("PASS: undo\n");
+	return failed;
+}
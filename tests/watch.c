@@ -0,0 +1,66 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Watched pages are off the fast path, but writes to them must still
+ * end up in the mapped memory.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "8089.h"
+
+static uint8_t mem[0x100000];
+static int failed;
+
+static void
+expect (const char *what, int got, int want)
+{
+	if (got != want) {
+		printf ("FAIL: %s: %x, not %x\n", what, got, want);
+		failed = 1;
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	static const uint8_t prog[] = {
+		0x13, 0x4c, 0x10, 0x34, 0x12,	/* mov [ga].10h,1234h */
+		0x13, 0x4c, 0x40, 0x78, 0x56,	/* mov [ga].40h,5678h */
+		0x20, 0x48,			/* hlt */
+	};
+	struct i89 iop = { 0, };
+
+	memcpy (mem + 0x100, prog, sizeof(prog));
+	i89_map (&iop, 0, sizeof(mem), mem);
+	iop.chan[0].regs[TP] = 0x100;
+	iop.chan[0].regs[GA] = 0x2000;
+
+	if (i89_watch (&iop, I89_WATCH_WRITE, 0x2011, 1))
+		return 1;
+
+	expect ("watched write", i89_run (&iop, 0, I89_EXEC, 1000), I89_WATCH);
+	expect ("hit", iop.hit.addr, 0x2011);
+	expect ("watched word", mem[0x2010] | mem[0x2011] << 8, 0x1234);
+
+	expect ("halt", i89_run (&iop, 0, I89_EXEC, 1000), I89_HALT);
+	expect ("unwatched word", mem[0x2040] | mem[0x2041] << 8, 0x5678);
+
+	i89_watch_free (&iop);
+	if (!failed)
+		printf ("PASS: watch\n");
+	return failed;
+}
@@ -0,0 +1,353 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Threaded mode. The IOP runs on a worker thread of its own. The host
+ * posts channel attentions, ring submissions and changes of the DRQ
+ * and port lines to it and gets SINTRs back through a pair of single
+ * producer, single consumer queues that need no locking; an eventfd
+ * wakes up whoever waits on the other end.
+ *
+ * A channel that waits for a DRQ or is parked in a polling loop is not
+ * run until the host posts something for it, so that a waiting IOP
+ * doesn't keep a host CPU busy. With poll_limit set, that means the
+ * device polled for must be one the host updates with
+ * i89_thread_port(), not one that runs on the IOP clock. A channel
+ * that stopped at a breakpoint or watchpoint stays stopped until the
+ * next attention.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "8089.h"
+
+/* Cycles to run a channel for before looking at the other one. */
+#define SLICE	1024
+
+#define Q_SIZE	64
+
+enum msg {
+	MSG_ATTN,
+	MSG_SUBMIT,
+	MSG_DRQ,
+	MSG_PORT,
+};
+
+struct q {
+	unsigned head, tail;
+	struct {
+		uint8_t msg;
+		uint8_t ch;
+		uint32_t arg;
+	} m[Q_SIZE];
+};
+
+struct i89_thread {
+	struct i89 *iop;
+	enum i89_flags flags;
+	pthread_t thread;
+	void (*sintr)(struct i89 *iop);
+
+	struct q attn;
+	struct q sintr_q;
+	int attn_fd;
+	int sintr_fd;
+
+	int sleeping;
+	int stop;
+
+	/* SINTRs the host didn't keep up with. */
+	uint64_t lost;
+
+	/* Parameter blocks the host submitted, for telling a full ring. */
+	unsigned submitted[2];
+
+	int run[2];
+	int cur;
+};
+
+static __thread struct i89_thread *self;
+
+static int
+push (struct q *q, int msg, int ch, uint32_t arg)
+{
+	unsigned tail = __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+
+	if (tail - __atomic_load_n (&q->head, __ATOMIC_ACQUIRE) == Q_SIZE)
+		return -1;
+
+	q->m[tail % Q_SIZE].msg = msg;
+	q->m[tail % Q_SIZE].ch = ch;
+	q->m[tail % Q_SIZE].arg = arg;
+	__atomic_store_n (&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int
+pop (struct q *q, int *ch, uint32_t *arg)
+{
+	unsigned head = __atomic_load_n (&q->head, __ATOMIC_RELAXED);
+	int msg;
+
+	if (head == __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE))
+		return -1;
+
+	msg = q->m[head % Q_SIZE].msg;
+	*ch = q->m[head % Q_SIZE].ch;
+	*arg = q->m[head % Q_SIZE].arg;
+	__atomic_store_n (&q->head, head + 1, __ATOMIC_RELEASE);
+	return msg;
+}
+
+static int
+wake (int fd)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	do
+		ret = write (fd, &one, sizeof(one));
+	while (ret == -1 && errno == EINTR);
+
+	return ret == sizeof(one) ? 0 : -1;
+}
+
+static void
+sintr (struct i89 *iop)
+{
+	(void)iop;
+
+	/* The host is expected to keep up; if it doesn't, the channel
+	 * can't wait for it. Count what is lost. */
+	if (push (&self->sintr_q, 0, self->cur, 0))
+		__atomic_add_fetch (&self->lost, 1, __ATOMIC_RELAXED);
+	else if (wake (self->sintr_fd))
+		abort ();	/* The counter can't get near overflowing. */
+}
+
+/* Post a message to the worker, waking it if it sleeps. */
+static int
+post (struct i89_thread *t, int msg, int ch, uint32_t arg)
+{
+	if (push (&t->attn, msg, ch, arg))
+		return -1;
+	if (__atomic_load_n (&t->sleeping, __ATOMIC_SEQ_CST))
+		return wake (t->attn_fd);
+	return 0;
+}
+
+static void
+deliver (struct i89_thread *t, int msg, int ch, uint32_t arg)
+{
+	struct i89 *iop = t->iop;
+
+	switch (msg) {
+	case MSG_ATTN:
+		i89_attn (iop, ch);
+		break;
+	case MSG_SUBMIT:
+		/* Room was checked for on the host side. */
+		i89_submit (iop, ch, arg);
+		break;
+	case MSG_DRQ:
+		i89_drq (iop, ch, arg);
+		break;
+	case MSG_PORT:
+		i89_port (iop, arg);
+		/* Only wake up a channel that polls; one that stopped
+		 * at a breakpoint stays stopped. */
+		for (ch = 0; ch < 2; ch++) {
+			if (iop->chan[ch].park)
+				t->run[ch] = 1;
+		}
+		return;
+	}
+	t->run[ch] = 1;
+}
+
+static void *
+worker (void *arg)
+{
+	struct i89_thread *t = arg;
+	uint32_t msg_arg;
+	uint64_t n;
+	ssize_t got;
+	int ch, msg, busy;
+
+	self = t;
+	while (!__atomic_load_n (&t->stop, __ATOMIC_ACQUIRE)) {
+		while ((msg = pop (&t->attn, &ch, &msg_arg)) >= 0)
+			deliver (t, msg, ch, msg_arg);
+
+		busy = 0;
+		for (ch = 0; ch < 2; ch++) {
+			if (!t->run[ch])
+				continue;
+			t->cur = ch;
+			switch (i89_run (t->iop, ch, t->flags, SLICE)) {
+			case I89_OK:
+			case I89_DMA:
+				busy = 1;
+				break;
+			default:
+				/* Halted, failed, stopped at a breakpoint or
+				 * watchpoint, or waiting for the host. */
+				t->run[ch] = 0;
+			}
+		}
+		if (busy)
+			continue;
+
+		/* Nothing to do. Announce we're going to sleep, then look
+		 * again so that a message posted meanwhile is not lost. */
+		__atomic_store_n (&t->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&t->attn.tail, __ATOMIC_SEQ_CST) == t->attn.head &&
+		    !__atomic_load_n (&t->stop, __ATOMIC_SEQ_CST)) {
+			do
+				got = read (t->attn_fd, &n, sizeof(n));
+			while (got == -1 && errno == EINTR);
+			/* Better to stop than to spin with no way to sleep. */
+			if (got != sizeof(n))
+				break;
+		}
+		__atomic_store_n (&t->sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+struct i89_thread *
+i89_thread_start (struct i89 *iop, enum i89_flags flags)
+{
+	struct i89_thread *t;
+
+	t = calloc (1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+
+	t->iop = iop;
+	t->flags = flags;
+	t->attn_fd = eventfd (0, 0);
+	t->sintr_fd = eventfd (0, EFD_NONBLOCK);
+	if (t->attn_fd == -1 || t->sintr_fd == -1)
+		goto err;
+
+	/* Nothing runs the IOP yet; put back what was there if the
+	 * worker doesn't start. */
+	t->sintr = iop->sintr;
+	iop->sintr = sintr;
+	if (pthread_create (&t->thread, NULL, worker, t)) {
+		iop->sintr = t->sintr;
+		goto err;
+	}
+
+	return t;
+err:
+	if (t->attn_fd != -1)
+		close (t->attn_fd);
+	if (t->sintr_fd != -1)
+		close (t->sintr_fd);
+	free (t);
+	return NULL;
+}
+
+int
+i89_thread_attn (struct i89_thread *t, int ch)
+{
+	return post (t, MSG_ATTN, ch, 0);
+}
+
+/*
+ * Queue a parameter block on the channel's ring. Completions are reaped
+ * with i89_reap() right from the host thread.
+ */
+
+int
+i89_thread_submit (struct i89_thread *t, int ch, uint32_t pb)
+{
+	struct i89_ring *ring = t->iop->chan[ch].ring;
+
+	if (ring == NULL)
+		return -1;
+	if (t->submitted[ch] - ring->cq_head == I89_RING_SIZE)
+		return -1;
+	if (post (t, MSG_SUBMIT, ch, pb))
+		return -1;
+	t->submitted[ch]++;
+	return 0;
+}
+
+int
+i89_thread_drq (struct i89_thread *t, int ch, int level)
+{
+	return post (t, MSG_DRQ, ch, level);
+}
+
+/* A device port changed; channels polling it run again. */
+int
+i89_thread_port (struct i89_thread *t, uint16_t port)
+{
+	return post (t, MSG_PORT, 0, port);
+}
+
+int
+i89_thread_fd (struct i89_thread *t)
+{
+	return t->sintr_fd;
+}
+
+int
+i89_thread_sintr (struct i89_thread *t)
+{
+	uint32_t arg;
+	uint64_t n;
+	int ch;
+
+	if (pop (&t->sintr_q, &ch, &arg) == -1) {
+		/* Drained; rearm the eventfd. It's nonblocking, so
+		 * nothing to read is fine. */
+		if (read (t->sintr_fd, &n, sizeof(n)) == -1 &&
+		    errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (pop (&t->sintr_q, &ch, &arg) == -1)
+			return -1;
+	}
+
+	return ch;
+}
+
+/* SINTRs dropped because the queue was full. */
+uint64_t
+i89_thread_lost (struct i89_thread *t)
+{
+	return __atomic_load_n (&t->lost, __ATOMIC_RELAXED);
+}
+
+void
+i89_thread_stop (struct i89_thread *t)
+{
+	__atomic_store_n (&t->stop, 1, __ATOMIC_SEQ_CST);
+	/* Can only fail on a counter about to overflow, which a
+	 * sleeping worker will have read down to zero. */
+	wake (t->attn_fd);
+	pthread_join (t->thread, NULL);
+
+	close (t->attn_fd);
+	close (t->sintr_fd);
+	free (t);
+}
@@ -0,0 +1,533 @@
+/*
+ * Intel 8089 I/O processor emulator and disassembler.
+ * Copyright (C) 2022  Lubomir Rintel <lkundrak@v3.sk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Worst-case execution time of channel programs.
+ *
+ * The program is decoded from each entry point into a control flow
+ * graph of instructions. Calls are analyzed as functions of their own,
+ * that end with a movp to TP. Loops are found as the back edges of a
+ * depth first search; each needs a bound on how many times it goes
+ * back. Starting with the innermost, a loop is replaced by a single node
+ * costing the longest way around it times the bound, plus the longest
+ * way out of it. What is left is acyclic and the longest path through
+ * it is the result.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "8089.h"
+
+#define MEM_SIZE	0x100000
+
+struct node {
+	uint32_t addr;
+	struct i89_decoded d;
+	int succ[2];
+	int nsucc;
+	int exit;		/* Halts or returns */
+	uint64_t cost;
+
+	/* Function, if this is its entry. */
+	int fstate;		/* 1 in progress, 2 done */
+	uint64_t fcost;
+
+	/* Loop collapsing. */
+	int rep;		/* The node this one is part of */
+	int *exits;		/* Edges out of a collapsed loop */
+	int nexits;
+	int *latch;		/* Sources of back edges, if a loop header */
+	int nlatch;
+	int64_t best[2];
+	int stamp;
+	int busy;
+	int mark;
+	int color;
+	int *pred;
+	int npred;
+};
+
+static uint8_t mem[MEM_SIZE];
+static uint32_t end;
+static int *at;
+static struct node *node;
+static int nnodes;
+static uint32_t bound[MEM_SIZE];
+static int have_bound[MEM_SIZE];
+static uint64_t xfer;
+static int sintr_ends;
+static int stamp;
+static int errors;
+
+static void *
+xrealloc (void *ptr, size_t size)
+{
+	ptr = realloc (ptr, size);
+	if (ptr == NULL) {
+		perror ("realloc");
+		exit (1);
+	}
+	return ptr;
+}
+
+static void
+append (int **list, int *n, int value)
+{
+	*list = xrealloc (*list, (*n + 1) * sizeof(**list));
+	(*list)[(*n)++] = value;
+}
+
+/* The node for the instruction at addr, decoding it if needed. */
+static int
+lookup (uint32_t addr)
+{
+	struct node *n;
+
+	if (at[addr])
+		return at[addr] - 1;
+
+	node = xrealloc (node, (nnodes + 1) * sizeof(*node));
+	n = &node[nnodes];
+	memset (n, 0, sizeof(*n));
+	n->addr = addr;
+	n->nsucc = 0;
+	if (addr >= end || i89_decode (&mem[addr], end - addr, addr, &n->d) == 0) {
+		fprintf (stderr, "Bad instruction at 0x%05x\n", addr);
+		errors++;
+		n->exit = 1;
+	}
+	at[addr] = ++nnodes;
+
+	return nnodes - 1;
+}
+
+static void
+edges (int i)
+{
+	struct node *n = &node[i];
+	uint32_t next = n->addr + n->d.len;
+	int s;
+
+	/* Already done, possibly from another function. */
+	if (n->exit || n->nsucc)
+		return;
+
+	switch (n->d.flow) {
+	case I89_FLOW_NEXT:
+	case I89_FLOW_CALL:
+		if (sintr_ends && n->d.insn == 0x0040) {
+			n->exit = 1;
+			return;
+		}
+		s = lookup (next);
+		node[i].succ[node[i].nsucc++] = s;
+		break;
+	case I89_FLOW_BRANCH:
+		s = lookup (node[i].d.target);
+		node[i].succ[node[i].nsucc++] = s;
+		s = lookup (next);
+		node[i].succ[node[i].nsucc++] = s;
+		break;
+	case I89_FLOW_JUMP:
+		s = lookup (node[i].d.target);
+		node[i].succ[node[i].nsucc++] = s;
+		break;
+	case I89_FLOW_RETURN:
+	case I89_FLOW_HALT:
+		n->exit = 1;
+		break;
+	case I89_FLOW_INDIRECT:
+		fprintf (stderr, "Computed jump at 0x%05x\n", n->addr);
+		errors++;
+		n->exit = 1;
+		break;
+	}
+}
+
+static int
+rep (int i)
+{
+	return node[i].rep;
+}
+
+/*
+ * Longest way from the node to taking a back edge to the header (kind
+ * 0) or out of the loop (kind 1), -1 if there's none. A negative header
+ * stands for the whole function.
+ */
+
+static int64_t
+best (int i, int kind, int header, int loop)
+{
+	struct node *n = &node[i];
+	int64_t v = -1, t;
+	int *succ = n->exits ? n->exits : n->succ;
+	int nsucc = n->exits ? n->nexits : n->nsucc;
+	int j, s;
+
+	if (n->stamp == loop && n->best[kind] != -2)
+		return n->best[kind];
+	if (n->stamp != loop) {
+		n->stamp = loop;
+		n->best[0] = n->best[1] = -2;
+	}
+	if (n->busy) {
+		fprintf (stderr, "Irreducible loop at 0x%05x\n", n->addr);
+		errors++;
+		return -1;
+	}
+
+	n->busy = 1;
+	if (n->exit && kind == 1)
+		v = 0;
+	for (j = 0; j < nsucc; j++) {
+		s = rep (succ[j]);
+		if (s == header) {
+			if (kind == 0 && v < 0)
+				v = 0;
+		} else if (node[s].mark == loop) {
+			t = best (s, kind, header, loop);
+			if (t > v)
+				v = t;
+		} else if (kind == 1 && v < 0) {
+			v = 0;
+		}
+	}
+	n->busy = 0;
+
+	n = &node[i];
+	n->best[kind] = v < 0 ? -1 : (int64_t)n->cost + v;
+	return n->best[kind];
+}
+
+static int
+by_size (const void *a, const void *b)
+{
+	return node[*(const int *)a].npred - node[*(const int *)b].npred;
+}
+
+static void
+loops (int *fn)
+{
+	int *stack = NULL, nstack = 0;
+	int *body = NULL, nbody;
+	int *headers = NULL, nheaders = 0;
+	int i, j, k, h, u, s, loop;
+	int64_t back, out;
+
+	/* Find the back edges. */
+	append (&stack, &nstack, fn[0]);
+	while (nstack) {
+		u = stack[nstack - 1];
+		if (node[u].color == 0) {
+			node[u].color = 1;
+			for (j = 0; j < node[u].nsucc; j++) {
+				s = node[u].succ[j];
+				if (node[s].color == 1) {
+					if (node[s].nlatch == 0)
+						append (&headers, &nheaders, s);
+					append (&node[s].latch, &node[s].nlatch, u);
+				} else if (node[s].color == 0) {
+					append (&stack, &nstack, s);
+				}
+			}
+		} else {
+			if (node[u].color == 1)
+				node[u].color = 2;
+			nstack--;
+		}
+	}
+
+	/* Natural loop bodies: what reaches a back edge without going
+	 * through the header. Kept in the header's pred list once all of
+	 * them are found. */
+	for (k = 0; k < nheaders; k++) {
+		h = headers[k];
+		loop = ++stamp;
+		nbody = 0;
+		node[h].mark = loop;
+		append (&body, &nbody, h);
+		for (i = 0; i < node[h].nlatch; i++) {
+			u = node[h].latch[i];
+			if (node[u].mark != loop) {
+				node[u].mark = loop;
+				append (&body, &nbody, u);
+			}
+		}
+		for (i = 1; i < nbody; i++) {
+			for (j = 0; j < node[body[i]].npred; j++) {
+				u = node[body[i]].pred[j];
+				if (node[u].mark != loop) {
+					node[u].mark = loop;
+					append (&body, &nbody, u);
+				}
+			}
+		}
+		node[h].exits = body;
+		node[h].nexits = nbody;
+		body = NULL;
+	}
+	for (k = 0; k < nheaders; k++) {
+		h = headers[k];
+		free (node[h].pred);
+		node[h].pred = node[h].exits;
+		node[h].npred = node[h].nexits;
+		node[h].exits = NULL;
+		node[h].nexits = 0;
+	}
+
+	for (k = 0; k < nheaders; k++) {
+		h = headers[k];
+		if (!have_bound[node[h].addr]) {
+			fprintf (stderr, "Loop at 0x%05x needs a bound\n", node[h].addr);
+			errors++;
+		}
+	}
+	if (errors)
+		nheaders = 0;
+
+	/* Innermost first. */
+	qsort (headers, nheaders, sizeof(*headers), by_size);
+	for (k = 0; k < nheaders; k++) {
+		h = headers[k];
+
+		loop = ++stamp;
+		for (i = 0; i < node[h].npred; i++)
+			node[rep (node[h].pred[i])].mark = loop;
+
+		back = best (h, 0, h, loop);
+		out = best (h, 1, h, loop);
+		if (out < 0) {
+			fprintf (stderr, "Loop at 0x%05x doesn't end\n", node[h].addr);
+			errors++;
+			continue;
+		}
+		if (back < 0)
+			back = 0;
+
+		/* Collapse it into the header. */
+		body = NULL;
+		nbody = 0;
+		for (i = 0; i < node[h].npred; i++) {
+			u = node[h].pred[i];
+			if (node[u].exit)
+				node[h].exit = 1;
+			if (rep (u) != u)
+				continue;
+			for (j = 0; j < (node[u].exits ? node[u].nexits : node[u].nsucc); j++) {
+				s = node[u].exits ? node[u].exits[j] : node[u].succ[j];
+				if (node[rep (s)].mark != loop)
+					append (&body, &nbody, s);
+			}
+		}
+		for (i = 0; i < node[h].npred; i++) {
+			u = node[h].pred[i];
+			if (u != h && rep (u) == u && node[u].exits) {
+				free (node[u].exits);
+				node[u].exits = NULL;
+			}
+			node[u].rep = h;
+		}
+		free (node[h].exits);
+		node[h].exits = body ? body : xrealloc (NULL, sizeof(int));
+		node[h].nexits = nbody;
+		node[h].cost = bound[node[h].addr] * back + out;
+	}
+
+	free (stack);
+	free (headers);
+}
+
+/* Worst case from the entry to a halt or a return. */
+static uint64_t
+function (int entry)
+{
+	int *fn = NULL, nfn = 0;
+	int i, j, s, loop;
+	int64_t v;
+
+	if (node[entry].fstate == 2)
+		return node[entry].fcost;
+	if (node[entry].fstate == 1) {
+		fprintf (stderr, "Recursive call to 0x%05x\n", node[entry].addr);
+		errors++;
+		return 0;
+	}
+	node[entry].fstate = 1;
+
+	/* What is reachable without following calls. */
+	loop = ++stamp;
+	node[entry].mark = loop;
+	append (&fn, &nfn, entry);
+	for (i = 0; i < nfn; i++) {
+		edges (fn[i]);
+		for (j = 0; j < node[fn[i]].nsucc; j++) {
+			s = node[fn[i]].succ[j];
+			if (node[s].mark != loop) {
+				node[s].mark = loop;
+				append (&fn, &nfn, s);
+			}
+		}
+	}
+
+	/* Callees first, they use the same nodes. */
+	for (i = 0; i < nfn; i++) {
+		if (node[fn[i]].d.flow == I89_FLOW_CALL && !node[fn[i]].exit)
+			function (lookup (node[fn[i]].d.target));
+	}
+
+	for (i = 0; i < nfn; i++) {
+		s = fn[i];
+		node[s].rep = s;
+		node[s].color = 0;
+		free (node[s].latch);
+		node[s].latch = NULL;
+		node[s].nlatch = 0;
+		free (node[s].exits);
+		node[s].exits = NULL;
+		node[s].nexits = 0;
+		free (node[s].pred);
+		node[s].pred = NULL;
+		node[s].npred = 0;
+		node[s].cost = node[s].d.clocks;
+		if (node[s].d.flow == I89_FLOW_CALL && !node[s].exit)
+			node[s].cost += node[at[node[s].d.target] - 1].fcost;
+		if (node[s].d.insn == 0x0060)
+			node[s].cost += xfer;
+	}
+	for (i = 0; i < nfn; i++) {
+		for (j = 0; j < node[fn[i]].nsucc; j++) {
+			s = node[fn[i]].succ[j];
+			append (&node[s].pred, &node[s].npred, fn[i]);
+		}
+	}
+
+	loops (fn);
+	if (errors) {
+		free (fn);
+		return 0;
+	}
+
+	loop = ++stamp;
+	for (i = 0; i < nfn; i++)
+		node[fn[i]].mark = loop;
+	v = best (rep (entry), 1, -1, loop);
+	if (v < 0) {
+		fprintf (stderr, "No way out from 0x%05x\n", node[entry].addr);
+		errors++;
+		v = 0;
+	}
+
+	free (fn);
+	node[entry].fstate = 2;
+	node[entry].fcost = v;
+	return v;
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr, "Usage: %s [-s] [-x <clocks>] [-e <entry>]... "
+		"[-b <loop>=<bound>]... [<iop.bin>]\n", argv0);
+}
+
+int
+main (int argc, char *argv[])
+{
+	uint32_t entry[64];
+	int nentries = 0;
+	unsigned long addr, n;
+	char *p;
+	int br;
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt (argc, argv, "b:e:sx:")) != -1) {
+		switch (opt) {
+		case 'b':
+			addr = strtoul (optarg, &p, 0);
+			if (*p != '=' || addr >= MEM_SIZE) {
+				usage (argv[0]);
+				return 1;
+			}
+			n = strtoul (p + 1, NULL, 0);
+			bound[addr] = n;
+			have_bound[addr] = 1;
+			break;
+		case 'e':
+			if (nentries == sizeof(entry) / sizeof(entry[0])) {
+				usage (argv[0]);
+				return 1;
+			}
+			entry[nentries++] = strtoul (optarg, NULL, 0) % MEM_SIZE;
+			break;
+		case 's':
+			sintr_ends = 1;
+			break;
+		case 'x':
+			xfer = strtoull (optarg, NULL, 0);
+			break;
+		default:
+			usage (argv[0]);
+			return 1;
+		}
+	}
+
+	switch (argc - optind) {
+	case 0:
+		fd = STDIN_FILENO;
+		break;
+	case 1:
+		fd = open (argv[optind], O_RDONLY);
+		if (fd == -1) {
+			perror (argv[optind]);
+			return 1;
+		}
+		break;
+	default:
+		usage (argv[0]);
+		return 1;
+	}
+
+	do {
+		br = read (fd, &mem[end], sizeof(mem) - end);
+		if (br == -1) {
+			perror (argv[optind]);
+			return 1;
+		}
+		end += br;
+	} while (br);
+
+	at = calloc (MEM_SIZE, sizeof(*at));
+	if (at == NULL) {
+		perror ("calloc");
+		return 1;
+	}
+
+	if (nentries == 0)
+		entry[nentries++] = 0;
+	for (i = 0; i < nentries; i++) {
+		n = function (lookup (entry[i]));
+		if (errors)
+			return 1;
+		printf ("0x%05x: %lu clocks\n", entry[i], n);
+	}
+
+	return 0;
+}